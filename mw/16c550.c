@@ -5,9 +5,10 @@ UartShadow sh;
 
 void uart_init(void) {
 	// Set line to BR,8N1. LCR[7] must be set to access DLX registers
-	UART_LCR = 0x83;
-	UART_DLM = UART_DLM_VAL;
-	UART_DLL = UART_DLL_VAL;
+	UART_WR(LCR, 0x83);
+	UART_WR(DLM, UART_DLM_VAL);
+	UART_WR(DLL, UART_DLL_VAL);
+	sh.DL = UART_DIV(UART_BR);
 	uart_set(LCR, 0x03);
 
 	// Enable auto RTS/CTS.
@@ -17,7 +18,7 @@ void uart_init(void) {
 	// NOTE: Even though trigger level is 14 bytes, RTS is de-asserted when
 	// receiving the first bit of the 16th byte entering the FIFO. See Fig. 9
 	// of the SC16C550B datasheet.
-	UART_FCR = 0xC1;
+	UART_WR(FCR, 0xC1);
 	// Reset FIFOs
 	uart_set(FCR, 0xC7);
 
@@ -29,3 +30,18 @@ void uart_init(void) {
 	// (shame on Masami Ishikawa for not including a single interrupt line!).
 }
 
+
+void uart_divisor_set(uint16_t div) {
+	// Wait until the transmitter is completely empty
+	while (!(UART_RD(LSR) & UART_LSR__TEMT));
+
+	// LCR[7] must be set to access DLX registers
+	UART_WR(LCR, sh.LCR | 0x80);
+	UART_WR(DLM, div>>8);
+	UART_WR(DLL, div & 0xFF);
+	UART_WR(LCR, sh.LCR);
+	sh.DL = div;
+
+	// Drop anything received at the previous rate
+	uart_reset_fifos();
+}
@@ -31,13 +31,60 @@
 
 /// Division with one bit rounding, useful for divisor calculations.
 #define DivWithRounding(dividend, divisor)	((((dividend)*2/(divisor))+1)/2)
+/// Divisor for the specified baud rate
+#define UART_DIV(br)	DivWithRounding(UART_CLK, 16 * (br))
+
+/// Baud rate obtained with the specified divisor
+#define UART_DIV_TO_BR(div)	(UART_CLK / 16 / (div))
+
 /// Value to load on the UART divisor, high byte
-#define UART_DLM_VAL	(DivWithRounding(UART_CLK, 16 * UART_BR)>>8)
+#define UART_DLM_VAL	(UART_DIV(UART_BR)>>8)
 //#define UART_DLM_VAL	((UART_CLK/16/UART_BR)>>8)
 /// Value to load on the UART divisor, low byte
-#define UART_DLL_VAL	(DivWithRounding(UART_CLK, 16 * UART_BR) & 0xFF)
+#define UART_DLL_VAL	(UART_DIV(UART_BR) & 0xFF)
 //#define UART_DLL_VAL	((UART_CLK/16/UART_BR)&0xFF)
 
+/** \addtogroup UartRegOffs UartRegOffs
+ *  \brief Offsets of the 16C550 UART registers from UART_BASE
+ *  \{
+ */
+#define UART_RHR_OFF	 0	///< Receiver holding register
+#define UART_THR_OFF	 0	///< Transmit holding register
+#define UART_IER_OFF	 2	///< Interrupt enable register
+#define UART_FCR_OFF	 4	///< FIFO control register
+#define UART_ISR_OFF	 4	///< Interrupt status register
+#define UART_LCR_OFF	 6	///< Line control register
+#define UART_MCR_OFF	 8	///< Modem control register
+#define UART_LSR_OFF	10	///< Line status register
+#define UART_MSR_OFF	12	///< Modem status register
+#define UART_SPR_OFF	14	///< Scratchpad register
+#define UART_DLL_OFF	 0	///< Divisor latch LSB
+#define UART_DLM_OFF	 2	///< Divisor latch MSB
+/** \} */
+
+#ifdef MW_HOST
+/************************************************************************//**
+ * \brief Reads a UART register from the host backend (mw/host).
+ *
+ * \param[in] off Register offset from UART_BASE.
+ *
+ * \return The register value.
+ ****************************************************************************/
+uint8_t uart_host_read(uint8_t off);
+
+/************************************************************************//**
+ * \brief Writes a UART register to the host backend (mw/host).
+ *
+ * \param[in] off Register offset from UART_BASE.
+ * \param[in] val Value to write.
+ ****************************************************************************/
+void uart_host_write(uint8_t off, uint8_t val);
+
+/// Reads a UART register
+#define UART_RD(reg)		uart_host_read(UART_##reg##_OFF)
+/// Writes a UART register
+#define UART_WR(reg, val)	uart_host_write(UART_##reg##_OFF, (val))
+#else
 /** \addtogroup UartRegs UartRegs
  *  \brief 16C550 UART registers
  *  \note Do NOT access IER, FCR, LCR and MCR directly, use Set/Get functions.
@@ -46,37 +93,44 @@
  *  \{
  */
 /// Receiver holding register. Read only.
-#define UART_RHR	(*((volatile uint8_t*)(UART_BASE +  0)))
+#define UART_RHR	(*((volatile uint8_t*)(UART_BASE + UART_RHR_OFF)))
 /// Transmit holding register. Write only.
-#define UART_THR	(*((volatile uint8_t*)(UART_BASE +  0)))
+#define UART_THR	(*((volatile uint8_t*)(UART_BASE + UART_THR_OFF)))
 /// Interrupt enable register. Write only.
-#define UART_IER	(*((volatile uint8_t*)(UART_BASE +  2)))
+#define UART_IER	(*((volatile uint8_t*)(UART_BASE + UART_IER_OFF)))
 /// FIFO control register. Write only.
-#define UART_FCR	(*((volatile uint8_t*)(UART_BASE +  4)))
+#define UART_FCR	(*((volatile uint8_t*)(UART_BASE + UART_FCR_OFF)))
 /// Interrupt status register. Read only.
-#define UART_ISR	(*((volatile uint8_t*)(UART_BASE +  4)))
+#define UART_ISR	(*((volatile uint8_t*)(UART_BASE + UART_ISR_OFF)))
 /// Line control register. Write only.
-#define UART_LCR	(*((volatile uint8_t*)(UART_BASE +  6)))
+#define UART_LCR	(*((volatile uint8_t*)(UART_BASE + UART_LCR_OFF)))
 /// Modem control register. Write only.
-#define UART_MCR	(*((volatile uint8_t*)(UART_BASE +  8)))
+#define UART_MCR	(*((volatile uint8_t*)(UART_BASE + UART_MCR_OFF)))
 /// Line status register. Read only.
-#define UART_LSR	(*((volatile uint8_t*)(UART_BASE + 10)))
+#define UART_LSR	(*((volatile uint8_t*)(UART_BASE + UART_LSR_OFF)))
 /// Modem status register. Read only.
-#define UART_MSR	(*((volatile uint8_t*)(UART_BASE + 12)))
+#define UART_MSR	(*((volatile uint8_t*)(UART_BASE + UART_MSR_OFF)))
 /// Scratchpad register.
-#define UART_SPR	(*((volatile uint8_t*)(UART_BASE + 14)))
+#define UART_SPR	(*((volatile uint8_t*)(UART_BASE + UART_SPR_OFF)))
 /// Divisor latch LSB. Acessed only when LCR[7] = 1.
-#define UART_DLL	(*((volatile uint8_t*)(UART_BASE +  0)))
+#define UART_DLL	(*((volatile uint8_t*)(UART_BASE + UART_DLL_OFF)))
 /// Divisor latch MSB. Acessed only when LCR[7] = 1.
-#define UART_DLM	(*((volatile uint8_t*)(UART_BASE +  2)))
+#define UART_DLM	(*((volatile uint8_t*)(UART_BASE + UART_DLM_OFF)))
 /** \} */
 
+/// Reads a UART register
+#define UART_RD(reg)		(UART_##reg)
+/// Writes a UART register
+#define UART_WR(reg, val)	do{UART_##reg = (val);}while(0)
+#endif
+
 /// Structure with the shadow registers.
 typedef struct {
 	uint8_t IER;	///< Interrupt Enable Register
 	uint8_t FCR;	///< FIFO Control Register
 	uint8_t LCR;	///< Line Control Register
 	uint8_t MCR;	///< Modem Control Register
+	uint16_t DL;	///< Divisor Latch
 } UartShadow;
 
 /// Uart shadow registers. Do NOT access directly!
@@ -92,6 +146,15 @@ extern UartShadow sh;
 #define UART_MCR__OUT2		0x08	///< GPIO pin 2.
 /** \} */
 
+/** \addtogroup UartLineStat UartLineStat
+ *  \brief Bits of the LSR UART register.
+ *  \{ */
+#define UART_LSR__DR		0x01	///< Data Ready.
+#define UART_LSR__OE		0x02	///< Overrun Error.
+#define UART_LSR__THRE		0x20	///< Transmit Holding Register Empty.
+#define UART_LSR__TEMT		0x40	///< Transmitter Empty.
+/** \} */
+
 /** \addtogroup UartIns UartIns
  *  \brief Input pins readed in the MSR UART register.
  *  \{ */
@@ -105,20 +168,44 @@ extern UartShadow sh;
  ****************************************************************************/
 void uart_init(void);
 
+/************************************************************************//**
+ * \brief Sets the baud rate divisor. FIFOs are reset, so make sure there is
+ *        no data being sent or received.
+ *
+ * \param[in] div Divisor to set. Baud rate will be UART_DIV_TO_BR(div).
+ ****************************************************************************/
+void uart_divisor_set(uint16_t div);
+
+/************************************************************************//**
+ * \brief Gets the baud rate divisor currently in use.
+ *
+ * \return The baud rate divisor.
+ ****************************************************************************/
+#define uart_divisor_get()	(sh.DL)
+
 /************************************************************************//**
  * \brief Checks if UART transmit register/FIFO is ready. In FIFO mode, up to
  *        16 characters can be loaded each time transmitter is ready.
  *
  * \return TRUE if transmitter is ready, FALSE otherwise.
  ****************************************************************************/
-#define uart_tx_ready()	(UART_LSR & 0x20)
+#define uart_tx_ready()	(UART_RD(LSR) & UART_LSR__THRE)
 
 /************************************************************************//**
  * \brief Checks if UART receive register/FIFO has data available.
  *
  * \return TRUE if at least 1 byte is available, FALSE otherwise.
  ****************************************************************************/
-#define uart_rx_ready()	(UART_LSR & 0x01)
+#define uart_rx_ready()	(UART_RD(LSR) & UART_LSR__DR)
+
+/************************************************************************//**
+ * \brief Checks if the receiver has overrun. The flag is cleared by any
+ *        Line Status Register read, including the ones done by
+ *        uart_rx_ready() and uart_tx_ready().
+ *
+ * \return TRUE if an overrun was flagged since the previous LSR read.
+ ****************************************************************************/
+#define uart_overrun()	(UART_RD(LSR) & UART_LSR__OE)
 
 /************************************************************************//**
  * \brief Sends a character. Please make sure there is room in the transmit
@@ -126,7 +213,7 @@ void uart_init(void);
  *
  * \return Received character.
  ****************************************************************************/
-#define uart_putc(c)		do{UART_RHR = (c);}while(0);
+#define uart_putc(c)		UART_WR(THR, c);
 
 /************************************************************************//**
  * \brief Returns a received character. Please make sure data is available by
@@ -134,7 +221,7 @@ void uart_init(void);
  *
  * \return Received character.
  ****************************************************************************/
-#define uart_getc()		(UART_RHR)
+#define uart_getc()		UART_RD(RHR)
 
 /************************************************************************//**
  * \brief Sets a value in IER, FCR, LCR or MCR register.
@@ -142,7 +229,7 @@ void uart_init(void);
  * \param[in] reg Register to modify (IER, FCR, LCR or MCR).
  * \param[in] val Value to set in IER, FCR, LCR or MCR register.
  ****************************************************************************/
-#define uart_set(reg, val)	do{sh.reg = (val);UART_##reg = (val);}while(0)
+#define uart_set(reg, val)	do{sh.reg = (val);UART_WR(reg, val);}while(0)
 
 /************************************************************************//**
  * \brief Gets value of IER, FCR, LCR or MCR register.
@@ -159,7 +246,7 @@ void uart_init(void);
  * \param[in] val Bits set in val, will be set in reg register.
  ****************************************************************************/
 #define uart_set_bits(reg, val)	do{sh.reg |= (val);			\
-	UART_##reg = sh.reg;}while(0)
+	UART_WR(reg, sh.reg);}while(0)
 
 /************************************************************************//**
  * \brief Clears bits in IER, FCR, LCR or MCR register.
@@ -168,7 +255,7 @@ void uart_init(void);
  * \param[in] val Bits set in val, will be cleared in reg register.
  ****************************************************************************/
 #define uart_clr_bits(reg, val)	do{sh.reg &= ~(val);			\
-	UART_##reg = sh.reg;}while(0)
+	UART_WR(reg, sh.reg);}while(0)
 
 /************************************************************************//**
  * \brief Reset TX and RX FIFOs.
@@ -7,6 +7,7 @@
 #include <string.h>
 #include "megawifi.h"
 #include "gamejolt.h"
+#include "reader.h"
 
 // Macro to fill optional parameters for requests
 #define FILL_OPTION(key, value, index, item) \
@@ -30,7 +31,7 @@ enum boolean {
 	BOOL_TRUE  =  1
 };
 
-struct {
+MW_STATE struct {
 	char *buf;
 	uint16_t buf_len;
 	uint16_t tout_frames;
@@ -124,37 +125,34 @@ bool gj_init(const char *endpoint, const char *game_id, const char *private_key,
 	return false;
 }
 
-char *gj_recv(uint32_t *len, uint16_t tout_frames)
+// Reply is received straight into the buffer. Length is unknown (INT32_MAX)
+// for chunked replies (GameJolt uses them): the module decodes them and marks
+// the end of the body with an empty frame. Replies not fitting are drained,
+// so they do not reach the next request.
+static char *gj_recv(struct mw_reader *r, uint32_t *len, uint16_t tout_frames)
 {
-	uint16_t pos = 0;
-	int16_t buf_len;
-	uint8_t ch = MW_HTTP_CH;
+	enum mw_http_body type = MW_HTTP_BODY_LENGTH;
+	enum mw_err err = MW_ERR_BUFFER_TOO_SHORT;
+	uint16_t body_len = *len;
+	char *body;
 
-	// Note:
-	// Reception from GameJolt is a bit problematic on embedded devices,
-	// because data is sent using chunked transfers, and esp_http_client
-	// does not allow retrieving in advance the length of each data chunk.
-	if (*len > (uint32_t)(gj.buf_len - 1)) {
-		return NULL;
+	if (INT32_MAX == *len) {
+		type = MW_HTTP_BODY_CLOSE;
+		err = mw_read_to_end(r, &body, &body_len, tout_frames);
+	} else if (*len < gj.buf_len) {
+		err = mw_read_exact(r, body_len, &body, tout_frames);
 	}
-
-	while (pos < *len) {
-		buf_len = gj.buf_len - pos;
-		if (MW_ERR_NONE != mw_recv_sync(&ch, gj.buf + pos,
-					&buf_len, tout_frames)) {
-			return NULL;
-		}
-		if (0 == buf_len) {
-			// Server closed the connection
-			break;
-		}
-		pos += buf_len;
+	if (MW_ERR_BUFFER_TOO_SHORT == err) {
+		mw_http_body_read(r, type, *len, NULL, NULL, tout_frames);
+	}
+	if (err) {
+		return NULL;
 	}
 
-	gj.buf[pos++] = '\0';
-	*len = pos;
+	body[body_len++] = '\0';
+	*len = body_len;
 
-	return gj.buf;
+	return body;
 }
 
 enum gj_error gj_get_error(void)
@@ -165,28 +163,31 @@ enum gj_error gj_get_error(void)
 char *gj_request(const char **path, uint8_t num_paths, const char **key,
 		const char **value, uint8_t num_kv_pairs, uint32_t *out_len)
 {
+	struct mw_reader r;
 	char *reply;
 	int status;
 
 	gj.error = GJ_ERR_NONE;
+	// Posted before the request, so the reply does not wait for it
+	if (mw_reader_init(&r, MW_HTTP_CH, gj.buf, gj.buf_len)) {
+		gj.error = GJ_ERR_PARAM;
+		return NULL;
+	}
 	status = mw_ga_request(MW_HTTP_METHOD_GET, path, num_paths, key,
 			value, num_kv_pairs, out_len, gj.tout_frames);
 
 	if (status < 100) {
+		mw_reader_free(&r);
 		gj.error = GJ_ERR_REQUEST;
 		return NULL;
 	}
+
+	reply = gj_recv(&r, out_len, gj.tout_frames);
+	mw_reader_free(&r);
 	if (status < 200 || status >= 300) {
 		gj.error = status;
 		return NULL;
 	}
-	// If chunked response, limit to the buffer length minus 1
-	// character for proper string termination
-	if (INT32_MAX == *out_len) {
-		*out_len = gj.buf_len - 1U;
-	}
-
-	reply = gj_recv(out_len, gj.tout_frames);
 	if (reply) {
 		enum boolean success;
 		char *aux = key_bool_get(reply, "success", &success);
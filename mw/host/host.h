@@ -0,0 +1,95 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Host backend, to build the API natively on Linux.
+ *
+ * \defgroup host host
+ * \{
+ *
+ * \brief Host backend, to build the API natively on Linux.
+ *
+ * Building with MW_HOST defined replaces the console hardware used by the
+ * API: UART register accesses go to a 16C550 model connected to a file
+ * descriptor (a pty such as the one created by tools/mw_virt.py, a
+ * socketpair, etc.), the tasking routines in tsk.h run on top of ucontext,
+ * and the VDP counters are derived from the host clock. VBLANK interrupts
+ * are raised once per frame, when the UART registers are accessed.
+ *
+ * Command fields are converted to the big endian order of the console, so
+ * the module sees the same bytes real carts send. Data sent to channels is
+ * not converted: the mw_reuse_payload port must be written big endian.
+ ****************************************************************************/
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdint.h>
+
+/// Scanline counter, used by the LSD budgeted processing
+#define VDP_V_COUNT_B	host_v_count()
+/// H/V counter, used by the LSD capture
+#define VDP_HV_COUNT_W	host_hv_count()
+
+/************************************************************************//**
+ * \brief Opens a tty (or pty) and connects it to the UART.
+ *
+ * \param[in] path Path to the tty device.
+ *
+ * \return 0 on success, -1 on error (with errno set).
+ ****************************************************************************/
+int uart_host_open(const char *path);
+
+/************************************************************************//**
+ * \brief Connects a file descriptor (e.g. a socketpair end) to the UART.
+ * The descriptor is set to non-blocking mode.
+ *
+ * \param[in] fd File descriptor to use, or -1 to disconnect.
+ ****************************************************************************/
+void uart_host_fd_set(int fd);
+
+/************************************************************************//**
+ * \brief Enables limiting the data rate to the baud rate the UART is set to.
+ * When disabled (the default), data moves as fast as the host allows.
+ *
+ * \param[in] enable Set to non-zero to pace the data rate.
+ ****************************************************************************/
+void uart_host_pace_set(int enable);
+
+/************************************************************************//**
+ * \brief Raises the VBLANK interrupt if a frame has elapsed. Called from the
+ * UART register accesses, can also be called from code not using the UART.
+ ****************************************************************************/
+void host_vint_poll(void);
+
+/************************************************************************//**
+ * \brief Sleeps until there is data in the line or the next VBLANK is due,
+ * raising it in the latter case. Use it in the user task after mw_process(),
+ * so idle instances do not spin.
+ ****************************************************************************/
+void host_idle(void);
+
+/************************************************************************//**
+ * \brief Waits for the UART to need servicing: received data, room to send
+ * the TX FIFO contents, or the timeout expiring. Used by host_idle().
+ *
+ * \param[in] max_ns Maximum time to wait, in nanoseconds.
+ ****************************************************************************/
+void uart_host_wait(int64_t max_ns);
+
+/************************************************************************//**
+ * \brief Returns the emulated scanline counter.
+ *
+ * \return Scanline counter, as read from the VDP.
+ ****************************************************************************/
+uint8_t host_v_count(void);
+
+/************************************************************************//**
+ * \brief Returns the emulated H/V counter.
+ *
+ * \return H/V counter, as read from the VDP.
+ ****************************************************************************/
+uint16_t host_hv_count(void);
+
+#endif /*_HOST_H_*/
+
+/** \} */
@@ -0,0 +1,172 @@
+/************************************************************************//**
+ * \brief Host implementation of the tasking routines and frame timing.
+ *
+ * The supervisor task runs on the calling thread, and the user task on its
+ * own ucontext. Context switches happen at the same points sega.s does them:
+ * when the supervisor pends or yields, when the user task posts with a
+ * forced switch, and on VBLANK, raised from host_vint_poll() once per frame
+ * of host time. All the state is per thread (see MW_STATE in util.h), so each
+ * thread runs its own pair of tasks.
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include "../tsk.h"
+#include "../util.h"
+#include "host.h"
+
+/// Length of the user task stack
+#define TSK_USER_STACK_LEN	(64 * 1024)
+
+/// Frame period, in nanoseconds
+#define FRAME_NS		(1000000000LL / FPS)
+/// Scanlines per frame
+#define FRAME_LINES		262
+/// Scanline period, in nanoseconds
+#define LINE_NS			(FRAME_NS / FRAME_LINES)
+/// First scanline of the vertical blanking, where VBLANK is raised
+#define VBLANK_LINE		224
+
+static MW_STATE struct {
+	ucontext_t super;		///< Supervisor task context
+	ucontext_t user;		///< User task context
+	void (*user_tsk)(void);		///< User task entry point
+	void (*vint_cb)(void);		///< VBLANK callback
+	int64_t next_vint;		///< Time of the next VBLANK
+	int16_t lock;			///< Supervisor lock, frames to timeout
+	uint8_t in_user;		///< User task running
+	uint8_t in_vint;		///< Running the VBLANK callback
+	uint8_t tout;			///< Value returned by tsk_super_pend()
+	uint8_t *stack;			///< User task stack
+} t;
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// Nanoseconds since the last VBLANK
+static int64_t frame_pos(void)
+{
+	int64_t pos;
+
+	if (!t.next_vint) {
+		t.next_vint = now_ns() + FRAME_NS;
+	}
+	pos = FRAME_NS - (t.next_vint - now_ns());
+
+	return pos < 0 ? 0 : pos % FRAME_NS;
+}
+
+uint8_t host_v_count(void)
+{
+	return (frame_pos() * FRAME_LINES / FRAME_NS + VBLANK_LINE) %
+		FRAME_LINES;
+}
+
+uint16_t host_hv_count(void)
+{
+	return (host_v_count()<<8) | ((frame_pos() % LINE_NS) * 256 / LINE_NS);
+}
+
+static int to_user(void)
+{
+	t.in_user = TRUE;
+	swapcontext(&t.super, &t.user);
+	t.in_user = FALSE;
+
+	return t.tout;
+}
+
+static void to_super(int tout)
+{
+	t.tout = tout;
+	t.in_user = FALSE;
+	swapcontext(&t.user, &t.super);
+	t.in_user = TRUE;
+}
+
+static void user_entry(void)
+{
+	t.user_tsk();
+
+	// Returning from the user task is not allowed, idle until VBLANK
+	while (1) {
+		host_vint_poll();
+	}
+}
+
+void host_vint_poll(void)
+{
+	int64_t now = now_ns();
+
+	if (t.in_vint || (t.next_vint && now < t.next_vint)) {
+		return;
+	}
+	// Frames lost while the host was busy are not replayed
+	t.next_vint = (t.next_vint && now - t.next_vint < FRAME_NS) ?
+		t.next_vint + FRAME_NS : now + FRAME_NS;
+
+	if (t.vint_cb) {
+		t.in_vint = TRUE;
+		t.vint_cb();
+		t.in_vint = FALSE;
+	}
+	if (!t.in_user || t.lock < 0) {
+		return;
+	}
+	if (!t.lock) {
+		to_super(FALSE);
+	} else if (!--t.lock) {
+		to_super(TRUE);
+	}
+}
+
+void host_idle(void)
+{
+	uart_host_wait(t.next_vint - now_ns());
+	host_vint_poll();
+}
+
+void vint_cb_set(void (*vint_cb)(void))
+{
+	t.vint_cb = vint_cb;
+}
+
+void tsk_user_set(void (*user_tsk)(void))
+{
+	if (!t.stack) {
+		// Allocated on first use, and kept for the life of the thread
+		t.stack = malloc(TSK_USER_STACK_LEN);
+	}
+	t.user_tsk = user_tsk;
+	getcontext(&t.user);
+	t.user.uc_stack.ss_sp = t.stack;
+	t.user.uc_stack.ss_size = TSK_USER_STACK_LEN;
+	t.user.uc_link = NULL;
+	makecontext(&t.user, user_entry, 0);
+}
+
+void tsk_user_yield(void)
+{
+	to_user();
+}
+
+bool tsk_super_pend(int16_t wait_tout)
+{
+	t.lock = wait_tout;
+
+	return to_user();
+}
+
+void tsk_super_post(bool force_ctx_sw)
+{
+	t.lock = 0;
+	if (force_ctx_sw && t.in_user) {
+		to_super(FALSE);
+	}
+}
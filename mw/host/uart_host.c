@@ -0,0 +1,281 @@
+/************************************************************************//**
+ * \brief Host 16C550 UART model.
+ *
+ * Models the registers used by the driver and the 16 byte FIFOs. The line
+ * is a file descriptor: bytes in the TX FIFO are written to it, and the RX
+ * FIFO is filled from it, when the line status is read. Data not fitting
+ * in the RX FIFO stays in the descriptor, as it would with RTS/CTS flow
+ * control.
+ ****************************************************************************/
+
+// Needed for ppoll()
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "../16c550.h"
+#include "../util.h"
+#include "host.h"
+
+/// Length of the FIFOs
+#define UART_FIFO_LEN		16
+/// Bits per byte on the line (8N1)
+#define UART_BITS_PER_BYTE	10
+
+/// LCR bit enabling access to the divisor latch
+#define UART_LCR__DLAB		0x80
+
+static MW_STATE struct {
+	int fd;				///< Line file descriptor
+	uint8_t pace;			///< Limit data rate to the baud rate
+	uint8_t rx[UART_FIFO_LEN];	///< RX FIFO
+	uint8_t rx_pos;			///< Position of the next byte to read
+	uint8_t rx_len;			///< Bytes in RX FIFO
+	uint8_t tx[UART_FIFO_LEN];	///< TX FIFO
+	uint8_t tx_len;			///< Bytes in TX FIFO
+	uint8_t ier;			///< Interrupt enable register
+	uint8_t lcr;			///< Line control register
+	uint8_t mcr;			///< Modem control register
+	uint8_t spr;			///< Scratchpad register
+	uint16_t dl;			///< Divisor latch
+	int64_t tx_free;		///< Time the TX line is available
+	int64_t rx_free;		///< Time the RX line is available
+} u = {.fd = -1, .dl = 1};
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// Returns how many bytes (up to max) the line can move, when pacing
+static int line_room(int64_t *line_free, int max)
+{
+	int64_t byte_ns;
+	int64_t now;
+	int room;
+
+	if (!u.pace) {
+		return max;
+	}
+	byte_ns = 1000000000LL * UART_BITS_PER_BYTE / UART_DIV_TO_BR(u.dl);
+	now = now_ns();
+	if (*line_free < now - byte_ns * UART_FIFO_LEN) {
+		// Line was idle, do not accumulate more than a FIFO worth
+		*line_free = now - byte_ns * UART_FIFO_LEN;
+	}
+	room = (now - *line_free) / byte_ns;
+
+	return MIN(room, max);
+}
+
+static void line_used(int64_t *line_free, int bytes)
+{
+	if (u.pace) {
+		*line_free += bytes * 1000000000LL * UART_BITS_PER_BYTE /
+			UART_DIV_TO_BR(u.dl);
+	}
+}
+
+/// Moves data between the FIFOs and the line
+static void pump(void)
+{
+	ssize_t len;
+	int room;
+	int pos;
+
+	if (u.fd < 0) {
+		return;
+	}
+
+	room = line_room(&u.tx_free, u.tx_len);
+	if (room > 0 && (len = write(u.fd, u.tx, room)) > 0) {
+		memmove(u.tx, u.tx + len, u.tx_len - len);
+		u.tx_len -= len;
+		line_used(&u.tx_free, len);
+	}
+
+	if (u.rx_len && u.rx_pos) {
+		memmove(u.rx, u.rx + u.rx_pos, u.rx_len);
+	}
+	u.rx_pos = 0;
+	room = line_room(&u.rx_free, UART_FIFO_LEN - u.rx_len);
+	pos = u.rx_len;
+	if (room > 0 && (len = read(u.fd, u.rx + pos, room)) > 0) {
+		u.rx_len += len;
+		line_used(&u.rx_free, len);
+	}
+}
+
+static uint8_t lsr_get(void)
+{
+	pump();
+
+	return (u.rx_len ? UART_LSR__DR : 0) |
+		(!u.tx_len ? UART_LSR__THRE | UART_LSR__TEMT : 0);
+}
+
+uint8_t uart_host_read(uint8_t off)
+{
+	uint8_t data;
+
+	host_vint_poll();
+
+	switch (off) {
+	case UART_RHR_OFF:
+		if (u.lcr & UART_LCR__DLAB) {
+			return u.dl & 0xFF;
+		}
+		if (!u.rx_len) {
+			return 0;
+		}
+		data = u.rx[u.rx_pos++];
+		u.rx_len--;
+		return data;
+
+	case UART_IER_OFF:
+		return u.lcr & UART_LCR__DLAB ? u.dl>>8 : u.ier;
+
+	case UART_ISR_OFF:
+		// FIFOs enabled, no interrupt pending
+		return 0xC1;
+
+	case UART_LCR_OFF:
+		return u.lcr;
+
+	case UART_MCR_OFF:
+		return u.mcr;
+
+	case UART_LSR_OFF:
+		return lsr_get();
+
+	case UART_MSR_OFF:
+		return u.fd >= 0 ? UART_MSR__DSR : 0;
+
+	case UART_SPR_OFF:
+		return u.spr;
+
+	default:
+		return 0;
+	}
+}
+
+void uart_host_write(uint8_t off, uint8_t val)
+{
+	host_vint_poll();
+
+	switch (off) {
+	case UART_THR_OFF:
+		if (u.lcr & UART_LCR__DLAB) {
+			u.dl = (u.dl & 0xFF00) | val;
+		} else if (u.tx_len < UART_FIFO_LEN) {
+			u.tx[u.tx_len++] = val;
+		}
+		break;
+
+	case UART_IER_OFF:
+		if (u.lcr & UART_LCR__DLAB) {
+			u.dl = (u.dl & 0x00FF) | (val<<8);
+		} else {
+			u.ier = val;
+		}
+		break;
+
+	case UART_FCR_OFF:
+		if (val & 0x02) {
+			u.rx_len = 0;
+			u.rx_pos = 0;
+		}
+		if (val & 0x04) {
+			u.tx_len = 0;
+		}
+		break;
+
+	case UART_LCR_OFF:
+		u.lcr = val;
+		break;
+
+	case UART_MCR_OFF:
+		u.mcr = val;
+		break;
+
+	case UART_SPR_OFF:
+		u.spr = val;
+		break;
+	}
+	if (!u.dl) {
+		u.dl = 1;
+	}
+}
+
+void uart_host_wait(int64_t max_ns)
+{
+	struct pollfd pfd = {.fd = u.fd, .events = POLLIN};
+	struct timespec ts;
+
+	pump();
+	if (max_ns <= 0) {
+		return;
+	}
+	if (u.pace) {
+		// Line is slow, service it each time half a FIFO is moved
+		max_ns = MIN(max_ns, (int64_t)(1000000000LL *
+				UART_BITS_PER_BYTE * UART_FIFO_LEN / 2 /
+				UART_DIV_TO_BR(u.dl)));
+		pfd.events = 0;
+	} else {
+		// Data left in the RX FIFO waits for a buffer to be posted,
+		// more data arriving does not change that
+		if (u.rx_len) {
+			pfd.events = 0;
+		}
+		if (u.tx_len) {
+			pfd.events |= POLLOUT;
+		}
+	}
+	if (!pfd.events) {
+		// Just sleep, also when the line is hung up
+		pfd.fd = -1;
+	}
+	ts.tv_sec = max_ns / 1000000000LL;
+	ts.tv_nsec = max_ns % 1000000000LL;
+	ppoll(&pfd, 1, &ts, NULL);
+}
+
+void uart_host_fd_set(int fd)
+{
+	if (fd >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+	u.fd = fd;
+	u.tx_free = u.rx_free = now_ns();
+}
+
+int uart_host_open(const char *path)
+{
+	struct termios tio;
+	int fd;
+
+	fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		return -1;
+	}
+	if (isatty(fd) && !tcgetattr(fd, &tio)) {
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+	uart_host_fd_set(fd);
+
+	return 0;
+}
+
+void uart_host_pace_set(int enable)
+{
+	u.pace = enable;
+	u.tx_free = u.rx_free = now_ns();
+}
@@ -14,6 +14,13 @@
 #include <string.h>
 #include "lsd.h"
 #include "../mw/util.h" 
+#ifdef MW_HOST
+#include "host/host.h"
+#else
+#include "../vdp.h"
+#endif
+#include "lz4.h"
+#include "tsk.h"
 /// Uart used for LSD
 #define LSD_UART		0
 
@@ -23,15 +30,66 @@
 /// Start of data in the buffer (skips STX and LEN fields).
 #define LSD_BUF_DATA_START 		3
 
+/// Channel used for link control frames in CRC mode
+#define LSD_LINK_CH		0x0F
+
+/// Channel used for link control frames in CRC mode, extended header
+#define LSD_LINK_CH_EXT		0xFF
+
+/// LENH flag marking LZ4 compressed payload (extended header only)
+#define LSD_LENH_LZ		0x80
+
+/// Length of the decompressed data before compressed payload
+#define LSD_LZ_HDR_LEN		2
+
+/// Compressed payload bytes read from the UART for each decoder call
+#define LSD_LZ_CHUNK		16
+
+/// CRC initial value (CRC-16/CCITT)
+#define LSD_CRC_INIT		0xFFFF
+
+/// Marks the start of a section the VBLANK service must not interrupt
+#define LOCK()		do {d.busy++; __asm__ volatile("" ::: "memory");} \
+	while(0)
+/// Marks the end of a section the VBLANK service must not interrupt
+#define UNLOCK()	do {__asm__ volatile("" ::: "memory"); d.busy--;} \
+	while(0)
+
+/// Maximum payload bytes moved at once. LSD_BYTEWISE moves them one at a
+/// time through the state machines, to measure the bursts (see tools/bench).
+#ifdef LSD_BYTEWISE
+#define LSD_BURST_MAX		1
+#else
+#define LSD_BURST_MAX		LSD_MAX_LEN
+#endif
+
+/// Frames (VBLANK interrupts) without acknowledge before retransmitting
+#define LSD_RETX_FRAMES		MS_TO_FRAMES(500)
+
+/// Link control frame payload
+enum link_msg {
+	LSD_LINK_NONE = 0,	///< No message
+	LSD_LINK_ACK = 0x06,	///< Frames up to seq received
+	LSD_LINK_NAK = 0x15	///< Resend frames starting from seq
+};
+
 /// Allowed states for the reception state machine.
 enum recv_state {
 	LSD_RECV_ERROR = -1,	///< An error has occurred
 	LSD_RECV_PARTIAL = 0,	///< Partial frame was received
+	LSD_RECV_POST,		///< Waiting for a buffer for the frame channel
 	LSD_RECV_IDLE,		///< Currently inactive
 	LSD_RECV_STX,		///< Waiting for STX
+	LSD_RECV_CH,		///< Receiving channel (extended header)
 	LSD_RECV_CH_LENH,	///< Receiving channel and length (high bits)
 	LSD_RECV_LEN,		///< Receiving frame length
+	LSD_RECV_SEQ,		///< Receiving sequence number (CRC mode)
+	LSD_RECV_LZ_LENH,	///< Receiving decompressed length high byte
+	LSD_RECV_LZ_LENL,	///< Receiving decompressed length low byte
+	LSD_RECV_RING,		///< Waiting for room in the RX ring
 	LSD_RECV_DATA,		///< Receiving data length
+	LSD_RECV_CRCH,		///< Receiving CRC high byte (CRC mode)
+	LSD_RECV_CRCL,		///< Receiving CRC low byte (CRC mode)
 	LSD_RECV_ETX,		///< Receiving ETX
 	LSD_RECV_MAX		///< Number of states
 };
@@ -41,74 +99,711 @@ enum send_state {
 	LSD_SEND_ERROR = -1,	///< An error has occurred
 	LSD_SEND_IDLE = 0,	///< Currently inactive
 	LSD_SEND_STX,           ///< Sending STX
+	LSD_SEND_CH,            ///< Sending channel (extended header)
 	LSD_SEND_CH_LENH,       ///< Sending channel and length (high bits)
 	LSD_SEND_LEN,           ///< Sending frame length
+	LSD_SEND_SEQ,           ///< Sending sequence number (CRC mode)
 	LSD_SEND_DATA,          ///< Sending data length
+	LSD_SEND_CRCH,          ///< Sending CRC high byte (CRC mode)
+	LSD_SEND_CRCL,          ///< Sending CRC low byte (CRC mode)
 	LSD_SEND_ETX,           ///< Sending ETX
+	LSD_SEND_ACK,           ///< Sent, waiting for acknowledge (CRC mode)
 	LSD_SEND_MAX            ///< Number of states
 };
 
 /// Data holding the send state
 struct send_data {
 	enum send_state stat;	///< Status of the send process
-	const char *buf;	///< Send buffer
-	int16_t pos;		///< Buffer position
+	const struct lsd_iov *iov;	///< Segments to send
+	struct lsd_iov one;	///< Segment used by lsd_send()
+	const char *buf;	///< Current segment position
+	int16_t left;		///< Bytes left in current segment
 	int16_t total; 		///< Total bytes to send
 	void *ctx;		///< Send context
 	lsd_send_cb cb;		///< Send completion callback
+	uint16_t crc;		///< CRC of the sent bytes
+	uint8_t iovcnt;		///< Number of segments
+	uint8_t seg;		///< Next segment to send
+	uint8_t seq;		///< Frame sequence number
 	uint8_t ch;		///< Send channel
 };
 
+/// Receive buffer posted by the application
+struct recv_post {
+	char *buf;		///< Receive buffer, NULL if not posted
+	int16_t max;		///< Buffer size
+	void *ctx;		///< Receive context
+	lsd_recv_cb cb;		///< Reception callback
+};
+
 /// Data holding the recv state
 struct recv_data {
 	enum recv_state stat;	///< Status of the recv process
-	char *buf;		///< Receive buffer
+	struct recv_post *post;	///< Buffer for the frame, NULL to discard it
 	int16_t pos;		///< Buffer position
 	int16_t frame_len;	///< Length of received frame
-	int16_t max;		///< Buffer size
-	void *ctx;		///< Receive context
-	lsd_recv_cb cb;		///< Reception callback
+	uint16_t crc;		///< CRC of the received bytes
+	uint16_t crc_rx;	///< CRC received in the frame trailer
+	struct recv_post *held;	///< Filled buffer waiting for the frame check
+	int16_t held_len;	///< Length of the data in the held buffer
+	uint16_t lz_len;	///< Decompressed payload length
+	uint8_t seq;		///< Frame sequence number
+	uint8_t lz;		///< Payload is LZ4 compressed
 	uint8_t ch;		///< Reception channel
+	uint8_t nobuf;		///< Dropped for lack of a buffer (CRC mode)
+#ifdef LSD_CAPTURE
+	int16_t total;		///< Frame length from the header
+#endif
+};
+
+/// RX ring record flags
+enum ring_flags {
+	RING_RELEASED = 0x01,	///< Record released by the application
+	RING_WRAP = 0x02	///< Padding until the end of the ring
 };
 
+/// Header of each frame stored in the RX ring
+struct ring_hdr {
+	uint16_t len;		///< Payload length
+	uint8_t ch;		///< Frame channel
+	uint8_t flags;		///< Record flags (see ring_flags)
+};
+
+/// Rounds up record lengths, keeping headers aligned
+#define RING_ALIGN(len)	(((len) + 3) & ~3)
+
+/// Continuous reception ring
+struct lsd_ring {
+	char *buf;		///< Ring buffer, NULL if ring is disabled
+	uint16_t size;		///< Ring buffer length (power of 2)
+	uint16_t used;		///< Bytes used, including padding
+	uint16_t head;		///< Where next frame will be stored
+	uint16_t tail;		///< Oldest frame not released
+	uint16_t res;		///< Position reserved for the frame in progress
+	uint16_t wrap;		///< Padding to skip before the reserved position
+};
+
+/// Advances a TX descriptor ring index
+#define TX_NEXT(idx)	(((idx) + 1) & (LSD_TX_QUEUE_LEN - 1))
+
 /// Local data required by the module.
 struct lsd_data {
-	struct send_data tx;
+	struct send_data tx[LSD_TX_QUEUE_LEN];	///< TX descriptor ring
+	struct send_data *tx_cur;	///< Frame being sent, NULL if none
+	struct send_data link;	///< Link control frame (CRC mode)
+	uint8_t tx_head;	///< Next free TX descriptor
+	uint8_t tx_tail;	///< Oldest TX descriptor in use
+	uint8_t tx_count;	///< Number of queued TX descriptors
+	uint8_t tx_unacked;	///< Sent descriptors waiting for acknowledge
+	uint8_t tx_seq;		///< Sequence number of the ring tail descriptor
+	uint8_t tx_rewind;	///< Resend unacknowledged frames after current
+	uint8_t tx_time;	///< Frame count when waiting for acknowledge started
+	volatile uint8_t frames;	///< VBLANK interrupts serviced
+	uint8_t vint_run;	///< lsd_vint_service() has been called
+	uint8_t link_pend;	///< Link message pending to be sent
+	uint8_t link_pend_seq;	///< Sequence number of the pending message
+	uint8_t link_msg;	///< Link message being sent
+	uint8_t link_rx;	///< Link message received
+	struct recv_post link_post;	///< Buffer for received link messages
 	struct recv_data rx;
+	struct recv_post post[LSD_MAX_CH];	///< Per channel posted buffers
+	struct recv_post any;	///< Buffer for channels without a posted one
+	struct recv_post side;	///< Side buffer, see lsd_side_recv()
+	struct recv_post ring_post;	///< Frame in progress in the RX ring
+	struct lz4_stream lz_dec;	///< Decoder of the frame in progress
+	struct lsd_ring ring;	///< Continuous reception ring
+	uint8_t posted;		///< Number of posted buffers
+	uint16_t ch_skip;	///< Channels whose next frame is discarded
+	uint16_t ch_hold;	///< Channels only received to their buffer
+	uint16_t side_ch;	///< Channels whose frames go to the side buffer
+	uint8_t side_on;	///< Side buffer takes frames with no buffer
+	uint8_t rx_seq;		///< Next expected sequence number
+	uint8_t rx_wait;	///< Frame rx_seq dropped for lack of a buffer
+	int16_t rx_skip;	///< Bytes of frame rx_seq already delivered
+	uint8_t crc;		///< CRC mode enabled
+	uint8_t ext;		///< Extended header enabled
+	uint8_t lz;		///< LZ4 compressed frames allowed
+	uint8_t max_ch;		///< Channels available in current mode
 	uint8_t ch_enable[LSD_MAX_CH];
+	struct lsd_stats stats;	///< Link statistics
+	volatile uint8_t busy;	///< Lock preventing VBLANK service to run
 };
 
 /// Module global data
-static struct lsd_data d = {};
+static MW_STATE struct lsd_data d = {};
+
+#ifdef LSD_CAPTURE
+/// Frame capture ring, global so it can be found by debuggers
+MW_STATE struct lsd_capture lsd_cap;
+
+/// Gets the next capture record, filling the timestamp
+static struct lsd_cap_rec *cap_rec_new(void)
+{
+	struct lsd_cap_rec *rec;
+
+	rec = &lsd_cap.rec[lsd_cap.count & (LSD_CAPTURE_RECS - 1)];
+	lsd_cap.count++;
+	rec->frame = lsd_cap.frame;
+	rec->hv = VDP_HV_COUNT_W;
+
+	return rec;
+}
+
+/// Records a sent frame
+static void cap_tx(const struct send_data *tx, uint8_t crc)
+{
+	struct lsd_cap_rec *rec = cap_rec_new();
+	uint8_t pos = 0;
+
+	rec->len = tx->total;
+	rec->ch = tx->ch;
+	rec->flags = LSD_CAP_TX | (crc ? LSD_CAP_CRC : 0);
+	rec->seq = tx->seq;
+	for (uint8_t i = 0; i < tx->iovcnt && pos < LSD_CAPTURE_PREFIX; i++) {
+		int16_t len = MIN(tx->iov[i].len, LSD_CAPTURE_PREFIX - pos);
+		memcpy(rec->data + pos, tx->iov[i].buf, len);
+		pos += len;
+	}
+	rec->cap_len = pos;
+}
+
+/// Records a received frame, with len payload bytes in the posted buffer
+static void cap_rx(uint8_t flags, int16_t len)
+{
+	struct lsd_cap_rec *rec = cap_rec_new();
+	struct recv_post *post = d.rx.post;
+
+	rec->len = d.rx.total;
+	rec->ch = d.rx.ch;
+	rec->flags = flags | (d.crc ? LSD_CAP_CRC : 0);
+	rec->seq = d.rx.seq;
+	rec->cap_len = 0;
+	if (post && post->buf) {
+		rec->cap_len = MIN(len, LSD_CAPTURE_PREFIX);
+		memcpy(rec->data, post->buf, rec->cap_len);
+	}
+}
+#else
+#define cap_tx(tx, crc)
+#define cap_rx(flags, len)
+#endif
+
+/// CRC-16/CCITT table, one entry per nibble to save memory
+static const uint16_t crc_nibble[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+static uint16_t crc_add(uint16_t crc, uint8_t data)
+{
+	crc = (crc<<4) ^ crc_nibble[(crc>>12) ^ (data>>4)];
+	crc = (crc<<4) ^ crc_nibble[(crc>>12) ^ (data & 0x0F)];
+
+	return crc;
+}
+
+/// Queues a link control message, sent as soon as the current frame ends.
+/// Newer messages replace older ones still not sent.
+static void link_queue(enum link_msg msg, uint8_t seq)
+{
+	d.link_pend = msg;
+	d.link_pend_seq = seq;
+}
+
+/// Frees the descriptor at the ring tail and runs its callback. The
+/// descriptor is freed before running the callback, so it can be used to
+/// queue another frame
+static void tx_free(void)
+{
+	struct send_data *tx = &d.tx[d.tx_tail];
+	lsd_send_cb cb = tx->cb;
+	void *ctx = tx->ctx;
+
+	tx->stat = LSD_SEND_IDLE;
+	d.tx_tail = TX_NEXT(d.tx_tail);
+	d.tx_count--;
+	d.tx_seq++;
+	if (cb) {
+		cb(LSD_STAT_COMPLETE, ctx);
+	}
+}
+
+/// Marks sent frames for retransmission.
+static void tx_rewind(void)
+{
+	uint8_t idx = d.tx_tail;
+
+	d.stats.retx += d.tx_unacked;
+	for (uint8_t i = 0; i < d.tx_unacked; i++) {
+		d.tx[idx].stat = LSD_SEND_STX;
+		d.tx[idx].seg = 0;
+		d.tx[idx].left = 0;
+		idx = TX_NEXT(idx);
+	}
+	d.tx_unacked = 0;
+	d.tx_rewind = FALSE;
+	d.tx_time = d.frames;
+}
+
+/// Frees sent frames with sequence number up to seq.
+static void tx_ack(uint8_t seq)
+{
+	while (d.tx_unacked && (int8_t)(seq - d.tx_seq) >= 0) {
+		d.tx_unacked--;
+		tx_free();
+	}
+	d.tx_time = d.frames;
+}
+
+/// Resends frames starting from seq. Previous ones were received.
+static void tx_nak(uint8_t seq)
+{
+	tx_ack(seq - 1);
+	// Frame being sent cannot be interrupted, rewind when it ends
+	if (d.tx_cur && d.tx_cur != &d.link) {
+		d.tx_rewind = TRUE;
+	} else {
+		tx_rewind();
+	}
+}
+
+/// Drops the frame being received for lack of a buffer (CRC mode), so the
+/// link control frames behind it are not blocked. It is asked for again
+/// when a buffer is posted (see rx_resume()).
+static void rx_nobuf(void)
+{
+	d.rx.post = NULL;
+	d.rx.nobuf = TRUE;
+	d.rx_wait = TRUE;
+}
+
+/// Asks the peer to resend the frame dropped for lack of a buffer, now that
+/// there might be one
+static void rx_resume(void)
+{
+	if (d.rx_wait) {
+		d.rx_wait = FALSE;
+		link_queue(LSD_LINK_NAK, d.rx_seq);
+	}
+}
+
+/// Returns the side buffer if the frame being received fits in it whole
+static struct recv_post *side_get(void)
+{
+	int16_t len = d.rx.lz ? d.rx.lz_len : d.rx.frame_len;
+
+	return d.side.buf && d.side.max >= len ? &d.side : NULL;
+}
+
+/// Checks if a frame is being received to the side buffer. Once complete
+/// (also while its callback runs) it is no longer.
+static int side_busy(void)
+{
+	return d.rx.stat != LSD_RECV_STX &&
+		(d.rx.post == &d.side || d.rx.held == &d.side);
+}
+
+/// Returns the buffer frames for a channel are received into, or NULL if
+/// there is none.
+static struct recv_post *post_get(uint8_t ch)
+{
+	struct recv_post *post;
+
+	if (d.side_ch & (1<<ch)) {
+		// Behind frames already in the side buffer, to keep order
+		return side_get();
+	}
+	if (d.post[ch].buf) {
+		return &d.post[ch];
+	}
+	if (d.ch_hold & (1<<ch)) {
+		// Waits in the UART until lsd_ch_recv() posts a buffer
+		return NULL;
+	}
+	if (d.any.buf) {
+		return &d.any;
+	}
+	if (d.ring.buf) {
+		return &d.ring_post;
+	}
+	if (d.side_on && (post = side_get())) {
+		d.side_ch |= 1<<ch;
+		return post;
+	}
+
+	return NULL;
+}
+
+/// Reserves room in the RX ring for the frame being received (once
+/// decompressed). Returns FALSE if there is not enough room yet.
+static int ring_reserve(void)
+{
+	struct lsd_ring *r = &d.ring;
+	int16_t len = d.rx.lz ? d.rx.lz_len : d.rx.frame_len;
+	uint16_t need = RING_ALIGN(sizeof(struct ring_hdr) + len);
+	uint16_t left = r->size - r->head;
+
+	if (need > r->size) {
+		// Will never fit, discard it
+		d.stats.dropped++;
+		d.rx.post = NULL;
+		return TRUE;
+	}
+
+	// Frames are kept contiguous, so they can be used in place
+	r->wrap = left < need ? left : 0;
+	if (r->used + r->wrap + need > r->size) {
+		return FALSE;
+	}
+	r->res = (r->head + r->wrap) & (r->size - 1);
+	d.ring_post.buf = r->buf + r->res + sizeof(struct ring_hdr);
+	d.ring_post.max = len;
+
+	return TRUE;
+}
+
+/// Makes the frame of length len stored in the reserved room available
+static void ring_commit(uint16_t len)
+{
+	struct lsd_ring *r = &d.ring;
+	struct ring_hdr *hdr = (struct ring_hdr*)(r->buf + r->res);
+	uint16_t rec_len = RING_ALIGN(sizeof(struct ring_hdr) + len);
+
+	if (r->wrap) {
+		((struct ring_hdr*)(r->buf + r->head))->flags = RING_WRAP;
+	}
+	hdr->len = len;
+	hdr->ch = d.rx.ch;
+	hdr->flags = 0;
+	r->used += r->wrap + rec_len;
+	r->head = (r->res + rec_len) & (r->size - 1);
+}
+
+/// Frees a posted buffer and runs its callback. The buffer is freed before
+/// running the callback, so it can be posted again from it.
+static void post_done(struct recv_post *post, enum lsd_status stat,
+		uint8_t ch, uint16_t len)
+{
+	char *buf = post->buf;
+
+	post->buf = NULL;
+	d.posted--;
+	if (post->cb) {
+		post->cb(stat, ch, buf, len, post->ctx);
+	}
+}
+
+/// Samples the UART overrun flag, cleared by every line status read
+static void overrun_check(void)
+{
+	if (uart_overrun()) {
+		d.stats.overrun++;
+	}
+}
 
 static void recv_error(enum lsd_status stat)
 {
-//	d.rx.stat = LSD_RECV_ERROR;
-	d.rx.stat = LSD_RECV_IDLE;
-	if (d.rx.cb) {
-		d.rx.cb(stat, 0, NULL, 0, d.rx.ctx);
+	struct recv_post *post = d.rx.post;
+
+	cap_rx(LSD_CAP_ERR, 0);
+	overrun_check();
+	d.rx.stat = LSD_RECV_STX;
+	d.rx.post = NULL;
+	if (LSD_STAT_ERR_INVALID_CH == stat) {
+		d.stats.invalid_ch++;
+	} else {
+		d.stats.framing_err++;
+	}
+	if (d.crc) {
+		// Ask for the frame again, it is received to the same buffer
+		link_queue(LSD_LINK_NAK, d.rx_seq);
+		return;
+	}
+	// Link and ring frames are just dropped. The channel is reported
+	// unless it is the cause of the error.
+	if (post && post != &d.link_post && post != &d.ring_post &&
+			post->buf) {
+		post_done(post, stat, LSD_STAT_ERR_INVALID_CH == stat ? 0 :
+				d.rx.ch, 0);
+	}
+}
+
+/// Accounts a frame correctly received
+static void recv_stats(void)
+{
+	if (d.rx.ch < LSD_MAX_CH) {
+		d.stats.ch[d.rx.ch].rx_frames++;
+	}
+}
+
+/// Starts decompressing the payload to the buffer the frame goes to
+static void lz_start(void)
+{
+	struct recv_post *post = d.rx.post;
+
+	// Frames not fitting the buffer are only received, and fail when done
+	if (post && d.rx.lz_len <= post->max) {
+		lz4_stream_init(&d.lz_dec, (uint8_t*)post->buf, d.rx.lz_len);
+	}
+}
+
+/// Checks the decompressed payload and delivers it
+static void lz_complete(void)
+{
+	struct recv_post *post = d.rx.post;
+	enum lsd_status stat = LSD_STAT_COMPLETE;
+
+	if (!post) {
+		return;
+	}
+	if (d.rx.lz_len > post->max) {
+		stat = LSD_STAT_ERR_FRAME_TOO_LONG;
+	} else if (lz4_stream_end(&d.lz_dec) != (int16_t)d.rx.lz_len) {
+		stat = LSD_STAT_ERR_DECOMPRESS;
+	}
+
+	if (&d.ring_post != post) {
+		post_done(post, stat, d.rx.ch,
+				LSD_STAT_COMPLETE == stat ? d.rx.lz_len : 0);
+	} else if (LSD_STAT_COMPLETE == stat) {
+		ring_commit(d.rx.lz_len);
+	} else {
+		// Reserved room is reused by the next frame
+		d.stats.dropped++;
 	}
 }
 
 static void recv_complete(void)
 {
-	if (d.rx.cb) {
-		d.rx.cb(LSD_STAT_COMPLETE, d.rx.ch, d.rx.buf,
-				d.rx.pos, d.rx.ctx);
+	if (!d.rx.post) {
+		// Discarded frame, maybe the one lsd_ch_skip() asked for
+		d.ch_skip &= ~(1<<d.rx.ch);
+	} else if (d.rx.lz) {
+		lz_complete();
+	} else if (&d.ring_post == d.rx.post) {
+		ring_commit(d.rx.pos);
+	} else if (d.rx.post) {
+		post_done(d.rx.post, LSD_STAT_COMPLETE, d.rx.ch, d.rx.pos);
 	}
 }
 
-static void recv_add(uint8_t recv)
+/// Checks a frame received in CRC mode, delivering it if it is the
+/// expected one, and acknowledging it to the peer.
+static void recv_check(void)
 {
-	d.rx.buf[d.rx.pos++] = recv;
-	if (d.rx.pos >= d.rx.frame_len) {
-		d.rx.stat = LSD_RECV_ETX;
-	} else if (d.rx.pos >= d.rx.max) {
+	int8_t ahead = d.rx.seq - d.rx_seq;
+
+	if (d.rx.crc != d.rx.crc_rx) {
+		d.stats.crc_err++;
+		overrun_check();
+		// Corrupted frame. Data is kept in the posted buffer, to be
+		// overwritten by the retransmission.
+		link_queue(LSD_LINK_NAK, d.rx_seq);
+	} else if (d.link.ch == d.rx.ch) {
+		if (LSD_LINK_ACK == d.link_rx) {
+			tx_ack(d.rx.seq);
+		} else if (LSD_LINK_NAK == d.link_rx) {
+			tx_nak(d.rx.seq);
+		}
+	} else if (ahead > 0) {
+		// A frame was lost, ask for it. If it was dropped for lack of
+		// a buffer, it is asked for once there is one.
+		if (!d.rx_wait) {
+			link_queue(LSD_LINK_NAK, d.rx_seq);
+		}
+	} else if (ahead < 0) {
+		// Retransmission of an already received frame
+		link_queue(LSD_LINK_ACK, d.rx_seq - 1);
+	} else if (d.rx.nobuf) {
+		// Not acknowledged, so it is resent
+	} else if (d.rx.held) {
+		// Frame did not fit in the buffer. Now that it is known to be
+		// good, deliver the part received, and get the rest from a
+		// retransmission, skipping the part delivered.
+		d.rx_skip += d.rx.held_len;
+		d.stats.partial++;
+		link_queue(LSD_LINK_NAK, d.rx_seq);
+		post_done(d.rx.held, LSD_STAT_COMPLETE, d.rx.ch,
+				d.rx.held_len);
+	} else {
+		link_queue(LSD_LINK_ACK, d.rx_seq++);
+		d.rx_wait = FALSE;
+		d.rx_skip = 0;
+		recv_stats();
+		recv_complete();
+	}
+}
+
+/// Returns the state following the frame payload
+static enum recv_state recv_trailer(void)
+{
+	return d.crc ? LSD_RECV_CRCH : LSD_RECV_ETX;
+}
+
+/// Receives up to max payload bytes while they are available, without going
+/// through the state machine for each byte.
+static void recv_data(int16_t max)
+{
+	struct recv_post *post = d.rx.post;
+	int16_t pos = d.rx.pos;
+	int16_t end = d.rx.frame_len;
+
+	if (post) {
+		end = MIN(end, post->max);
+	}
+	end = MIN(end, pos + MIN(max, LSD_BURST_MAX));
+	if (pos < 0) {
+		// Part delivered before the retransmission (CRC mode)
+		end = MIN(end, 0);
+	}
+
+	if (pos >= end) {
+		// Posted buffer has no room, it is completed below
+	} else if (d.crc) {
+		char *buf = post && pos >= 0 ? post->buf : NULL;
+		uint16_t crc = d.rx.crc;
+
+		do {
+			uint8_t recv = uart_getc();
+			crc = crc_add(crc, recv);
+			if (buf) {
+				buf[pos] = recv;
+			}
+			pos++;
+		} while (pos < end && uart_rx_ready());
+		d.rx.crc = crc;
+	} else if (post) {
+		char *buf = post->buf;
+
+		do {
+			buf[pos++] = uart_getc();
+		} while (pos < end && uart_rx_ready());
+	} else {
+		do {
+			(void)uart_getc();
+			pos++;
+		} while (pos < end && uart_rx_ready());
+	}
+	if (d.rx.ch < LSD_MAX_CH) {
+		d.stats.ch[d.rx.ch].rx_bytes += pos - d.rx.pos;
+	}
+	d.rx.pos = pos;
+
+	if (pos >= d.rx.frame_len) {
+		d.rx.stat = recv_trailer();
+	} else if (post && pos >= post->max && d.crc) {
+		// Filled the buffer, hold it until the frame is checked. The
+		// rest of the payload is only checked.
+		d.rx.held = post;
+		d.rx.held_len = pos;
+		d.rx.post = NULL;
+	} else if (post && pos >= post->max) {
 		// Filled the available buffer space, so force
 		// a frame completion and flag partial reception
-		d.rx.frame_len -= d.rx.pos;
+		d.rx.frame_len -= pos;
 		d.rx.stat = LSD_RECV_PARTIAL;
+		d.stats.partial++;
 		recv_complete();
+		d.rx.pos = 0;
+		d.rx.post = NULL;
+	}
+}
+
+/// Receives up to max bytes of compressed payload while they are available,
+/// decompressing them to the buffer the frame goes to. Decoder errors are
+/// kept until the frame ends.
+static void recv_lz(int16_t max)
+{
+	struct recv_post *post = d.rx.post;
+	int feed = post && d.rx.lz_len <= post->max;
+	int16_t left = MIN(d.rx.frame_len - d.rx.pos, MIN(max, LSD_BURST_MAX));
+	uint8_t chunk[LSD_LZ_CHUNK];
+	int16_t pos = d.rx.pos;
+	uint16_t crc = d.rx.crc;
+	int16_t len;
+
+	do {
+		len = 0;
+		do {
+			chunk[len] = uart_getc();
+			if (d.crc) {
+				crc = crc_add(crc, chunk[len]);
+			}
+			len++;
+		} while (len < MIN(left, LSD_LZ_CHUNK) && uart_rx_ready());
+		if (feed) {
+			lz4_stream_feed(&d.lz_dec, chunk, len);
+		}
+		pos += len;
+		left -= len;
+	} while (left && uart_rx_ready());
+	d.rx.crc = crc;
+	if (d.rx.ch < LSD_MAX_CH) {
+		d.stats.ch[d.rx.ch].rx_bytes += pos - d.rx.pos;
+	}
+	d.rx.pos = pos;
+
+	if (pos >= d.rx.frame_len) {
+		d.rx.stat = recv_trailer();
+	}
+}
+
+/// Returns the state following the frame header, or the part of the frame
+/// already received. Payload goes to the buffer posted for the channel, and
+/// if there is none, it waits in the UART until one is posted.
+static enum recv_state recv_payload(void)
+{
+	if (&d.link_post == d.rx.post) {
+		// Link control message
+	} else if (d.crc && d.rx.seq != d.rx_seq) {
+		// Resent or out of order frame, only checked to answer it
+		d.rx.post = NULL;
+	} else if (d.ch_skip & (1<<d.rx.ch)) {
+		// Received without a buffer, until it completes (a good copy of
+		// it in CRC mode)
+		d.rx.post = NULL;
+	} else {
+		d.rx.post = post_get(d.rx.ch);
+		if (!d.rx.post && d.crc) {
+			rx_nobuf();
+		} else if (!d.rx.post) {
+			return LSD_RECV_POST;
+		}
+	}
+	if (&d.ring_post == d.rx.post) {
+		return LSD_RECV_RING;
+	}
+	if (d.rx.lz) {
+		lz_start();
+	}
+
+	return d.rx.pos < d.rx.frame_len ? LSD_RECV_DATA : recv_trailer();
+}
+
+/// Checks the channel of the frame, and gets the length high bits
+static void recv_route(uint8_t lenh)
+{
+	d.rx.frame_len = (lenh & 0x0F)<<8;
+	d.rx.held = NULL;
+	d.rx.nobuf = FALSE;
+	d.rx.lz = d.ext && (lenh & LSD_LENH_LZ);
+	if (d.rx.lz && !d.lz) {
+		// Peer must not compress unless negotiated
+		d.rx.post = NULL;
+		recv_error(LSD_STAT_ERR_FRAMING);
+	} else if (d.crc && d.link.ch == d.rx.ch) {
+		d.rx.post = &d.link_post;
+		d.rx.stat = LSD_RECV_LEN;
+	} else if (d.rx.ch >= d.max_ch || !d.ch_enable[d.rx.ch]) {
+		// Sanity check (not exceding number of
+		// channels). The frame cannot be trusted, so
+		// hunt for the next one.
+		d.rx.post = &d.any;
+		recv_error(LSD_STAT_ERR_INVALID_CH);
+	} else {
+		// Buffer is looked up when the header is complete
+		d.rx.post = NULL;
+		d.rx.stat = LSD_RECV_LEN;
 	}
 }
 
@@ -119,46 +814,109 @@ static void process_recv(void)
 	switch (d.rx.stat) {
 	case LSD_RECV_STX:	// Wait for STX to arrive
 		if (LSD_STX_ETX == recv) {
-			d.rx.stat = LSD_RECV_CH_LENH;
+			d.rx.stat = d.ext ? LSD_RECV_CH : LSD_RECV_CH_LENH;
 		}
 		break;
 
-	case LSD_RECV_CH_LENH:	// Receive CH and len high
+	case LSD_RECV_CH:	// Receive CH (extended header)
 		// Check special case: if we receive ETX here,
 		// then this is the real STX (previous one was ETX from
 		// previous frame).
 		if (!(LSD_STX_ETX == recv)) {
+			d.rx.ch = recv;
+			d.rx.crc = crc_add(LSD_CRC_INIT, recv);
+			d.rx.stat = LSD_RECV_CH_LENH;
+		}
+		break;
+
+	case LSD_RECV_CH_LENH:	// Receive CH and len high
+		if (d.ext) {
+			d.rx.crc = crc_add(d.rx.crc, recv);
+			recv_route(recv);
+		} else if (!(LSD_STX_ETX == recv)) {
+			// Same special case as in LSD_RECV_CH
 			d.rx.ch = recv>>4;
-			d.rx.frame_len = (recv & 0x0F)<<8;
-			// Sanity check (not exceding number of channels)
-			if (d.rx.ch >= LSD_MAX_CH ||
-					!d.ch_enable[d.rx.ch]) {
-				recv_error(LSD_STAT_ERR_INVALID_CH);
-			} else {
-				d.rx.stat = LSD_RECV_LEN;
-			}
+			d.rx.crc = crc_add(LSD_CRC_INIT, recv);
+			recv_route(recv);
 		}
 		break;
 
 	case LSD_RECV_LEN:	// Receive len low
 		d.rx.frame_len |= recv;
+#ifdef LSD_CAPTURE
+		d.rx.total = d.rx.frame_len;
+#endif
+		d.rx.crc = crc_add(d.rx.crc, recv);
 		d.rx.pos = 0;
-		if (d.rx.frame_len) {
+		if (d.rx.post == &d.link_post && d.rx.frame_len != 1) {
+			recv_error(LSD_STAT_ERR_FRAMING);
+		} else if (d.rx.lz && d.rx.frame_len <= LSD_LZ_HDR_LEN) {
+			recv_error(LSD_STAT_ERR_FRAMING);
+		} else if (d.crc) {
+			d.rx.stat = LSD_RECV_SEQ;
+		} else if (d.rx.lz) {
+			d.rx.stat = LSD_RECV_LZ_LENH;
+		} else {
 			// If there's payload, receive it. Else wait for ETX
-			d.rx.stat = LSD_RECV_DATA;
+			d.rx.stat = recv_payload();
+		}
+		break;
+
+	case LSD_RECV_SEQ:	// Receive sequence number
+		d.rx.seq = recv;
+		d.rx.crc = crc_add(d.rx.crc, recv);
+		if (d.rx.lz) {
+			// Compressed frames are never partially delivered
+			d.rx.stat = LSD_RECV_LZ_LENH;
+			break;
+		}
+		if (d.rx.seq == d.rx_seq && &d.link_post != d.rx.post) {
+			// Skip the part delivered before the retransmission
+			d.rx.pos = -MIN(d.rx_skip, d.rx.frame_len);
+			d.rx.frame_len += d.rx.pos;
+		}
+		d.rx.stat = recv_payload();
+		break;
+
+	case LSD_RECV_LZ_LENH:	// Receive decompressed length
+		d.rx.lz_len = recv<<8;
+		d.rx.crc = crc_add(d.rx.crc, recv);
+		d.rx.stat = LSD_RECV_LZ_LENL;
+		break;
+
+	case LSD_RECV_LZ_LENL:
+		d.rx.lz_len |= recv;
+		d.rx.crc = crc_add(d.rx.crc, recv);
+		d.rx.frame_len -= LSD_LZ_HDR_LEN;
+		if (d.rx.lz_len > LSD_MAX_LEN) {
+			recv_error(LSD_STAT_ERR_FRAMING);
 		} else {
-			d.rx.stat = LSD_RECV_ETX;
+			d.rx.stat = recv_payload();
 		}
 		break;
 
-	case LSD_RECV_DATA:	// Receive payload
-		recv_add(recv);
+	case LSD_RECV_CRCH:	// Receive CRC
+		d.rx.crc_rx = recv<<8;
+		d.rx.stat = LSD_RECV_CRCL;
+		break;
+
+	case LSD_RECV_CRCL:
+		d.rx.crc_rx |= recv;
+		d.rx.stat = LSD_RECV_ETX;
 		break;
 
 	case LSD_RECV_ETX:	// ETX should come here
 		if (LSD_STX_ETX == recv) {
-			d.rx.stat = LSD_RECV_IDLE;
-			recv_complete();
+			d.rx.stat = LSD_RECV_STX;
+			cap_rx(d.crc && d.rx.crc != d.rx.crc_rx ?
+					LSD_CAP_ERR : 0, d.rx.pos);
+			if (d.crc) {
+				recv_check();
+			} else {
+				recv_stats();
+				recv_complete();
+			}
+			d.rx.post = NULL;
 		} else {
 			// Error, ETX not received.
 			recv_error(LSD_STAT_ERR_FRAMING);
@@ -172,78 +930,512 @@ static void process_recv(void)
 	}
 }
 
-static void send_complete(void)
+/// Checks if the reception state machine can consume data. New frames are
+/// only started when there are posted buffers. Frames whose header or part
+/// of the payload was received wait until a buffer for their channel is
+/// posted, keeping the rest of the data in the UART.
+static int recv_ready(void)
 {
-	d.tx.stat = LSD_SEND_IDLE;
-	if (d.tx.cb) {
-		d.tx.cb(LSD_STAT_COMPLETE, d.tx.ctx);
+	if (LSD_RECV_POST == d.rx.stat || LSD_RECV_PARTIAL == d.rx.stat) {
+		d.rx.stat = recv_payload();
+		if (LSD_RECV_POST == d.rx.stat) {
+			return FALSE;
+		}
+	}
+	if (LSD_RECV_RING == d.rx.stat) {
+		// Keep data in the UART until there is room in the ring
+		if (ring_reserve()) {
+			// Reserved
+		} else if (d.crc) {
+			rx_nobuf();
+		} else {
+			return FALSE;
+		}
+		if (d.rx.lz) {
+			lz_start();
+		}
+		d.rx.stat = d.rx.frame_len ? LSD_RECV_DATA : recv_trailer();
+	}
+
+	// In CRC mode link control frames must always be received
+	return d.rx.stat > LSD_RECV_STX || d.posted || d.crc || d.ring.buf ||
+		d.ch_skip;
+}
+
+static void send_complete(struct send_data *tx)
+{
+	cap_tx(tx, d.crc);
+	d.tx_cur = NULL;
+	if (tx == &d.link) {
+		tx->stat = LSD_SEND_IDLE;
+		return;
+	}
+
+	d.stats.ch[tx->ch].tx_frames++;
+	d.stats.ch[tx->ch].tx_bytes += tx->total;
+	if (d.crc) {
+		// Keep the frame until the peer acknowledges it
+		tx->stat = LSD_SEND_ACK;
+		d.tx_unacked++;
+		d.tx_time = d.frames;
+		if (d.tx_rewind) {
+			tx_rewind();
+		}
+	} else {
+		tx_free();
 	}
 }
 
-static void process_send(void)
+/// Returns the frame being sent, starting a new one if there is none.
+/// Link control messages take precedence over queued frames.
+static struct send_data *tx_cur(void)
 {
-	switch (d.tx.stat) {
+	struct send_data *tx;
+
+	if (!d.tx_cur) {
+		if (d.link_pend) {
+			d.link_msg = d.link_pend;
+			d.link.seq = d.link_pend_seq;
+			d.link_pend = LSD_LINK_NONE;
+			d.link.seg = 0;
+			d.link.left = 0;
+			d.link.stat = LSD_SEND_STX;
+			d.tx_cur = &d.link;
+		} else if (d.tx_count > d.tx_unacked) {
+			tx = &d.tx[(d.tx_tail + d.tx_unacked) &
+				(LSD_TX_QUEUE_LEN - 1)];
+			tx->seq = d.tx_seq + d.tx_unacked;
+			d.tx_cur = tx;
+		}
+	}
+
+	return d.tx_cur;
+}
+
+/// Sends payload bytes from the current segment, up to the FIFO room.
+static int16_t send_data(struct send_data *tx, int16_t room)
+{
+	int16_t sent = MIN(MIN(room, LSD_BURST_MAX), tx->left);
+	const char *buf = tx->buf;
+
+	if (d.crc) {
+		uint16_t crc = tx->crc;
+
+		for (int16_t i = sent; i > 0; i--) {
+			crc = crc_add(crc, *buf);
+			uart_putc(*buf++);
+		}
+		tx->crc = crc;
+	} else {
+		for (int16_t i = sent; i > 0; i--) {
+			uart_putc(*buf++);
+		}
+	}
+	tx->buf = buf;
+	tx->left -= sent;
+
+	return sent;
+}
+
+/// Moves to the next non empty segment, or to the trailer if there are no
+/// more.
+static void seg_next(struct send_data *tx)
+{
+	while (!tx->left && tx->seg < tx->iovcnt) {
+		tx->buf = tx->iov[tx->seg].buf;
+		tx->left = tx->iov[tx->seg].len;
+		tx->seg++;
+	}
+	if (!tx->left) {
+		tx->stat = d.crc ? LSD_SEND_CRCH : LSD_SEND_ETX;
+	}
+}
+
+/// Runs the send state machine, returning the number of bytes written.
+static int16_t process_send(int16_t room)
+{
+	struct send_data *tx = d.tx_cur;
+	int16_t sent = 1;
+	uint8_t data;
+
+	switch (tx->stat) {
 	case LSD_SEND_STX:
 		uart_putc(LSD_STX_ETX);
-		d.tx.stat = LSD_SEND_CH_LENH;
+		tx->stat = d.ext ? LSD_SEND_CH : LSD_SEND_CH_LENH;
+		break;
+
+	case LSD_SEND_CH:
+		uart_putc(tx->ch);
+		tx->crc = crc_add(LSD_CRC_INIT, tx->ch);
+		tx->stat = LSD_SEND_CH_LENH;
 		break;
 
 	case LSD_SEND_CH_LENH:
-		uart_putc((d.tx.ch<<4) | (d.tx.total>>8));
-		d.tx.stat = LSD_SEND_LEN;
+		if (d.ext) {
+			data = tx->total>>8;
+			tx->crc = crc_add(tx->crc, data);
+		} else {
+			data = (tx->ch<<4) | (tx->total>>8);
+			tx->crc = crc_add(LSD_CRC_INIT, data);
+		}
+		uart_putc(data);
+		tx->stat = LSD_SEND_LEN;
 		break;
 
 	case LSD_SEND_LEN:
-		uart_putc(d.tx.total & 0xFF);
-		d.tx.stat = LSD_SEND_DATA;
+		data = tx->total & 0xFF;
+		uart_putc(data);
+		tx->crc = crc_add(tx->crc, data);
+		if (d.crc) {
+			tx->stat = LSD_SEND_SEQ;
+		} else {
+			tx->stat = LSD_SEND_DATA;
+			seg_next(tx);
+		}
+		break;
+
+	case LSD_SEND_SEQ:
+		uart_putc(tx->seq);
+		tx->crc = crc_add(tx->crc, tx->seq);
+		tx->stat = LSD_SEND_DATA;
+		seg_next(tx);
 		break;
 
 	case LSD_SEND_DATA:
-		uart_putc(d.tx.buf[d.tx.pos++]);
-		if (d.tx.pos >= d.tx.total) {
-			d.tx.stat = LSD_SEND_ETX;
+		sent = send_data(tx, room);
+		if (!tx->left) {
+			seg_next(tx);
 		}
 		break;
 
+	case LSD_SEND_CRCH:
+		uart_putc(tx->crc>>8);
+		tx->stat = LSD_SEND_CRCL;
+		break;
+
+	case LSD_SEND_CRCL:
+		uart_putc(tx->crc & 0xFF);
+		tx->stat = LSD_SEND_ETX;
+		break;
+
 	case LSD_SEND_ETX:
 		uart_putc(LSD_STX_ETX);
-		send_complete();
+		send_complete(tx);
 		break;
 	default:
 		break;
 	}
+
+	return sent;
 }
 
-void lsd_process(void)
+/// Returns TRUE if the VDP is past the specified scanline. Wraps properly
+/// as long as the budget is shorter than 128 lines.
+#define line_passed(line)	((int8_t)(VDP_V_COUNT_B - (line)) >= 0)
+
+/// Runs the state machines until both directions are idle or, if budget is
+/// set, until end_line is reached. Returns TRUE if stopped by the deadline.
+static int process(int budget, uint8_t end_line)
 {
+	// Payload bursts are cut so the deadline is checked often enough
+	int16_t chunk = budget ? UART_TX_FIFO_LEN : LSD_MAX_LEN;
+	int expired = FALSE;
 	int active;
+	int work = FALSE;
 
+	LOCK();
 	do {
 		active = FALSE;
-		if (d.rx.stat > LSD_RECV_IDLE && uart_rx_ready()) {
+		if (uart_rx_ready() && recv_ready()) {
 			active = TRUE;
-			while (d.rx.stat > LSD_RECV_IDLE && uart_rx_ready()) {
-				process_recv();
+			while (!expired && uart_rx_ready() && recv_ready()) {
+				// Payload is copied in bursts, other fields
+				// go through the state machine
+				if (LSD_RECV_DATA == d.rx.stat && d.rx.lz) {
+					recv_lz(chunk);
+				} else if (LSD_RECV_DATA == d.rx.stat) {
+					recv_data(chunk);
+				} else {
+					process_recv();
+				}
+				expired = budget && line_passed(end_line);
 			}
 		}
-		if (d.tx.stat > LSD_SEND_IDLE && uart_tx_ready()) {
+		if (!expired && uart_tx_ready() && tx_cur()) {
+			int16_t room = UART_TX_FIFO_LEN;
+
 			active = TRUE;
-			for (int i = 0; i < UART_TX_FIFO_LEN &&
-					d.tx.stat > LSD_SEND_IDLE; i++) {
-				process_send();
+			// Queued frames are sent back to back, so the FIFO is
+			// topped up even when a frame ends in the middle
+			while (room && tx_cur()) {
+				room -= process_send(room);
 			}
+			expired = budget && line_passed(end_line);
+		}
+		work |= active;
+	} while(active && !expired);
+
+	if (!work) {
+		d.stats.idle_polls++;
+	}
+
+	// Retransmit if the peer does not acknowledge sent frames in time
+	if (d.tx_unacked && !d.tx_cur &&
+			(uint8_t)(d.frames - d.tx_time) >= LSD_RETX_FRAMES) {
+		tx_rewind();
+	}
+	UNLOCK();
+
+	return expired;
+}
+
+/// Returns the number of payload bytes that can be received without the
+/// state machine running callbacks, or 0 if there are none.
+static int16_t vint_rx_len(void)
+{
+	struct recv_post *post = d.rx.post;
+
+	switch (d.rx.stat) {
+	case LSD_RECV_STX:
+	case LSD_RECV_CH:
+	case LSD_RECV_LEN:
+	case LSD_RECV_SEQ:
+	case LSD_RECV_LZ_LENH:
+	case LSD_RECV_LZ_LENL:
+	case LSD_RECV_CRCH:
+	case LSD_RECV_CRCL:
+		return 1;
+
+	case LSD_RECV_DATA:
+		// Decompressing is left out of the interrupt
+		if (d.rx.lz) {
+			return 0;
+		}
+		// Filling the buffer of a partial frame completes it
+		if (post && post->max < d.rx.frame_len) {
+			return MIN(UART_TX_FIFO_LEN, post->max - d.rx.pos - 1);
+		}
+		return UART_TX_FIFO_LEN;
+
+	default:
+		// Processing the remaining states can run callbacks
+		return 0;
+	}
+}
+
+void lsd_vint_service(void)
+{
+	uint8_t start = VDP_V_COUNT_B;
+	uint8_t end_line = start + LSD_VINT_LINES;
+	int16_t room = UART_TX_FIFO_LEN;
+	int16_t len;
+	uint8_t lines;
+
+	// Times the retransmissions, so counted even if the service is skipped
+	d.frames++;
+	d.vint_run = TRUE;
+	// The interrupted code might be in the middle of updating the state
+	if (d.busy) {
+		d.stats.vint_skipped++;
+		return;
+	}
+
+	while (!line_passed(end_line) && uart_rx_ready() && recv_ready() &&
+			(len = vint_rx_len()) > 0) {
+		if (LSD_RECV_DATA == d.rx.stat) {
+			recv_data(len);
+		} else {
+			process_recv();
+		}
+	}
+
+	// Sending ETX completes the frame and runs the callback
+	if (uart_tx_ready()) {
+		while (room && tx_cur() && LSD_SEND_ETX != d.tx_cur->stat) {
+			room -= process_send(room);
 		}
-	} while(active);
+	}
+
+	lines = VDP_V_COUNT_B - start;
+	d.stats.vint_lines = lines;
+	if (lines > d.stats.vint_lines_max) {
+		d.stats.vint_lines_max = lines;
+	}
+}
+
+#ifndef MW_HOST
+static void vint_handler(void) __attribute__((interrupt));
+#endif
+static void vint_handler(void)
+{
+	lsd_vint_service();
+}
+
+void lsd_vint_enable(void)
+{
+	vint_cb_set(vint_handler);
+}
+
+int lsd_vint_running(void)
+{
+	return d.vint_run;
+}
+
+uint8_t lsd_frames_get(void)
+{
+	return d.frames;
+}
+
+void lsd_process(void)
+{
+	process(FALSE, 0);
+}
+
+int lsd_process_budget(uint8_t end_line)
+{
+	return process(TRUE, end_line);
 }
 
 void lsd_init(void)
 {
 	uart_init();
 	memset(&d, 0, sizeof(struct lsd_data));
-	d.rx.stat = LSD_RECV_IDLE;
+	d.rx.stat = LSD_RECV_STX;
+#ifdef LSD_CAPTURE
+	memset(&lsd_cap, 0, sizeof(struct lsd_capture));
+	lsd_cap.magic = LSD_CAPTURE_MAGIC;
+	lsd_cap.rec_len = sizeof(struct lsd_cap_rec);
+	lsd_cap.rec_num = LSD_CAPTURE_RECS;
+#endif
+	d.max_ch = LSD_STD_MAX_CH;
+	d.link.ch = LSD_LINK_CH;
+	d.link.total = 1;
+	d.link.one.buf = (const char*)&d.link_msg;
+	d.link.one.len = 1;
+	d.link.iov = &d.link.one;
+	d.link.iovcnt = 1;
+	d.link_post.buf = (char*)&d.link_rx;
+	d.link_post.max = 1;
 	lsd_line_sync();
 }
 
+const struct lsd_stats *lsd_stats_get(void)
+{
+	overrun_check();
+
+	return &d.stats;
+}
+
+void lsd_stats_reset(void)
+{
+	memset(&d.stats, 0, sizeof(struct lsd_stats));
+}
+
+#ifdef LSD_CAPTURE
+const struct lsd_capture *lsd_capture_get(void)
+{
+	return &lsd_cap;
+}
+
+void lsd_capture_tick(void)
+{
+	lsd_cap.frame++;
+}
+#endif
+
+enum lsd_status lsd_crc_set(uint8_t enable)
+{
+	// Retransmissions would never be timed
+	if (enable && !d.vint_run) {
+		return LSD_STAT_ERROR;
+	}
+	d.crc = enable;
+	d.tx_seq = 0;
+	d.rx_seq = 0;
+	d.rx_skip = 0;
+	d.rx_wait = FALSE;
+	d.link_pend = LSD_LINK_NONE;
+
+	return LSD_STAT_COMPLETE;
+}
+
+void lsd_ring_set(char *buf, uint16_t len)
+{
+	memset(&d.ring, 0, sizeof(struct lsd_ring));
+	d.ring.buf = buf;
+	d.ring.size = len;
+	if (buf) {
+		rx_resume();
+	}
+}
+
+int lsd_ring_peek(int16_t ch, struct lsd_ring_frame *frame)
+{
+	struct lsd_ring *r = &d.ring;
+	uint16_t pos = r->tail;
+	uint16_t used = 0;
+	struct ring_hdr *hdr;
+
+	while (used < r->used) {
+		hdr = (struct ring_hdr*)(r->buf + pos);
+		if (hdr->flags & RING_WRAP) {
+			used += r->size - pos;
+			pos = 0;
+			continue;
+		}
+		if (!(hdr->flags & RING_RELEASED) &&
+				(LSD_RING_ANY == ch || hdr->ch == ch)) {
+			frame->data = (char*)(hdr + 1);
+			frame->len = hdr->len;
+			frame->ch = hdr->ch;
+			return TRUE;
+		}
+		used += RING_ALIGN(sizeof(struct ring_hdr) + hdr->len);
+		pos = (pos + RING_ALIGN(sizeof(struct ring_hdr) + hdr->len)) &
+			(r->size - 1);
+	}
+
+	return FALSE;
+}
+
+void lsd_ring_release(const struct lsd_ring_frame *frame)
+{
+	struct lsd_ring *r = &d.ring;
+	struct ring_hdr *hdr = ((struct ring_hdr*)frame->data) - 1;
+	uint16_t len;
+
+	LOCK();
+	hdr->flags |= RING_RELEASED;
+
+	// Reclaim released frames at the tail
+	while (r->used) {
+		hdr = (struct ring_hdr*)(r->buf + r->tail);
+		if (hdr->flags & RING_WRAP) {
+			len = r->size - r->tail;
+		} else if (hdr->flags & RING_RELEASED) {
+			len = RING_ALIGN(sizeof(struct ring_hdr) + hdr->len);
+		} else {
+			break;
+		}
+		r->used -= len;
+		r->tail = (r->tail + len) & (r->size - 1);
+	}
+	rx_resume();
+	UNLOCK();
+}
+
+void lsd_ext_set(uint8_t enable)
+{
+	d.ext = enable;
+	d.max_ch = enable ? LSD_MAX_CH : LSD_STD_MAX_CH;
+	d.link.ch = enable ? LSD_LINK_CH_EXT : LSD_LINK_CH;
+}
+
+void lsd_lz_set(uint8_t enable)
+{
+	d.lz = enable;
+}
+
 int lsd_ch_enable(uint8_t ch)
 {
 	if (ch >= LSD_MAX_CH) {
@@ -264,52 +1456,225 @@ int lsd_ch_disable(uint8_t ch)
 	return LSD_STAT_COMPLETE;
 }
 
-/// \todo Should we call the send callback on errors?
-enum lsd_status lsd_send(uint8_t ch, const char *data, int16_t len,
-		void *ctx, lsd_send_cb send_cb)
+void lsd_ch_skip(uint8_t ch)
+{
+	if (ch < LSD_MAX_CH) {
+		LOCK();
+		d.ch_skip |= 1<<ch;
+		UNLOCK();
+	}
+}
+
+int lsd_ch_skipping(uint8_t ch)
+{
+	return ch < LSD_MAX_CH && (d.ch_skip & (1<<ch)) ? TRUE : FALSE;
+}
+
+void lsd_ch_hold(uint8_t ch, uint8_t hold)
 {
-	if (d.tx.stat > LSD_SEND_IDLE) {
+	if (ch < LSD_MAX_CH) {
+		LOCK();
+		if (hold) {
+			d.ch_hold |= 1<<ch;
+		} else {
+			d.ch_hold &= ~(1<<ch);
+		}
+		UNLOCK();
+	}
+}
+
+/// Checks if a frame can be queued for sending.
+static enum lsd_status send_check(uint8_t ch, int32_t len)
+{
+	if (d.tx_count >= LSD_TX_QUEUE_LEN) {
 		return LSD_STAT_ERR_IN_PROGRESS;
 	}
-	if (ch >= LSD_MAX_CH || !d.ch_enable[ch]) {
+	if (ch >= d.max_ch || !d.ch_enable[ch]) {
 		return LSD_STAT_ERR_INVALID_CH;
 	}
 	if (len > LSD_MAX_LEN) {
 		return LSD_STAT_ERR_FRAME_TOO_LONG;
 	}
 
-	d.tx.ch = ch;
-	d.tx.buf = data;
-	d.tx.total = len;
-	d.tx.cb = send_cb;
-	d.tx.ctx = ctx;
-	d.tx.pos = 0;
-	d.tx.stat = LSD_SEND_STX;
+	return LSD_STAT_COMPLETE;
+}
+
+/// Fills the free TX descriptor at the ring head and queues it.
+static void send_queue(uint8_t ch, const struct lsd_iov *iov, uint8_t iovcnt,
+		int16_t total, void *ctx, lsd_send_cb send_cb)
+{
+	struct send_data *tx = &d.tx[d.tx_head];
+
+	LOCK();
+	tx->ch = ch;
+	tx->iov = iov;
+	tx->iovcnt = iovcnt;
+	tx->seg = 0;
+	tx->left = 0;
+	tx->total = total;
+	tx->cb = send_cb;
+	tx->ctx = ctx;
+	tx->stat = LSD_SEND_STX;
+	d.tx_head = TX_NEXT(d.tx_head);
+	d.tx_count++;
+	UNLOCK();
+}
+
+/// \todo Should we call the send callback on errors?
+enum lsd_status lsd_send(uint8_t ch, const char *data, int16_t len,
+		void *ctx, lsd_send_cb send_cb)
+{
+	struct send_data *tx;
+	enum lsd_status stat;
+
+	stat = send_check(ch, len);
+	if (stat) {
+		return stat;
+	}
+
+	tx = &d.tx[d.tx_head];
+	tx->one.buf = data;
+	tx->one.len = len;
+	send_queue(ch, &tx->one, 1, len, ctx, send_cb);
 
 	return LSD_STAT_BUSY;
 }
 
+enum lsd_status lsd_sendv(uint8_t ch, const struct lsd_iov *iov,
+		uint8_t iovcnt, void *ctx, lsd_send_cb send_cb)
+{
+	enum lsd_status stat;
+	int32_t total = 0;
+
+	// Frame length goes in the header, so compute it up front
+	for (uint8_t i = 0; i < iovcnt; i++) {
+		if (iov[i].len < 0) {
+			return LSD_STAT_ERROR;
+		}
+		total += iov[i].len;
+	}
+
+	stat = send_check(ch, total);
+	if (stat) {
+		return stat;
+	}
+	send_queue(ch, iov, iovcnt, total, ctx, send_cb);
+
+	return LSD_STAT_BUSY;
+}
+
+static void post_set(struct recv_post *post, char *buf, int16_t len,
+		void *ctx, lsd_recv_cb recv_cb)
+{
+	LOCK();
+	if (!post->buf && buf) {
+		d.posted++;
+		rx_resume();
+	} else if (post->buf && !buf) {
+		d.posted--;
+		// Discard the rest of the frame being received to the buffer
+		if (d.rx.post == post) {
+			d.rx.post = NULL;
+		}
+		if (d.rx.held == post) {
+			d.rx.held = NULL;
+		}
+	}
+	post->max = len;
+	post->cb = recv_cb;
+	post->ctx = ctx;
+	post->buf = buf;
+	UNLOCK();
+}
+
 enum lsd_status lsd_recv(char *buf, int16_t len, void *ctx, lsd_recv_cb recv_cb)
 {
 	if (len >= (LSD_MAX_LEN + 1)) {
 		return LSD_STAT_ERR_FRAME_TOO_LONG;
 	}
 
-	if (LSD_RECV_IDLE == d.rx.stat) {
-		d.rx.stat = LSD_RECV_STX;
-	} else if (LSD_RECV_PARTIAL == d.rx.stat) {
-		d.rx.pos = 0;
-		d.rx.stat = LSD_RECV_DATA;
+	post_set(&d.any, buf, len, ctx, recv_cb);
+
+	return LSD_STAT_BUSY;
+}
+
+enum lsd_status lsd_ch_recv(uint8_t ch, char *buf, int16_t len, void *ctx,
+		lsd_recv_cb recv_cb)
+{
+	if (ch >= LSD_MAX_CH) {
+		return LSD_STAT_ERR_INVALID_CH;
+	}
+	if (len >= (LSD_MAX_LEN + 1)) {
+		return LSD_STAT_ERR_FRAME_TOO_LONG;
 	}
 
-	d.rx.buf = buf;
-	d.rx.max = len;
-	d.rx.cb = recv_cb;
-	d.rx.ctx = ctx;
+	post_set(&d.post[ch], buf, len, ctx, recv_cb);
 
 	return LSD_STAT_BUSY;
 }
 
+enum lsd_status lsd_side_recv(char *buf, int16_t len, void *ctx,
+		lsd_recv_cb recv_cb)
+{
+	if (len >= (LSD_MAX_LEN + 1)) {
+		return LSD_STAT_ERR_FRAME_TOO_LONG;
+	}
+	if (side_busy()) {
+		return LSD_STAT_ERR_IN_PROGRESS;
+	}
+
+	post_set(&d.side, buf, len, ctx, recv_cb);
+
+	return LSD_STAT_BUSY;
+}
+
+void lsd_side_enable(uint8_t enable)
+{
+	d.side_on = enable;
+}
+
+int lsd_side_end(uint8_t ch)
+{
+	int done = FALSE;
+
+	if (ch >= LSD_MAX_CH) {
+		return TRUE;
+	}
+	LOCK();
+	// A frame being received to the side buffer must be delivered first
+	if (d.rx.ch != ch || !side_busy()) {
+		d.side_ch &= ~(1<<ch);
+		done = TRUE;
+	}
+	UNLOCK();
+
+	return done;
+}
+
+int16_t lsd_deliver(uint8_t ch, const char *data, int16_t len)
+{
+	struct recv_post *post;
+
+	if (ch >= LSD_MAX_CH) {
+		return -1;
+	}
+	LOCK();
+	post = d.post[ch].buf ? &d.post[ch] : d.any.buf ? &d.any : NULL;
+	if (!post || (!post->max && len) || d.rx.post == post ||
+			d.rx.held == post) {
+		// No buffer, or busy with a frame from the UART
+		len = -1;
+	} else {
+		// As frames from the UART, delivered in parts if too long
+		len = MIN(len, post->max);
+		memcpy(post->buf, data, len);
+		post_done(post, LSD_STAT_COMPLETE, ch, len);
+	}
+	UNLOCK();
+
+	return len;
+}
+
 enum lsd_status lsd_send_sync(uint8_t ch, const char *data, int16_t len)
 {
 	enum lsd_status stat;
@@ -320,39 +1685,55 @@ enum lsd_status lsd_send_sync(uint8_t ch, const char *data, int16_t len)
 		return stat;
 	}
 
-	// Poll until sending is completed
-	while (d.tx.stat > LSD_SEND_IDLE) {
+	// Frames are sent in order, so ours is done when the queue drains
+	while (d.tx_count) {
 		lsd_process();
 	}
 
-	if (LSD_SEND_IDLE == d.tx.stat) {
-		return LSD_STAT_COMPLETE;
-	} else {
-		return LSD_STAT_ERROR;
-	}
+	return LSD_STAT_COMPLETE;
+}
+
+/// Reception result for lsd_recv_sync()
+struct sync_recv {
+	enum lsd_status stat;	///< Reception status
+	uint16_t len;		///< Received length
+	uint8_t ch;		///< Reception channel
+	uint8_t done;		///< Reception finished
+};
+
+static void sync_recv_cb(enum lsd_status stat, uint8_t ch, char *data,
+		uint16_t len, void *ctx)
+{
+	struct sync_recv *res = (struct sync_recv*)ctx;
+	UNUSED_PARAM(data);
+
+	res->stat = stat;
+	res->ch = ch;
+	res->len = len;
+	res->done = TRUE;
 }
 
 enum lsd_status lsd_recv_sync(char *buf, uint16_t *len, uint8_t *ch)
 {
+	struct sync_recv res = {};
 	enum lsd_status stat;
 
-	stat = lsd_recv(buf, *len, NULL, NULL);
+	stat = lsd_recv(buf, *len, &res, sync_recv_cb);
 
 	if (stat <= LSD_STAT_COMPLETE) {
 		return stat;
 	}
 
-	while (d.rx.stat > LSD_RECV_IDLE) {
+	while (!res.done) {
 		lsd_process();
 	}
 
-	if (LSD_RECV_IDLE == d.rx.stat) {
-		*len = d.rx.pos;
-		*ch = d.rx.ch;
-		return LSD_STAT_COMPLETE;
-	} else {
-		return LSD_STAT_ERROR;
+	if (LSD_STAT_COMPLETE == res.stat) {
+		*len = res.len;
+		*ch = res.ch;
 	}
+
+	return res.stat;
 }
 
 void lsd_line_sync(void)
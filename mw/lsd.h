@@ -3,8 +3,8 @@
  *         protocol to link two full-duplex devices, multiplexing the
  *         data link.
  *
- * The multiplexing facility allows having up to LSD_MAX_CH simultaneous
- * channels on the serial link.
+ * The multiplexing facility allows having up to LSD_STD_MAX_CH simultaneous
+ * channels on the serial link, or LSD_MAX_CH when using the extended header.
  *
  * The module has synchronous functions to send/receive data (easy to use, but
  * due to polling hang the console until transfer is complete) and their
@@ -39,6 +39,44 @@
  *   data length.
  * - LENL is the low 8 bits of the data length.
  * - DATA is the payload, of the previously specified length.
+ *
+ * When CRC mode is enabled (see lsd_crc_set()), frame format is:
+ *
+ * STX : CH-LENH : LENL : SEQ : DATA : CRCH : CRCL : ETX
+ *
+ * - SEQ is the 8-bit frame sequence number.
+ * - CRCH:CRCL is the CRC-16/CCITT of the fields from CH-LENH to DATA.
+ *
+ * In CRC mode the receiver acknowledges frames using link control frames
+ * on channel 0xF, with one byte of payload (ACK or NAK) and SEQ set to the
+ * referenced sequence number. Frames are kept until acknowledged, and the
+ * sender resends unacknowledged frames when it gets a NAK or when no
+ * acknowledge arrives in time (go-back-N). Payload only reaches the
+ * application once its frame has passed the CRC and sequence checks. When
+ * a frame does not fit in the posted buffer, the part received is delivered
+ * once checked, and the receiver answers with a NAK for the same frame,
+ * skipping the part already delivered when it is resent.
+ *
+ * When the extended header is enabled (see lsd_ext_set()), the channel uses
+ * a whole byte, and the CH-LENH field only holds the length high bits:
+ *
+ * STX : CH : LENH : LENL : DATA : ETX
+ *
+ * CRC mode fields are added the same way as with the standard header, and
+ * link control frames use channel 0xFF. If LZ4 compression is enabled (see
+ * lsd_lz_set()) and bit 7 of LENH is set, DATA is compressed:
+ *
+ * DATA = DLENH : DLENL : LZ4 block
+ *
+ * - DLENH:DLENL is the length of the decompressed data, big endian.
+ * - LZ4 block is the data compressed as an LZ4 block (see lz4.h).
+ *
+ * LEN counts the compressed DATA, and the CRC covers it as sent. The payload
+ * is decompressed straight into the posted buffer (or the RX ring) as it
+ * arrives, so the buffer only needs room for the decompressed data. Frames
+ * decompressing to more than the posted buffer fit fail with
+ * LSD_STAT_ERR_FRAME_TOO_LONG, and corrupt ones with
+ * LSD_STAT_ERR_DECOMPRESS. Compressed frames are never delivered in parts.
  */
 #ifndef _LSD_H_
 #define _LSD_H_
@@ -49,8 +87,14 @@
 /// LSD frame overhead in bytes
 #define LSD_OVERHEAD		4
 
-/// Maximum number of available simultaneous channels
-#define LSD_MAX_CH		4
+/// LSD frame overhead in bytes, extended header
+#define LSD_OVERHEAD_EXT	5
+
+/// Maximum number of available simultaneous channels (extended header)
+#define LSD_MAX_CH		16
+
+/// Number of available simultaneous channels with the standard header
+#define LSD_STD_MAX_CH		4
 
 /// Maximum data payload length
 #define LSD_MAX_LEN		 4095
@@ -58,8 +102,95 @@
 /// Number of buffer frames available
 #define LSD_BUF_FRAMES		2
 
+/// Maximum scanlines used by each lsd_vint_service() call
+#define LSD_VINT_LINES		16
+
+/// Number of frames that can be queued for sending. Must be a power of 2.
+#define LSD_TX_QUEUE_LEN	4
+
+#ifdef LSD_CAPTURE
+/// Number of frames recorded in the capture ring. Must be a power of 2.
+#ifndef LSD_CAPTURE_RECS
+#define LSD_CAPTURE_RECS	64
+#endif
+
+/// Payload bytes recorded for each captured frame. Must be even and less
+/// than 256.
+#ifndef LSD_CAPTURE_PREFIX
+#define LSD_CAPTURE_PREFIX	16
+#endif
+
+/// Capture ring magic number ("LSDC")
+#define LSD_CAPTURE_MAGIC	0x4C534443
+
+/// Captured frame flags
+enum lsd_cap_flags {
+	LSD_CAP_TX = 0x01,	///< Frame was sent (received otherwise)
+	LSD_CAP_ERR = 0x02,	///< Frame was received with errors
+	LSD_CAP_CRC = 0x04	///< Frame uses CRC mode format
+};
+
+/// Captured frame
+struct lsd_cap_rec {
+	uint16_t frame;		///< Video frame counter (see lsd_capture_tick())
+	uint16_t hv;		///< VDP H/V counter
+	uint16_t len;		///< Frame payload length
+	uint8_t ch;		///< Frame channel
+	uint8_t flags;		///< Frame flags (see lsd_cap_flags)
+	uint8_t seq;		///< Sequence number (CRC mode only)
+	uint8_t cap_len;	///< Payload bytes captured
+	uint8_t data[LSD_CAPTURE_PREFIX];	///< Payload prefix
+};
+
+/// Capture ring. Dump it from RAM and convert it using tools/lsd_pcap.py.
+struct lsd_capture {
+	uint32_t magic;		///< Set to LSD_CAPTURE_MAGIC
+	uint16_t rec_len;	///< Length of each record
+	uint16_t rec_num;	///< Number of records in the ring
+	uint32_t count;		///< Number of frames captured, including lost
+	uint16_t frame;		///< Current video frame counter
+	uint16_t reserved;	///< Reserved, set to 0
+	struct lsd_cap_rec rec[LSD_CAPTURE_RECS];	///< Record ring
+};
+#endif
+
+/// Use with lsd_ring_peek() to get frames from any channel
+#define LSD_RING_ANY		-1
+
+/// Frame stored in the RX ring
+struct lsd_ring_frame {
+	char *data;		///< Frame payload
+	int16_t len;		///< Payload length
+	uint8_t ch;		///< Frame channel
+};
+
+/// Per channel link statistics
+struct lsd_ch_stats {
+	uint32_t tx_frames;	///< Frames sent
+	uint32_t tx_bytes;	///< Payload bytes sent
+	uint32_t rx_frames;	///< Frames received
+	uint32_t rx_bytes;	///< Payload bytes received
+};
+
+/// Link statistics
+struct lsd_stats {
+	struct lsd_ch_stats ch[LSD_MAX_CH];	///< Per channel statistics
+	uint16_t framing_err;	///< Frames without proper ETX or length
+	uint16_t invalid_ch;	///< Frames for invalid or disabled channels
+	uint16_t partial;	///< Frames not fitting in the posted buffer
+	uint16_t overrun;	///< UART RX overruns detected
+	uint16_t crc_err;	///< Frames failing CRC check (CRC mode)
+	uint16_t retx;		///< Frames retransmitted (CRC mode)
+	uint16_t dropped;	///< Frames too long for the RX ring
+	uint32_t idle_polls;	///< lsd_process() calls finding no work
+	uint16_t vint_skipped;	///< VBLANK services skipped (LSD was busy)
+	uint8_t vint_lines;	///< Scanlines used by the last VBLANK service
+	uint8_t vint_lines_max;	///< Maximum scanlines used by VBLANK service
+};
+
 /// Return status codes for LSD functions
 enum lsd_status {
+	LSD_STAT_ERR_DECOMPRESS = -7,		///< Compressed payload is corrupt
 	LSD_STAT_ERR_FRAMING = -5,		///< Frame format error
 	LSD_STAT_ERR_INVALID_CH = -4,		///< Invalid channel
 	LSD_STAT_ERR_FRAME_TOO_LONG = -3,	///< Frame is too long
@@ -69,9 +200,16 @@ enum lsd_status {
 	LSD_STAT_BUSY = 1			///< Doing requested operation
 };
 
+/// Data segment for the lsd_sendv() function.
+struct lsd_iov {
+	const char *buf;	///< Segment data
+	int16_t len;		///< Segment length in bytes
+};
+
 /// Callback for the asynchronous lsd_send() function.
 typedef void (*lsd_send_cb)(enum lsd_status stat, void *ctx);
-/// Callback for the asynchronous lsd_recv() function.
+/// Callback for the asynchronous lsd_recv() function. On errors, ch is the
+/// channel of the failed frame, or 0 if the channel is invalid.
 typedef void (*lsd_recv_cb)(enum lsd_status stat, uint8_t ch,
 		char *data, uint16_t len, void *ctx);
 
@@ -98,10 +236,49 @@ int lsd_ch_enable(uint8_t ch);
  ****************************************************************************/
 int lsd_ch_disable(uint8_t ch);
 
+/************************************************************************//**
+ * \brief Discards the next frame received on a channel.
+ *
+ * The frame is received and dropped even if a buffer is posted for the
+ * channel, that is kept for the following frames. Used to get rid of
+ * replies known to be stale.
+ *
+ * \param[in] ch Channel number.
+ ****************************************************************************/
+void lsd_ch_skip(uint8_t ch);
+
+/************************************************************************//**
+ * \brief Checks if the next frame of a channel is still to be discarded.
+ *
+ * \param[in] ch Channel number.
+ *
+ * \return TRUE if the frame requested with lsd_ch_skip() was not received
+ * yet, FALSE otherwise.
+ ****************************************************************************/
+int lsd_ch_skipping(uint8_t ch);
+
+/************************************************************************//**
+ * \brief Makes the frames of a channel wait for a buffer posted for it.
+ *
+ * Frames on a held channel are only received to the buffer posted with
+ * lsd_ch_recv(). While there is none, they wait in the UART (and so do the
+ * frames behind them, for all channels) instead of going to the buffer
+ * posted with lsd_recv(), the RX ring or the side buffer. The rest of a
+ * frame partially received also waits. Used when data must not be lost
+ * nor reordered, e.g. for byte streams.
+ *
+ * \param[in] ch   Channel number.
+ * \param[in] hold TRUE to hold the channel, FALSE to release it.
+ ****************************************************************************/
+void lsd_ch_hold(uint8_t ch, uint8_t hold);
 
 /************************************************************************//**
  * \brief Asynchronously sends data through a previously enabled channel.
  *
+ * Frames are queued and sent in order, back to back. Up to LSD_TX_QUEUE_LEN
+ * frames can be queued at once. The data buffer must not be modified until
+ * the send callback runs.
+ *
  * \param[in] ch      Channel number to use.
  * \param[in] data    Buffer to send.
  * \param[in] len     Length of the buffer to send.
@@ -110,12 +287,33 @@ int lsd_ch_disable(uint8_t ch);
  *
  * \return Status of the send procedure. Usually LSD_STAT_BUSY is returned,
  * and the send procedure is then performed in background.
- * \note Calling this function while there is a send procedure in progress,
- * will cause the function call to fail with LSD_STAT_SEND_ERR_IN_PROGRESS.
+ * \note Calling this function while the send queue is full, will cause the
+ * function call to fail with LSD_STAT_ERR_IN_PROGRESS.
  ****************************************************************************/
 enum lsd_status lsd_send(uint8_t ch, const char *data, int16_t len,
 		void *ctx, lsd_send_cb send_cb);
 
+/************************************************************************//**
+ * \brief Asynchronously sends a frame gathering data from several segments.
+ *
+ * The frame payload is the concatenation of the segments, in order. This
+ * avoids copying e.g. a header and a body to a single buffer before sending
+ * them. Segments can be located in ROM.
+ *
+ * \param[in] ch      Channel number to use.
+ * \param[in] iov     Array with the segments to send.
+ * \param[in] iovcnt  Number of segments in iov.
+ * \param[in] ctx     Context for the send callback function.
+ * \param[in] send_cb Callback to run when send completes or errors.
+ *
+ * \return Status of the send procedure. Usually LSD_STAT_BUSY is returned,
+ * and the send procedure is then performed in background.
+ * \warning Neither the iov array nor the segment data can be modified until
+ * the send callback runs.
+ ****************************************************************************/
+enum lsd_status lsd_sendv(uint8_t ch, const struct lsd_iov *iov,
+		uint8_t iovcnt, void *ctx, lsd_send_cb send_cb);
+
 /************************************************************************//**
  * \brief Synchronously sends data through a previously enabled channel.
  *
@@ -131,6 +329,9 @@ enum lsd_status lsd_send_sync(uint8_t ch, const char *data, int16_t len);
 /************************************************************************//**
  * \brief Asyncrhonously Receives a frame using LSD protocol.
  *
+ * The buffer receives frames from any channel that does not have its own
+ * buffer posted with lsd_ch_recv().
+ *
  * \param[in] buf     Buffer for reception.
  * \param[in] len     Buffer length.
  * \param[in] ctx     Context for the receive callback function.
@@ -141,6 +342,92 @@ enum lsd_status lsd_send_sync(uint8_t ch, const char *data, int16_t len);
 enum lsd_status lsd_recv(char *buf, int16_t len, void *ctx,
 		lsd_recv_cb recv_cb);
 
+/************************************************************************//**
+ * \brief Asyncrhonously Receives a frame on the specified channel.
+ *
+ * Each channel can have its own buffer posted, and frames are routed to it
+ * as soon as the frame header is decoded, regardless of the buffers posted
+ * to other channels. Frames on channels without a posted buffer go to the
+ * buffer posted with lsd_recv(), to the RX ring or to the side buffer (see
+ * lsd_side_recv()), unless the channel is held (see lsd_ch_hold()). If
+ * there is none, the frame waits in the UART (stopping
+ * the peer with RTS, so frames for other channels also wait) until a buffer
+ * for it is posted.
+ *
+ * \param[in] ch      Channel number to receive from.
+ * \param[in] buf     Buffer for reception. NULL cancels the reception
+ *                    (without running the callback), discarding the rest
+ *                    of the frame being received to the buffer, if any.
+ * \param[in] len     Buffer length.
+ * \param[in] ctx     Context for the receive callback function.
+ * \param[in] recv_cb Callback to run when receive completes or errors.
+ *
+ * \return Status of the receive procedure.
+ ****************************************************************************/
+enum lsd_status lsd_ch_recv(uint8_t ch, char *buf, int16_t len, void *ctx,
+		lsd_recv_cb recv_cb);
+
+/************************************************************************//**
+ * \brief Posts the side buffer, receiving whole frames that would otherwise
+ * wait in the UART for lack of a buffer.
+ *
+ * While enabled with lsd_side_enable(), frames on channels without a buffer
+ * go to the side buffer if they fit whole in it, and then later frames on
+ * these channels also go there, keeping their order, until lsd_side_end()
+ * is called. The callback gets them as any other receive callback. Once a
+ * frame completes, the buffer is no longer posted until this function is
+ * called again, which can be done from the callback.
+ *
+ * \param[in] buf     Buffer for reception. NULL cancels the reception.
+ * \param[in] len     Buffer length.
+ * \param[in] ctx     Context for the receive callback function.
+ * \param[in] recv_cb Callback to run when receive completes or errors.
+ *
+ * \return LSD_STAT_BUSY on success, or LSD_STAT_ERR_IN_PROGRESS if a frame
+ * is being received to the side buffer.
+ ****************************************************************************/
+enum lsd_status lsd_side_recv(char *buf, int16_t len, void *ctx,
+		lsd_recv_cb recv_cb);
+
+/************************************************************************//**
+ * \brief Enables or disables sending frames for channels without a buffer
+ * to the side buffer.
+ *
+ * Channels already sending their frames to the side buffer keep doing so
+ * until lsd_side_end() is called.
+ *
+ * \param[in] enable TRUE to enable, FALSE to disable.
+ ****************************************************************************/
+void lsd_side_enable(uint8_t enable);
+
+/************************************************************************//**
+ * \brief Stops sending the frames of a channel to the side buffer.
+ *
+ * Call it when all the frames of the channel in the side buffer have been
+ * delivered (see lsd_deliver()), or from the callback of the side buffer.
+ *
+ * \param[in] ch Channel number.
+ *
+ * \return TRUE on success, FALSE if a frame of the channel is being
+ * received to the side buffer: call again once it completes.
+ ****************************************************************************/
+int lsd_side_end(uint8_t ch);
+
+/************************************************************************//**
+ * \brief Delivers data of a frame to the buffer posted for a channel, with
+ * lsd_ch_recv() or lsd_recv(), running its callback.
+ *
+ * Frames longer than the buffer are delivered in parts, as with the frames
+ * received from the UART.
+ *
+ * \param[in] ch   Channel of the frame.
+ * \param[in] data Frame data.
+ * \param[in] len  Length of the data.
+ *
+ * \return Bytes delivered, or -1 if there is no buffer available.
+ ****************************************************************************/
+int16_t lsd_deliver(uint8_t ch, const char *data, int16_t len);
+
 /************************************************************************//**
  * \brief Syncrhonously Receives a frame using LSD protocol.
  *
@@ -163,6 +450,62 @@ enum lsd_status lsd_recv_sync(char *buf, uint16_t *len, uint8_t *ch);
  ****************************************************************************/
 void lsd_process(void);
 
+/************************************************************************//**
+ * \brief Processes sends/receives pending data, until there is nothing to
+ * do or the VDP reaches the specified scanline.
+ *
+ * Use it instead of lsd_process() to bound the CPU time used for the link
+ * on each frame. State is kept when the deadline is reached, so the next
+ * call resumes the transfers where they were left. The deadline is checked
+ * at least every UART_TX_FIFO_LEN bytes.
+ *
+ * \param[in] end_line Scanline (VDP V counter value) at which processing
+ *            stops. Must be less than 128 lines ahead of the current one.
+ *
+ * \return TRUE if processing stopped because of the deadline, FALSE if
+ *         there was nothing more to do.
+ ****************************************************************************/
+int lsd_process_budget(uint8_t end_line);
+
+/************************************************************************//**
+ * \brief Moves data between the UART and the buffers, from the VBLANK
+ * interrupt.
+ *
+ * Keeps the link running when the game does not give CPU time to
+ * lsd_process() for a while. Runs at most LSD_VINT_LINES scanlines, and only
+ * the parts of the transfers that do not complete frames, so callbacks are
+ * never run in interrupt context: lsd_process() must still be called to
+ * complete them. The service is skipped if it interrupts other LSD code.
+ * Scanlines used are reported in the vint_lines and vint_lines_max stats
+ * (each scanline is about 488 CPU cycles).
+ *
+ * Call it from the VBLANK interrupt handler, or use lsd_vint_enable() if the
+ * game does not have its own handler.
+ ****************************************************************************/
+void lsd_vint_service(void);
+
+/************************************************************************//**
+ * \brief Sets lsd_vint_service() as the VBLANK interrupt callback, using
+ * vint_cb_set().
+ ****************************************************************************/
+void lsd_vint_enable(void);
+
+/************************************************************************//**
+ * \brief Checks if lsd_vint_service() has run, as CRC mode requires.
+ *
+ * \return TRUE if the service has been called at least once, FALSE
+ *         otherwise.
+ ****************************************************************************/
+int lsd_vint_running(void);
+
+/************************************************************************//**
+ * \brief Gets the number of lsd_vint_service() calls, wrapping at 256.
+ *
+ * \return Frame counter, usable to time events if the service runs on every
+ *         VBLANK.
+ ****************************************************************************/
+uint8_t lsd_frames_get(void);
+
 /************************************************************************//**
  * \brief Sends syncrhonization frame.
  *
@@ -172,6 +515,135 @@ void lsd_process(void);
  ****************************************************************************/
 void lsd_line_sync(void);
 
+/************************************************************************//**
+ * \brief Gets the link statistics.
+ *
+ * \return Pointer to the statistics, updated as lsd_process() runs.
+ *
+ * \note The UART overrun flag is sampled on reception errors and by this
+ *       function. Polling the UART also clears it, so overruns are not all
+ *       counted; the frames they corrupt are counted as framing or CRC
+ *       errors.
+ ****************************************************************************/
+const struct lsd_stats *lsd_stats_get(void);
+
+/************************************************************************//**
+ * \brief Sets all the link statistics counters to 0.
+ ****************************************************************************/
+void lsd_stats_reset(void);
+
+#ifdef LSD_CAPTURE
+/************************************************************************//**
+ * \brief Gets the frame capture ring.
+ *
+ * Sent and received frames are recorded into the ring as they complete. The
+ * ring is always available as the lsd_cap symbol, so it can also be dumped
+ * from a debugger or emulator.
+ *
+ * \return Pointer to the capture ring.
+ ****************************************************************************/
+const struct lsd_capture *lsd_capture_get(void);
+
+/************************************************************************//**
+ * \brief Advances the capture video frame counter. Call it once per frame
+ * (e.g. from the VBLANK callback) to get absolute timestamps.
+ ****************************************************************************/
+void lsd_capture_tick(void);
+#endif
+
+/************************************************************************//**
+ * \brief Enables or disables CRC mode.
+ *
+ * In CRC mode frames carry a sequence number and a CRC, and are
+ * retransmitted until the peer acknowledges them. Both ends of the link must
+ * agree on the mode, so this function is usually called after negotiating
+ * it with the peer.
+ *
+ * Frames not acknowledged are resent after about 500 ms, timed by counting
+ * the calls to lsd_vint_service(), so it must run on every VBLANK (see
+ * lsd_vint_enable()). Without it, a lost frame the peer does not ask for
+ * would never be resent, so enabling is refused until the service runs.
+ *
+ * Received frames with a bad CRC are not delivered: the peer is asked to
+ * resend them. Frames for channels without a buffer (see lsd_ch_recv())
+ * do not wait in the UART, so link control frames behind them still get
+ * through: they are dropped, and asked for again when a buffer is posted.
+ *
+ * \param[in] enable TRUE to enable CRC mode, FALSE to disable it.
+ *
+ * \return LSD_STAT_COMPLETE on success, LSD_STAT_ERROR if enabling while
+ * lsd_vint_service() has never run (see lsd_vint_running()).
+ *
+ * \warning Call only when there are no frames being sent or received.
+ ****************************************************************************/
+enum lsd_status lsd_crc_set(uint8_t enable);
+
+/************************************************************************//**
+ * \brief Enables or disables continuous reception into a RAM ring.
+ *
+ * While the ring is enabled, frames for channels without a buffer posted
+ * with lsd_ch_recv() or lsd_recv() are stored in the ring, so reception
+ * never stops waiting for the application to post a buffer. Frames are
+ * read in place with lsd_ring_peek() and freed with lsd_ring_release().
+ * When the ring is full, data is kept in the UART (stopping the peer with
+ * RTS) until frames are released.
+ *
+ * \param[in] buf Ring buffer, aligned to 4 bytes. NULL disables the ring.
+ * \param[in] len Ring buffer length. Must be a power of 2. Frames longer
+ *            than len - 4 bytes are dropped, so make it at least twice the
+ *            largest frame expected.
+ *
+ * \warning Call only when there are no frames being received.
+ ****************************************************************************/
+void lsd_ring_set(char *buf, uint16_t len);
+
+/************************************************************************//**
+ * \brief Gets the oldest not released frame from the RX ring.
+ *
+ * The frame stays in the ring until released, so calling this function
+ * again without releasing it returns the same frame.
+ *
+ * \param[in]  ch    Channel to get the frame from, or LSD_RING_ANY.
+ * \param[out] frame Frame found in the ring.
+ *
+ * \return TRUE if a frame was found, FALSE otherwise.
+ ****************************************************************************/
+int lsd_ring_peek(int16_t ch, struct lsd_ring_frame *frame);
+
+/************************************************************************//**
+ * \brief Releases a frame obtained with lsd_ring_peek(). Frames can be
+ * released in any order, but ring space is only reclaimed when the oldest
+ * frame is released.
+ *
+ * \param[in] frame Frame to release.
+ ****************************************************************************/
+void lsd_ring_release(const struct lsd_ring_frame *frame);
+
+/************************************************************************//**
+ * \brief Enables or disables the extended header.
+ *
+ * The extended header allows using LSD_MAX_CH channels instead of
+ * LSD_STD_MAX_CH. Both ends of the link must agree on the header format,
+ * so this function is usually called after negotiating it with the peer.
+ *
+ * \param[in] enable TRUE to enable the extended header, FALSE to disable it.
+ *
+ * \warning Call only when there are no frames being sent or received.
+ ****************************************************************************/
+void lsd_ext_set(uint8_t enable);
+
+/************************************************************************//**
+ * \brief Enables or disables reception of LZ4 compressed frames.
+ *
+ * Compressed frames need the extended header (see lsd_ext_set()). While
+ * disabled, frames flagged as compressed are framing errors.
+ *
+ * \param[in] enable TRUE to accept compressed frames, FALSE otherwise.
+ *
+ * \warning Call only when there are no frames being received.
+ ****************************************************************************/
+void lsd_lz_set(uint8_t enable);
+
 /** \} */
 
 #endif //_LSD_H_
@@ -0,0 +1,154 @@
+/************************************************************************//**
+ * \brief LZ4 block format decoder.
+ *
+ * Each sequence is a token (literal length in the high nibble, match length
+ * minus 4 in the low one), the literals, and a little endian match offset.
+ * Lengths of 15 continue in the following bytes. The last sequence only has
+ * literals.
+ *
+ * The decoder is a state machine, so input can end anywhere in a sequence.
+ * State values are also used by lz4_68k.s.
+ ****************************************************************************/
+
+#include "lz4.h"
+#include "util.h"
+
+/// Minimum match length
+#define LZ4_MIN_MATCH	4
+
+/// Decoder states
+enum lz4_stat {
+	LZ4_TOKEN = 0,		///< Waiting for a token
+	LZ4_LIT_EXT,		///< Waiting for a literal length extension
+	LZ4_LIT,		///< Copying literals
+	LZ4_OFF_L,		///< Waiting for the match offset low byte
+	LZ4_OFF_H,		///< Waiting for the match offset high byte
+	LZ4_MATCH_EXT,		///< Waiting for a match length extension
+	LZ4_ERROR		///< Corrupt data or output full
+};
+
+void lz4_stream_init(struct lz4_stream *s, uint8_t *out, uint16_t out_max)
+{
+	s->out = out;
+	s->pos = out;
+	s->end = out + out_max;
+	s->len = 0;
+	s->off = 0;
+	s->stat = LZ4_TOKEN;
+	s->token = 0;
+}
+
+#if defined(MW_HOST) || !defined(LZ4_ASM)
+/// Gets the state following a complete literal length
+static uint8_t lit_start(const struct lz4_stream *s, const uint8_t *op)
+{
+	if (!s->len) {
+		return LZ4_OFF_L;
+	}
+
+	return s->len > s->end - op ? LZ4_ERROR : LZ4_LIT;
+}
+
+/// Copies a match once its offset and length are known
+static uint8_t match_copy(const struct lz4_stream *s, uint8_t **op)
+{
+	uint8_t *dst = *op;
+	const uint8_t *src = dst - s->off;
+	uint16_t len = s->len + LZ4_MIN_MATCH;
+
+	if (!s->off || s->off > dst - s->out || len > s->end - dst) {
+		return LZ4_ERROR;
+	}
+	// Byte by byte, since match and output can overlap
+	while (len--) {
+		*dst++ = *src++;
+	}
+	*op = dst;
+
+	return LZ4_TOKEN;
+}
+
+int lz4_stream_feed(struct lz4_stream *s, const uint8_t *in, uint16_t len)
+{
+	const uint8_t *const in_end = in + len;
+	uint8_t *op = s->pos;
+	uint8_t stat = s->stat;
+	uint16_t n;
+	uint8_t byte;
+
+	while (in < in_end && LZ4_ERROR != stat) {
+		switch (stat) {
+		case LZ4_TOKEN:
+			s->token = *in++;
+			s->len = s->token>>4;
+			stat = 15 == s->len ? LZ4_LIT_EXT : lit_start(s, op);
+			break;
+
+		case LZ4_LIT_EXT:
+			byte = *in++;
+			s->len += byte;
+			if (255 != byte) {
+				stat = lit_start(s, op);
+			}
+			break;
+
+		case LZ4_LIT:
+			n = MIN(s->len, in_end - in);
+			s->len -= n;
+			while (n--) {
+				*op++ = *in++;
+			}
+			if (!s->len) {
+				stat = LZ4_OFF_L;
+			}
+			break;
+
+		case LZ4_OFF_L:
+			s->off = *in++;
+			stat = LZ4_OFF_H;
+			break;
+
+		case LZ4_OFF_H:
+			s->off |= *in++<<8;
+			s->len = s->token & 0x0F;
+			stat = 15 == s->len ? LZ4_MATCH_EXT : match_copy(s, &op);
+			break;
+
+		case LZ4_MATCH_EXT:
+			byte = *in++;
+			s->len += byte;
+			if (255 != byte) {
+				stat = match_copy(s, &op);
+			}
+			break;
+		}
+	}
+	s->pos = op;
+	s->stat = stat;
+
+	return LZ4_ERROR == stat ? -1 : 0;
+}
+#endif
+
+int16_t lz4_stream_end(const struct lz4_stream *s)
+{
+	// The last sequence ends after its literals, where an offset would go
+	if (LZ4_OFF_L != s->stat) {
+		return -1;
+	}
+
+	return s->pos - s->out;
+}
+
+int16_t lz4_decode(const uint8_t *in, uint16_t in_len, uint8_t *out,
+		uint16_t out_max)
+{
+	struct lz4_stream s;
+
+	lz4_stream_init(&s, out, out_max);
+	if (lz4_stream_feed(&s, in, in_len)) {
+		return -1;
+	}
+
+	return lz4_stream_end(&s);
+}
@@ -0,0 +1,85 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief LZ4 block format decoder.
+ *
+ * \defgroup lz4 lz4
+ * \{
+ *
+ * \brief LZ4 block format decoder.
+ *
+ * Decodes raw LZ4 blocks (no frame headers, checksums nor dictionaries), as
+ * sent by the WiFi module when link compression is enabled. The decoder is a
+ * stream: compressed data can be fed in pieces as it arrives, and it is
+ * expanded straight into the output buffer, that also holds the history
+ * matches are copied from. No extra room is needed for the input.
+ *
+ * lz4_stream_feed() is the C version in lz4.c, the reference. Console
+ * builds with LZ4_ASM defined use the experimental 68000 assembly version
+ * in lz4_68k.s instead.
+ ****************************************************************************/
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <stdint.h>
+
+/// LZ4 stream decoder state. Field order is relied on by lz4_68k.s.
+struct lz4_stream {
+	uint8_t *out;		///< Start of the output buffer
+	uint8_t *pos;		///< Next output byte
+	uint8_t *end;		///< End of the output buffer
+	uint16_t len;		///< Length of the literals or match in progress
+	uint16_t off;		///< Offset of the match in progress
+	uint8_t stat;		///< Decoder state
+	uint8_t token;		///< Token of the sequence in progress
+};
+
+/************************************************************************//**
+ * \brief Starts decoding an LZ4 block.
+ *
+ * \param[out] s       Decoder state.
+ * \param[out] out     Buffer for the decompressed data.
+ * \param[in]  out_max Length of the out buffer.
+ ****************************************************************************/
+void lz4_stream_init(struct lz4_stream *s, uint8_t *out, uint16_t out_max);
+
+/************************************************************************//**
+ * \brief Decodes the next piece of an LZ4 block.
+ *
+ * \param[inout] s   Decoder state.
+ * \param[in]    in  Compressed data.
+ * \param[in]    len Length of the compressed data.
+ *
+ * \return 0 on success, -1 if data is corrupt or does not fit in the output
+ * buffer. Once an error is returned, following calls also fail.
+ ****************************************************************************/
+int lz4_stream_feed(struct lz4_stream *s, const uint8_t *in, uint16_t len);
+
+/************************************************************************//**
+ * \brief Finishes decoding an LZ4 block.
+ *
+ * \param[in] s Decoder state.
+ *
+ * \return Length of the decompressed data, or -1 if there was an error or
+ * the block ended in the middle of a sequence.
+ ****************************************************************************/
+int16_t lz4_stream_end(const struct lz4_stream *s);
+
+/************************************************************************//**
+ * \brief Decodes an LZ4 block.
+ *
+ * \param[in]  in      Compressed data.
+ * \param[in]  in_len  Length of the compressed data.
+ * \param[out] out     Buffer for the decompressed data. Must not overlap in.
+ * \param[in]  out_max Length of the out buffer.
+ *
+ * \return Length of the decompressed data, or -1 if data is corrupt or does
+ * not fit in the output buffer.
+ ****************************************************************************/
+int16_t lz4_decode(const uint8_t *in, uint16_t in_len, uint8_t *out,
+		uint16_t out_max);
+
+#endif /*_LZ4_H_*/
+
+/** \} */
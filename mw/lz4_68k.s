@@ -0,0 +1,186 @@
+/************************************************************************//**
+ * LZ4 block stream decoder for the 68000, see lz4.h and lz4.c. This is the
+ * same state machine as the C version, with the state kept in registers
+ * while a piece of input is decoded:
+ *
+ * d0: input bytes left     a0: input
+ * d1: scratch              a1: output
+ * d2: state                a2: struct lz4_stream
+ * d3: literal/match length a3: match source
+ * d4: token
+ * d5: match offset
+ *
+ * Numbers in comments are cycle counts of the inner loops. The 68000 faults
+ * on word accesses to odd addresses, and matches can overlap the output, so
+ * bytes are copied one at a time.
+ ****************************************************************************/
+
+        # struct lz4_stream field offsets
+        .equ    S_OUT,  0
+        .equ    S_POS,  4
+        .equ    S_END,  8
+        .equ    S_LEN,  12
+        .equ    S_OFF,  14
+        .equ    S_STAT, 16
+        .equ    S_TOKEN, 17
+
+        # Decoder states, as in enum lz4_stat in lz4.c
+        .equ    LZ4_TOKEN,     0
+        .equ    LZ4_LIT_EXT,   1
+        .equ    LZ4_LIT,       2
+        .equ    LZ4_OFF_L,     3
+        .equ    LZ4_OFF_H,     4
+        .equ    LZ4_MATCH_EXT, 5
+        .equ    LZ4_ERROR,     6
+
+        .equ    LZ4_MIN_MATCH, 4
+
+        # Own section, so it is garbage collected when not used
+        .section .text.lz4_stream_feed,"ax",@progbits
+
+/************************************************************************//**
+ * int lz4_stream_feed(struct lz4_stream *s, const uint8_t *in, uint16_t len)
+ ****************************************************************************/
+        .globl lz4_stream_feed
+        .type lz4_stream_feed, @function
+lz4_stream_feed:
+        movem.l d2-d5/a2-a3, -(sp)
+        # Arguments are above the 24 saved bytes and the return address
+        move.l  28(sp), a2
+        move.l  32(sp), a0
+        move.w  38(sp), d0
+        move.l  S_POS(a2), a1
+        moveq   #0, d3
+        move.w  S_LEN(a2), d3
+        move.b  S_TOKEN(a2), d4
+        moveq   #0, d5
+        move.w  S_OFF(a2), d5
+        moveq   #0, d2
+        move.b  S_STAT(a2), d2
+        # Resume where the previous piece left
+        add.w   d2, d2
+        move.w  stat_tab(pc, d2.w), d1
+        jmp     stat_tab(pc, d1.w)
+
+stat_tab:
+        dc.w    token - stat_tab
+        dc.w    lit_ext - stat_tab
+        dc.w    lit - stat_tab
+        dc.w    off_l - stat_tab
+        dc.w    off_h - stat_tab
+        dc.w    match_ext - stat_tab
+        dc.w    error - stat_tab
+
+token:
+        moveq   #LZ4_TOKEN, d2          /*  4 */
+        subq.w  #1, d0                  /*  4 */
+        bcs     save                    /*  8 */
+        move.b  (a0)+, d4               /*  8 */
+        moveq   #0, d3                  /*  4 */
+        move.b  d4, d3                  /*  4 */
+        lsr.b   #4, d3                  /* 14 */
+        cmp.b   #15, d3                 /*  8 */
+        bne     lit_start               /* 10 */
+
+lit_ext:
+        moveq   #LZ4_LIT_EXT, d2
+        subq.w  #1, d0
+        bcs     save
+        moveq   #0, d1
+        move.b  (a0)+, d1
+        add.w   d1, d3
+        # 255 continues the length
+        addq.b  #1, d1
+        beq.s   lit_ext
+
+lit_start:
+        tst.w   d3                      /*  4 */
+        beq     off_l                   /*  8 */
+        # Literals must fit in the output buffer
+        move.l  S_END(a2), d1           /* 16 */
+        sub.l   a1, d1                  /*  8 */
+        cmp.l   d3, d1                  /*  6 */
+        bcs     error                   /*  8 */
+
+lit:
+        moveq   #LZ4_LIT, d2            /*  4 */
+        tst.w   d0                      /*  4 */
+        beq     save                    /*  8 */
+        # Copy as many literals as there are in this piece
+        move.w  d3, d1                  /*  4 */
+        cmp.w   d0, d1                  /*  4 */
+        bls.s   1f                      /* 10 */
+        move.w  d0, d1
+1:      sub.w   d1, d3                  /*  4 */
+        sub.w   d1, d0                  /*  4 */
+        subq.w  #1, d1                  /*  4 */
+2:      move.b  (a0)+, (a1)+            /* 12 */
+        dbra    d1, 2b                  /* 10 */
+        tst.w   d3                      /*  4 */
+        bne     save                    /*  8 */
+
+off_l:
+        moveq   #LZ4_OFF_L, d2          /*  4 */
+        subq.w  #1, d0                  /*  4 */
+        bcs     save                    /*  8 */
+        moveq   #0, d5                  /*  4 */
+        move.b  (a0)+, d5               /*  8 */
+
+off_h:
+        moveq   #LZ4_OFF_H, d2          /*  4 */
+        subq.w  #1, d0                  /*  4 */
+        bcs     save                    /*  8 */
+        move.b  (a0)+, d1               /*  8 */
+        lsl.w   #8, d1                  /* 22 */
+        or.w    d1, d5                  /*  4 */
+        moveq   #15, d3                 /*  4 */
+        and.b   d4, d3                  /*  4 */
+        cmp.b   #15, d3                 /*  8 */
+        bne     match                   /* 10 */
+
+match_ext:
+        moveq   #LZ4_MATCH_EXT, d2
+        subq.w  #1, d0
+        bcs     save
+        moveq   #0, d1
+        move.b  (a0)+, d1
+        add.w   d1, d3
+        addq.b  #1, d1
+        beq.s   match_ext
+
+match:
+        # Offset must be in the decoded data, match must fit the buffer
+        tst.w   d5                      /*  4 */
+        beq     error                   /*  8 */
+        move.l  a1, d1                  /*  4 */
+        sub.l   S_OUT(a2), d1           /* 18 */
+        cmp.l   d5, d1                  /*  6 */
+        bcs     error                   /*  8 */
+        addq.w  #LZ4_MIN_MATCH, d3      /*  4 */
+        move.l  S_END(a2), d1           /* 16 */
+        sub.l   a1, d1                  /*  8 */
+        cmp.l   d3, d1                  /*  6 */
+        bcs     error                   /*  8 */
+        move.l  a1, a3                  /*  4 */
+        sub.l   d5, a3                  /*  8 */
+        subq.w  #1, d3                  /*  4 */
+3:      move.b  (a3)+, (a1)+            /* 12 */
+        dbra    d3, 3b                  /* 10 */
+        bra     token                   /* 10 */
+
+error:
+        moveq   #LZ4_ERROR, d2
+
+save:
+        move.l  a1, S_POS(a2)
+        move.w  d3, S_LEN(a2)
+        move.w  d5, S_OFF(a2)
+        move.b  d4, S_TOKEN(a2)
+        move.b  d2, S_STAT(a2)
+        moveq   #0, d0
+        cmp.b   #LZ4_ERROR, d2
+        bne.s   1f
+        moveq   #-1, d0
+1:      movem.l (sp)+, d2-d5/a2-a3
+        rts
+        .size lz4_stream_feed, . - lz4_stream_feed
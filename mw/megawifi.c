@@ -6,8 +6,7 @@
  *
  * \note Module is not reentrant.
  *
- * \todo Missing a lot of integrity checks, also module should track used
- *       channels, and is not currently doing it
+ * \todo Missing a lot of integrity checks.
  ****************************************************************************/
 
 #include <string.h>
@@ -24,6 +23,7 @@
 #define MW_STAT_POLL_TOUT	MS_TO_FRAMES(MW_STAT_POLL_MS)
 #define MW_HTTP_OPEN_TOUT	MS_TO_FRAMES(MW_HTTP_OPEN_TOUT_MS)
 #define MW_UPGRADE_TOUT		MS_TO_FRAMES(MW_UPGRADE_TOUT_MS)
+#define MW_UART_SPEED_TOUT	MS_TO_FRAMES(MW_UART_SPEED_TOUT_MS)
 
 /*
  * The module assumes that once started, sending always succeeds, but uses
@@ -41,19 +41,104 @@ struct recv_metadata {
 	uint8_t ch;
 };
 
+/// Coalescing buffer for a channel
+struct coalesce {
+	char *buf;		///< Buffer, NULL if coalescing is disabled
+	uint16_t half;		///< Length of each half of the buffer
+	uint16_t len;		///< Data accumulated in the active half
+	uint8_t max_msgs;	///< Sends to accumulate before flushing
+	uint8_t msgs;		///< Sends accumulated in the active half
+	uint8_t max_frames;	///< Frames data can wait before flushing
+	uint8_t since;		///< Frame the active half got its first data
+	uint8_t active;		///< Half accumulating data
+	uint8_t sending;	///< Oldest half being sent
+	uint8_t busy;		///< Halves being sent, one bit each
+};
+
+/// Frame held in the side buffer, followed by its data
+struct side_frame {
+	uint16_t len;		///< Length of the frame data
+	uint16_t pos;		///< Data already delivered
+	uint8_t ch;		///< Channel of the frame
+	uint8_t done;		///< Frame completely delivered
+	char data[];		///< Frame data, padded to an even length
+};
+
+/// Side buffer, holding frames received while commands are in progress,
+/// until they are delivered to the buffers posted for their channels.
+/// Frames are added by the reception callback and removed by
+/// side_deliver(), both run from mw_process().
+struct side_buf {
+	char *buf;		///< Buffer, NULL if not set
+	uint16_t len;		///< Length of the buffer
+	uint16_t head;		///< Position where the next frame is received
+	uint16_t tail;		///< Position of the oldest frame kept
+	uint16_t chans;		///< Channels with frames kept, one bit each
+};
+
+/// Command submitted with mw_cmd_submit(), waiting for the reply
+struct cmd_async {
+	mw_cmd *cmd;		///< Command buffer, also receiving the reply
+	mw_cmd_cb done_cb;	///< Callback to run when the reply arrives
+	void *ctx;		///< Context for the callback
+	uint8_t tag;		///< Tag of the command, 0 if untagged
+#ifdef MW_HOST
+	uint8_t code;		///< Command code, to convert the reply
+#endif
+};
+
+/// State of the frames sent by mw_send_sync()
+struct send_sync {
+	uint8_t gen;		///< Call number, passed to the frame callbacks
+	uint8_t pending;	///< Frames queued and not yet sent
+	uint8_t late;		///< Frames of failed calls not yet sent
+	uint8_t waiting;	///< Supervisor task waiting for a frame
+	enum lsd_status err;	///< Error sending a frame
+};
+
 /// Data required by the module
 struct mw_data {
 	mw_cmd *cmd;
-	// TODO This callback is never set!
-	lsd_recv_cb cmd_data_cb;
+	/// Frames received while commands are in progress
+	struct side_buf side;
 	uint16_t buf_len;
+	/// Channels in use by sockets, one bit per channel
+	uint16_t sock_used;
+	/// Highest channel usable by sockets
+	uint8_t max_sock;
+	/// Coalescing buffers
+	struct coalesce coal[LSD_MAX_CH];
+	/// Channels with coalesced data to flush after max_frames
+	uint16_t coal_timed;
+	/// Socket stream buffers
+	struct mw_stream strm[LSD_MAX_CH];
+	/// Channels received by a stream buffer, one bit per channel
+	uint16_t ch_strm;
+	/// Channels with compression enabled, one bit per channel
+	uint16_t ch_lz;
+	/// mw_send_sync() state
+	struct send_sync ss;
+	/// Commands in progress, in submission order
+	struct cmd_async async[MW_CMD_MAX_INFLIGHT];
+	/// Buffer receiving the replies to tagged commands
+	mw_cmd *reply;
+	/// Number of commands in progress
+	uint8_t async_num;
+	/// Tag of the last command submitted
+	uint8_t tag;
 	union {
 		uint8_t flags;
 		struct {
 			uint8_t mw_ready:1;
+			uint8_t cmd_tag:1;
+			/// A stale reply was expected when the untagged command
+			/// in progress was submitted
+			uint8_t stale:1;
 		};
 	};
-} d = {};
+};
+
+MW_STATE struct mw_data d = {};
 
 //void cmd_tout_cb(struct loop_timer *t);
 
@@ -66,6 +151,7 @@ int16_t mw_init(char *cmd_buf, uint16_t buf_len)
 	memset(&d, 0, sizeof(struct mw_data));
 	d.cmd = (mw_cmd*)cmd_buf;
 	d.buf_len = buf_len;
+	d.max_sock = MW_MAX_SOCK;
 
 	lsd_init();
 
@@ -75,10 +161,10 @@ int16_t mw_init(char *cmd_buf, uint16_t buf_len)
 	uart_clr_bits(MCR, MW__PRG | MW__PD);
 
 	// Try accessing UART scratch pad register to see if it is installed
-	UART_SPR = 0x55;
-	if (UART_SPR != 0x55) return MW_ERR;
-	UART_SPR = 0xAA;
-	if (UART_SPR != 0xAA) return MW_ERR;
+	UART_WR(SPR, 0x55);
+	if (UART_RD(SPR) != 0x55) return MW_ERR;
+	UART_WR(SPR, 0xAA);
+	if (UART_RD(SPR) != 0xAA) return MW_ERR;
 
 	// Enable control channel
 	lsd_ch_enable(MW_CTRL_CH);
@@ -88,61 +174,543 @@ int16_t mw_init(char *cmd_buf, uint16_t buf_len)
 	return MW_ERR_NONE;
 }
 
-static void cmd_send_cb(enum lsd_status err, void *ctx)
+static void cmd_recv_cb(enum lsd_status err, uint8_t ch,
+		char *data, uint16_t len, void *ctx)
 {
-	UNUSED_PARAM(ctx);
-	UNUSED_PARAM(err);
+	UNUSED_PARAM(data);
+	struct recv_metadata *md = (struct recv_metadata*)ctx;
 
 	// FIXME: Treat errors!
 	if (!err) {
-		// TODO: Do we always want to force a context switch
+		md->ch = ch;
+		md->len = len;
 		tsk_super_post(true);
 	}
 }
 
-static void cmd_recv_cb(enum lsd_status err, uint8_t ch,
+static void cmd_reply_cb(enum lsd_status err, uint8_t ch,
+		char *data, uint16_t len, void *ctx);
+
+#ifdef MW_HOST
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAP16(field)	(field) = ByteSwapWord(field)
+#define SWAP32(field)	(field) = ByteSwapDWord(field)
+#else
+#define SWAP16(field)
+#define SWAP32(field)
+#endif
+
+/// Swaps the cmd and data_len fields between host and module byte order
+static void cmd_hdr_swap(mw_cmd *cmd)
+{
+	SWAP16(cmd->cmd);
+	SWAP16(cmd->data_len);
+}
+
+/// Swaps the multi-byte data fields of a command (or of the reply to it,
+/// if reply is true) between host and module byte order. The module uses
+/// big endian fields, as sent by the console, so hosts must convert them.
+static void cmd_data_swap(mw_cmd *cmd, uint8_t code, bool reply)
+{
+	switch (code) {
+	case MW_CMD_LINK_CFG:
+		SWAP16(cmd->link_cfg.features);
+		SWAP16(cmd->link_cfg.reserved);
+		break;
+
+	case MW_CMD_SYS_STAT:
+		if (reply) {
+			SWAP32(cmd->sys_stat.st_flags);
+		}
+		break;
+
+	case MW_CMD_DATETIME:
+		if (reply) {
+			SWAP32(cmd->date_time.dt_bin[0]);
+			SWAP32(cmd->date_time.dt_bin[1]);
+		}
+		break;
+
+	case MW_CMD_FLASH_ID:
+		if (reply) {
+			SWAP16(cmd->flash_id.device);
+		}
+		break;
+
+	case MW_CMD_HTTP_CERT_QUERY:
+		if (reply) {
+			SWAP32(cmd->dw_data[0]);
+		}
+		break;
+
+	case MW_CMD_HTTP_FINISH:
+	case MW_CMD_GAME_REQUEST:
+		if (reply) {
+			SWAP32(cmd->dw_data[0]);
+			SWAP16(cmd->w_data[2]);
+		}
+		break;
+
+	case MW_CMD_GAMERTAG_GET:
+		if (reply) {
+			SWAP32(cmd->gamertag_get.id);
+		}
+		break;
+
+	case MW_CMD_WIFI_ADV_GET:
+		if (reply) {
+			SWAP32(cmd->wifi_adv_cfg.rx_ampdu_buf_len);
+			SWAP32(cmd->wifi_adv_cfg.rx_max_single_pkt_len);
+			SWAP32(cmd->wifi_adv_cfg.rx_buf_len);
+		}
+		break;
+
+	case MW_CMD_WIFI_ADV_SET:
+		if (!reply) {
+			SWAP32(cmd->wifi_adv_cfg.rx_ampdu_buf_len);
+			SWAP32(cmd->wifi_adv_cfg.rx_max_single_pkt_len);
+			SWAP32(cmd->wifi_adv_cfg.rx_buf_len);
+		}
+		break;
+
+	case MW_CMD_UART_SPEED_SET:
+		if (!reply) {
+			SWAP32(cmd->uart_speed.baud);
+			SWAP16(cmd->uart_speed.tout_ms);
+			SWAP16(cmd->uart_speed.flags);
+		}
+		break;
+
+	case MW_CMD_DEF_CFG_SET:
+	case MW_CMD_HTTP_OPEN:
+		if (!reply) {
+			SWAP32(cmd->dw_data[0]);
+		}
+		break;
+
+	case MW_CMD_HTTP_CERT_SET:
+		if (!reply) {
+			SWAP32(cmd->dw_data[0]);
+			SWAP16(cmd->w_data[2]);
+		}
+		break;
+
+	case MW_CMD_TCP_BIND:
+		if (!reply) {
+			SWAP32(cmd->bind.reserved);
+			SWAP16(cmd->bind.port);
+		}
+		break;
+
+	case MW_CMD_FLASH_ERASE:
+		if (!reply) {
+			SWAP16(cmd->fl_sect);
+		}
+		break;
+
+	case MW_CMD_FLASH_WRITE:
+		if (!reply) {
+			SWAP32(cmd->fl_data.addr);
+		}
+		break;
+
+	case MW_CMD_FLASH_READ:
+		if (!reply) {
+			SWAP32(cmd->fl_range.addr);
+			SWAP16(cmd->fl_range.len);
+		}
+		break;
+
+	case MW_CMD_HRNG_GET:
+		if (!reply) {
+			SWAP16(cmd->rnd_len);
+		}
+		break;
+
+	case MW_CMD_GAMERTAG_SET:
+		if (!reply) {
+			SWAP32(cmd->gamertag_set.gamertag.id);
+		}
+		break;
+
+	default:
+		// Byte sized fields only
+		break;
+	}
+}
+#else
+// Command fields already are in the byte order of the module
+#define cmd_hdr_swap(cmd)
+#define cmd_data_swap(cmd, code, reply)
+#endif
+
+/// Sends a command, converting it to the module byte order. The command
+/// must not be used until the send completes (or the reply arrives).
+static enum lsd_status cmd_send(mw_cmd *cmd)
+{
+	uint16_t len = cmd->data_len + 4;
+
+	cmd_data_swap(cmd, MW_CMD_CODE(cmd->cmd), FALSE);
+	cmd_hdr_swap(cmd);
+
+	return lsd_send(MW_CTRL_CH, cmd->packet, len, NULL, NULL);
+}
+
+/// Posts the buffer receiving the next command reply
+static void cmd_reply_post(void)
+{
+	if (d.cmd_tag) {
+		// Kept posted while tagged, so stray replies are discarded
+		lsd_ch_recv(MW_CTRL_CH, d.reply->packet, sizeof(mw_cmd), NULL,
+				cmd_reply_cb);
+	} else if (d.async_num) {
+		// Reply is received on the command buffer, so network data
+		// arriving meanwhile goes to the buffers posted by the
+		// application. It overwrites the command, but the module only
+		// replies once the whole command has been received.
+		mw_cmd_recv(d.async[0].cmd, NULL, cmd_reply_cb);
+	}
+}
+
+/// Removes a command from the in progress list
+static void cmd_async_del(uint8_t i)
+{
+	if (!--d.async_num) {
+		lsd_side_enable(FALSE);
+	}
+	memmove(&d.async[i], &d.async[i + 1],
+			(d.async_num - i) * sizeof(struct cmd_async));
+}
+
+static void cmd_reply_cb(enum lsd_status err, uint8_t ch,
 		char *data, uint16_t len, void *ctx)
 {
-	UNUSED_PARAM(data);
-	struct recv_metadata *md = (struct recv_metadata*)ctx;
+	mw_cmd *reply = (mw_cmd*)data;
+	struct cmd_async done;
+	uint8_t i = 0;
+	UNUSED_PARAM(ch);
+	UNUSED_PARAM(ctx);
 
-	// FIXME: Treat errors!
 	if (!err) {
-		md->ch = ch;
-		md->len = len;
-		tsk_super_post(true);
+		cmd_hdr_swap(reply);
+	}
+	if (d.cmd_tag) {
+		while (i < d.async_num &&
+				d.async[i].tag != MW_CMD_TAG(reply->cmd)) {
+			i++;
+		}
+	}
+	if (err || i >= d.async_num) {
+		// Corrupted (resent in CRC mode), or reply to a cancelled
+		// command: keep waiting
+		cmd_reply_post();
+		return;
+	}
+	// Removed before running the callback, so it can submit another one
+	done = d.async[i];
+	cmd_async_del(i);
+	if (d.cmd_tag) {
+		memcpy(done.cmd->packet, data, len);
+	}
+	cmd_data_swap(done.cmd, done.code, TRUE);
+	done.cmd->cmd = MW_CMD_CODE(done.cmd->cmd);
+	cmd_reply_post();
+	if (done.done_cb) {
+		done.done_cb(done.cmd->cmd != MW_CMD_OK ? MW_ERR_RECV :
+				MW_ERR_NONE, done.cmd, done.ctx);
 	}
 }
 
-static enum mw_err mw_command(int16_t timeout_frames)
+enum mw_err mw_cmd_submit(mw_cmd *cmd, void *ctx, mw_cmd_cb done_cb)
 {
-	struct recv_metadata md;
-	bool tout;
-	bool done = false;
+	struct cmd_async *async;
+	enum lsd_status stat;
 
-	// Optimization: we do not wait until the command is sent
-	mw_cmd_send(d.cmd, NULL, NULL);
+	if (!d.mw_ready) {
+		return MW_ERR_NOT_READY;
+	}
+	// Without tags, replies can only be matched by order of arrival
+	if (d.async_num >= (d.cmd_tag ? MW_CMD_MAX_INFLIGHT : 1)) {
+		return MW_ERR_BUSY;
+	}
 
-	while (!done) {
-		mw_cmd_recv(d.cmd, &md, cmd_recv_cb);
-		tout = tsk_super_pend(timeout_frames);
-		if (tout) {
-			return MW_ERR_RECV;
+	async = &d.async[d.async_num++];
+	async->cmd = cmd;
+	async->done_cb = done_cb;
+	async->ctx = ctx;
+	async->tag = 0;
+	if (d.cmd_tag) {
+		// Tag 0 is reserved for untagged commands
+		if (!++d.tag) {
+			d.tag = 1;
+		}
+		async->tag = d.tag;
+	} else {
+		d.stale = lsd_ch_skipping(MW_CTRL_CH);
+	}
+#ifdef MW_HOST
+	async->code = MW_CMD_CODE(cmd->cmd);
+#endif
+	cmd->cmd = MW_CMD_CODE(cmd->cmd) | (async->tag<<8);
+	if (1 == d.async_num) {
+		cmd_reply_post();
+		lsd_side_enable(d.side.buf != NULL);
+	}
+	stat = cmd_send(cmd);
+	if (stat != LSD_STAT_BUSY) {
+		cmd_hdr_swap(cmd);
+		cmd_data_swap(cmd, MW_CMD_CODE(cmd->cmd), FALSE);
+		cmd->cmd = MW_CMD_CODE(cmd->cmd);
+		cmd_async_del(d.async_num - 1);
+		return LSD_STAT_ERR_IN_PROGRESS == stat ? MW_ERR_BUSY :
+			MW_ERR_SEND;
+	}
+
+	return MW_ERR_NONE;
+}
+
+/// Returns the position of a command in the in progress list, or -1
+static int cmd_async_find(const mw_cmd *cmd)
+{
+	int i;
+
+	for (i = 0; i < d.async_num; i++) {
+		if (d.async[i].cmd == cmd) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void mw_cmd_cancel(const mw_cmd *cmd)
+{
+	int i = cmd_async_find(cmd);
+
+	if (i < 0) {
+		return;
+	}
+	cmd_async_del(i);
+	// Tagged replies are told apart, but an untagged one arriving later
+	// would be taken as the reply to the next command, so discard it.
+	// If a stale reply was discarded while waiting, it could have been
+	// this one, and waiting for another would discard every reply.
+	if (!d.cmd_tag && (!d.stale || lsd_ch_skipping(MW_CTRL_CH))) {
+		lsd_ch_skip(MW_CTRL_CH);
+	}
+}
+
+int mw_cmd_busy(const mw_cmd *cmd)
+{
+	if (!cmd) {
+		return d.async_num ? TRUE : FALSE;
+	}
+
+	return cmd_async_find(cmd) >= 0 ? TRUE : FALSE;
+}
+
+void mw_cmd_reply_buf_set(mw_cmd *reply_buf)
+{
+	d.reply = reply_buf;
+}
+
+/// Bytes a frame takes in the side buffer, keeping the next one aligned
+#define SIDE_FRAME_SIZE(len)	(sizeof(struct side_frame) + (((len) + 1) & ~1))
+
+static void side_recv_cb(enum lsd_status err, uint8_t ch,
+		char *data, uint16_t len, void *ctx);
+
+/// Posts the side buffer room after the last frame kept
+static enum lsd_status side_post(void)
+{
+	int16_t room = d.side.len - d.side.head - sizeof(struct side_frame);
+
+	if (room < 0) {
+		// Full, reception stops until the frames are delivered
+		return LSD_STAT_BUSY;
+	}
+
+	return lsd_side_recv(d.side.buf + d.side.head +
+			sizeof(struct side_frame), MIN(room, LSD_MAX_LEN),
+			NULL, side_recv_cb);
+}
+
+static void side_recv_cb(enum lsd_status err, uint8_t ch,
+		char *data, uint16_t len, void *ctx)
+{
+	struct side_frame *f = (struct side_frame*)(data -
+			sizeof(struct side_frame));
+	UNUSED_PARAM(ctx);
+
+	if (!err && ch != MW_CTRL_CH) {
+		f->len = len;
+		f->pos = 0;
+		f->ch = ch;
+		f->done = FALSE;
+		d.side.head = (char*)f - d.side.buf + SIDE_FRAME_SIZE(len);
+		d.side.chans |= 1<<ch;
+	} else if (!(d.side.chans & (1<<ch))) {
+		// Bad frame, or late reply to a cancelled command: dropped,
+		// and its channel stops going to the side buffer
+		lsd_side_end(ch);
+	}
+	side_post();
+}
+
+void mw_cmd_data_buf_set(char *buf, uint16_t len)
+{
+	d.side.buf = buf;
+	d.side.len = len;
+	d.side.head = 0;
+	d.side.tail = 0;
+	d.side.chans = 0;
+	if (buf) {
+		side_post();
+	} else {
+		lsd_side_recv(NULL, 0, NULL, NULL);
+		for (uint8_t ch = 0; ch < LSD_MAX_CH; ch++) {
+			lsd_side_end(ch);
+		}
+	}
+	lsd_side_enable(buf && d.async_num);
+}
+
+/// Delivers the frames held in the side buffer to the buffers posted for
+/// their channels, in arrival order for each channel
+static void side_deliver(void)
+{
+	struct side_frame *f;
+	uint16_t waiting = 0;
+	uint16_t pos;
+	int16_t sent;
+
+	if (!d.side.chans) {
+		return;
+	}
+	for (pos = d.side.tail; pos < d.side.head;
+			pos += SIDE_FRAME_SIZE(f->len)) {
+		f = (struct side_frame*)(d.side.buf + pos);
+		// Frames wait behind older ones of the same channel
+		if (f->done || (waiting & (1<<f->ch))) {
+			continue;
 		}
-		// We might receive network data while waiting
-		// for a command reply
-		if (MW_CTRL_CH == md.ch) {
-			if (d.cmd->cmd != MW_CMD_OK) {
-				return MW_ERR_RECV;
+		do {
+			sent = lsd_deliver(f->ch, f->data + f->pos,
+					f->len - f->pos);
+			if (sent > 0) {
+				f->pos += sent;
 			}
-			done = TRUE;
-		} else if (d.cmd_data_cb) {
-			d.cmd_data_cb(LSD_STAT_COMPLETE, md.ch,
-					(char*)d.cmd, md.len, NULL);
+		} while (sent > 0 && f->pos < f->len);
+		if (sent < 0) {
+			waiting |= 1<<f->ch;
+		} else {
+			f->done = TRUE;
 		}
 	}
 
-	return MW_ERR_NONE;
+	while (d.side.tail < d.side.head &&
+			((struct side_frame*)(d.side.buf + d.side.tail))->done) {
+		f = (struct side_frame*)(d.side.buf + d.side.tail);
+		d.side.tail += SIDE_FRAME_SIZE(f->len);
+	}
+	for (uint8_t ch = 1; ch < LSD_MAX_CH; ch++) {
+		// Channel gets its frames directly again, unless one for the
+		// side buffer is arriving
+		if ((d.side.chans & ~waiting & (1<<ch)) &&
+				!lsd_side_end(ch)) {
+			waiting |= 1<<ch;
+		}
+	}
+	d.side.chans = waiting;
+	if (d.side.tail == d.side.head) {
+		// Empty, start again from the beginning if not receiving
+		d.side.head = 0;
+		if (LSD_STAT_BUSY == side_post()) {
+			d.side.tail = 0;
+		} else {
+			d.side.head = d.side.tail;
+		}
+	}
+}
+
+/// Flushes the coalescing buffers holding data for max_frames or more
+static void coal_poll(void)
+{
+	uint8_t now;
+
+	if (!d.coal_timed) {
+		return;
+	}
+	now = lsd_frames_get();
+	for (uint8_t ch = 1; ch < LSD_MAX_CH; ch++) {
+		struct coalesce *c = &d.coal[ch];
+
+		if ((d.coal_timed & (1<<ch)) &&
+				(uint8_t)(now - c->since) >= c->max_frames) {
+			// If the queue is full, it is retried on next call
+			mw_flush(ch);
+		}
+	}
+}
+
+void mw_process(void)
+{
+	lsd_process();
+	side_deliver();
+	coal_poll();
+}
+
+int mw_process_budget(uint8_t end_line)
+{
+	if (lsd_process_budget(end_line)) {
+		return TRUE;
+	}
+	side_deliver();
+	coal_poll();
+
+	return FALSE;
+}
+
+/// Waits until posted or for a frame, counting frames down from tout_frames.
+/// Counts of 0 or less (TSK_PEND_FOREVER) never expire. Returns TRUE when
+/// the count reaches 0.
+static int pend_frame(int16_t *tout_frames)
+{
+	if (!tsk_super_pend(1) || *tout_frames <= 0) {
+		return FALSE;
+	}
+
+	return !--*tout_frames;
+}
+
+static void cmd_sync_cb(enum mw_err err, mw_cmd *reply, void *ctx)
+{
+	enum mw_err *result = (enum mw_err*)ctx;
+	UNUSED_PARAM(reply);
+
+	*result = err;
+	tsk_super_post(true);
+}
+
+static enum mw_err mw_command(int16_t timeout_frames)
+{
+	enum mw_err result = MW_ERR_RECV;
+	enum mw_err err;
+
+	err = mw_cmd_submit(d.cmd, &result, cmd_sync_cb);
+	if (err) {
+		return err;
+	}
+	// Other completions may also post, wait until the reply arrives
+	// without restarting the timeout
+	while (mw_cmd_busy(d.cmd)) {
+		if (pend_frame(&timeout_frames)) {
+			mw_cmd_cancel(d.cmd);
+			return MW_ERR_RECV;
+		}
+	}
+
+	return result;
 }
 
 static enum mw_err string_based_cmd(enum mw_command cmd, const char *payload,
@@ -176,7 +744,11 @@ enum mw_err mw_recv_sync(uint8_t *ch, char *buf, int16_t *buf_len,
 	struct recv_metadata md;
 	bool tout;
 
-	lsd_recv(buf, *buf_len, &md, cmd_recv_cb);
+	// Frames are never longer than LSD_MAX_LEN, larger buffers are fine
+	if (lsd_recv(buf, MIN(*buf_len, LSD_MAX_LEN), &md,
+				cmd_recv_cb) != LSD_STAT_BUSY) {
+		return MW_ERR_RECV;
+	}
 	tout = tsk_super_pend(tout_frames);
 	if (tout) {
 		return MW_ERR_RECV;
@@ -188,26 +760,425 @@ enum mw_err mw_recv_sync(uint8_t *ch, char *buf, int16_t *buf_len,
 	return MW_ERR_NONE;
 }
 
+static void coal_sent_cb(enum lsd_status err, void *ctx)
+{
+	struct coalesce *c = (struct coalesce*)ctx;
+	UNUSED_PARAM(err);
+
+	// Halves are sent in order
+	c->busy &= ~(1<<c->sending);
+	c->sending ^= 1;
+}
+
+enum lsd_status mw_flush(uint8_t ch)
+{
+	struct coalesce *c;
+	enum lsd_status stat;
+
+	if (ch >= LSD_MAX_CH) {
+		return LSD_STAT_ERR_INVALID_CH;
+	}
+	c = &d.coal[ch];
+	if (!c->buf || !c->len) {
+		return LSD_STAT_COMPLETE;
+	}
+
+	stat = lsd_send(ch, c->buf + c->active * c->half, c->len, c,
+			coal_sent_cb);
+	if (stat < LSD_STAT_COMPLETE) {
+		return stat;
+	}
+	c->busy |= 1<<c->active;
+	c->active ^= 1;
+	c->len = 0;
+	c->msgs = 0;
+	d.coal_timed &= ~(1<<ch);
+
+	return LSD_STAT_BUSY;
+}
+
+enum lsd_status mw_send(uint8_t ch, const char *data, int16_t len,
+		void *ctx, lsd_send_cb send_cb)
+{
+	struct coalesce *c;
+	enum lsd_status stat;
+
+	if (ch >= LSD_MAX_CH || !d.coal[ch].buf) {
+		return lsd_send(ch, data, len, ctx, send_cb);
+	}
+
+	c = &d.coal[ch];
+	if (c->len + len > c->half) {
+		stat = mw_flush(ch);
+		if (stat < LSD_STAT_COMPLETE) {
+			return stat;
+		}
+	}
+	if (len > c->half) {
+		// Does not fit, send it directly after the flushed data
+		return lsd_send(ch, data, len, ctx, send_cb);
+	}
+	if (c->busy & (1<<c->active)) {
+		// Previous data in this half is still being sent
+		return LSD_STAT_ERR_IN_PROGRESS;
+	}
+
+	if (!c->len && c->max_frames) {
+		c->since = lsd_frames_get();
+		d.coal_timed |= 1<<ch;
+	}
+	memcpy(c->buf + c->active * c->half + c->len, data, len);
+	c->len += len;
+	c->msgs++;
+	if (c->len == c->half || c->msgs == c->max_msgs) {
+		// If the queue is full, data is sent on next call
+		mw_flush(ch);
+	}
+	if (send_cb) {
+		send_cb(LSD_STAT_COMPLETE, ctx);
+	}
+
+	return LSD_STAT_COMPLETE;
+}
+
+enum mw_err mw_coalesce_set(uint8_t ch, char *buf, uint16_t len,
+		uint8_t max_msgs, uint8_t max_frames)
+{
+	struct coalesce *c;
+
+	if (!ch || ch >= LSD_MAX_CH) {
+		return MW_ERR_PARAM;
+	}
+
+	c = &d.coal[ch];
+	if (c->busy) {
+		// The send callbacks still have to update the buffer state
+		return MW_ERR_BUSY;
+	}
+	memset(c, 0, sizeof(struct coalesce));
+	d.coal_timed &= ~(1<<ch);
+	c->buf = buf;
+	c->half = len / 2;
+	c->max_msgs = max_msgs;
+	c->max_frames = max_frames;
+
+	return MW_ERR_NONE;
+}
+
+static void send_sync_cb(enum lsd_status err, void *ctx)
+{
+	// Frames queued by a call that failed only count for
+	// mw_send_sync_wait()
+	if ((uint8_t)(uintptr_t)ctx != d.ss.gen) {
+		d.ss.late--;
+		return;
+	}
+
+	d.ss.pending--;
+	if (err < LSD_STAT_COMPLETE) {
+		d.ss.err = err;
+	}
+	if (d.ss.waiting) {
+		d.ss.waiting = FALSE;
+		tsk_super_post(true);
+	}
+}
+
 enum mw_err mw_send_sync(uint8_t ch, const char *data, uint16_t len,
 		int16_t tout_frames)
 {
+	enum lsd_status stat;
 	uint16_t to_send;
 	int16_t tout;
 	uint16_t sent = 0;
 
-	while (sent < len) {
-		to_send = MIN(len - sent, d.buf_len);
-		lsd_send(ch, data + sent, to_send, NULL, cmd_send_cb);
-		tout = tsk_super_pend(tout_frames);
+	// Keep ordering with data accumulated by mw_send()
+	if (mw_flush(ch) < LSD_STAT_COMPLETE) {
+		return MW_ERR_SEND;
+	}
+
+	// Frames are queued while previous ones are being sent, so the
+	// UART does not go idle between them. A new generation keeps the
+	// frames of previous calls from being counted.
+	d.ss.gen++;
+	d.ss.pending = 0;
+	d.ss.err = LSD_STAT_COMPLETE;
+	while (sent < len || d.ss.pending) {
+		if (sent < len) {
+			to_send = MIN(len - sent, LSD_MAX_LEN);
+			stat = lsd_send(ch, data + sent, to_send,
+					(void*)(uintptr_t)d.ss.gen, send_sync_cb);
+			if (LSD_STAT_BUSY == stat) {
+				d.ss.pending++;
+				sent += to_send;
+				continue;
+			}
+			if (stat != LSD_STAT_ERR_IN_PROGRESS) {
+				break;
+			}
+		}
+		if (d.ss.pending) {
+			// Wait for a frame to be sent
+			d.ss.waiting = TRUE;
+			tout = tsk_super_pend(tout_frames);
+		} else {
+			// Queue full with frames from other senders
+			tout = pend_frame(&tout_frames);
+		}
 		if (tout) {
+			d.ss.waiting = FALSE;
+			break;
+		}
+	}
+	if (sent < len || d.ss.pending) {
+		// Frames still queued use the data. Change the generation
+		// first, so their callbacks stop updating pending.
+		d.ss.gen++;
+		d.ss.late += d.ss.pending;
+		return MW_ERR_SEND;
+	}
+
+	return d.ss.err ? MW_ERR_SEND : MW_ERR_NONE;
+}
+
+enum mw_err mw_send_sync_wait(int16_t tout_frames)
+{
+	while (d.ss.late) {
+		if (pend_frame(&tout_frames)) {
 			return MW_ERR_SEND;
 		}
-		sent += to_send;
 	}
 
 	return MW_ERR_NONE;
 }
 
+static void strm_recv_cb(enum lsd_status err, uint8_t ch, char *data,
+		uint16_t len, void *ctx);
+
+void mw_stream_post(struct mw_stream *s)
+{
+	uint16_t pos = s->ring ? s->in & (s->len - 1) : s->in;
+	uint16_t room = s->ring ? s->len - (uint16_t)(s->in - s->out) :
+		s->len - s->in;
+
+	if (s->posted || !room) {
+		// The channel is held, so frames wait in the UART until data
+		// is consumed
+		return;
+	}
+	room = MIN(room, s->len - pos);
+	s->posted = TRUE;
+	lsd_ch_recv(s->ch, s->buf + pos, MIN(room, LSD_MAX_LEN), s,
+			strm_recv_cb);
+}
+
+static void strm_recv_cb(enum lsd_status err, uint8_t ch, char *data,
+		uint16_t len, void *ctx)
+{
+	struct mw_stream *s = (struct mw_stream*)ctx;
+	UNUSED_PARAM(ch);
+	UNUSED_PARAM(data);
+
+	s->posted = FALSE;
+	if (LSD_STAT_COMPLETE == err) {
+		// Frames filling the room continue on the next one, so the
+		// data is seen as a byte stream
+		s->in += len;
+		if (!len) {
+			s->eof = TRUE;
+		}
+	}
+	mw_stream_post(s);
+	if (s->waiting) {
+		s->waiting = FALSE;
+		tsk_super_post(true);
+	}
+}
+
+enum mw_err mw_stream_init(struct mw_stream *s, uint8_t ch, char *buf,
+		uint16_t len, uint8_t ring)
+{
+	if (!ch || ch >= LSD_MAX_CH || !buf || !len || (ring &&
+				((len & (len - 1)) || len > 0x8000))) {
+		return MW_ERR_PARAM;
+	}
+	// Compressed frames must fit whole in the room posted
+	if (d.ch_lz & (1<<ch)) {
+		return MW_ERR_PARAM;
+	}
+
+	memset(s, 0, sizeof(struct mw_stream));
+	s->buf = buf;
+	s->len = len;
+	s->ch = ch;
+	s->ring = ring;
+	d.ch_strm |= 1<<ch;
+	// Data must not go elsewhere while the buffer is full
+	lsd_ch_hold(ch, TRUE);
+	mw_stream_post(s);
+
+	return MW_ERR_NONE;
+}
+
+void mw_stream_free(struct mw_stream *s)
+{
+	if (!s->buf) {
+		return;
+	}
+	if (s->posted) {
+		lsd_ch_recv(s->ch, NULL, 0, NULL, NULL);
+		s->posted = FALSE;
+	}
+	d.ch_strm &= ~(1<<s->ch);
+	lsd_ch_hold(s->ch, FALSE);
+	s->buf = NULL;
+}
+
+enum mw_err mw_sock_stream_set(uint8_t ch, char *buf, uint16_t len)
+{
+	if (!ch || ch >= LSD_MAX_CH) {
+		return MW_ERR_PARAM;
+	}
+
+	mw_stream_free(&d.strm[ch]);
+	if (!buf) {
+		return MW_ERR_NONE;
+	}
+
+	return mw_stream_init(&d.strm[ch], ch, buf, len, TRUE);
+}
+
+int16_t mw_sock_available(uint8_t ch)
+{
+	struct mw_stream *s;
+
+	if (ch >= LSD_MAX_CH) {
+		return -1;
+	}
+	s = &d.strm[ch];
+	if (!s->buf) {
+		return -1;
+	}
+
+	return (uint16_t)(s->in - s->out);
+}
+
+/// Copies data from the stream buffer, without removing it
+static void strm_copy(const struct mw_stream *s, char *buf, uint16_t len)
+{
+	uint16_t pos = s->out & (s->len - 1);
+	uint16_t first = MIN(len, s->len - pos);
+
+	memcpy(buf, s->buf + pos, first);
+	memcpy(buf + first, s->buf, len - first);
+}
+
+int16_t mw_sock_read(uint8_t ch, char *buf, int16_t len, uint8_t flags,
+		int16_t tout_frames)
+{
+	struct mw_stream *s;
+	uint16_t avail;
+	int16_t want;
+	int16_t done = 0;
+
+	if (ch >= LSD_MAX_CH || len < 0) {
+		return -1;
+	}
+	s = &d.strm[ch];
+	if (!s->buf) {
+		return -1;
+	}
+
+	want = (flags & MW_SOCK_WAITALL) ? len : MIN(len, 1);
+	if (flags & MW_SOCK_PEEK) {
+		// Peeked data stays in the buffer, so it cannot wait for more
+		want = MIN(want, s->len);
+	}
+	while (TRUE) {
+		// Set before checking, the callback can run at any time
+		s->waiting = !(flags & MW_SOCK_NONBLOCK);
+		avail = s->in - s->out;
+		if (flags & MW_SOCK_PEEK) {
+			done = MIN(avail, len);
+			strm_copy(s, buf, done);
+		} else if (avail) {
+			avail = MIN(avail, len - done);
+			strm_copy(s, buf + done, avail);
+			s->out += avail;
+			done += avail;
+			mw_stream_post(s);
+		}
+		if (done >= want || !s->waiting ||
+				tsk_super_pend(tout_frames)) {
+			break;
+		}
+	}
+	s->waiting = FALSE;
+
+	return done;
+}
+
+int16_t mw_sock_write(uint8_t ch, const char *data, int16_t len,
+		uint8_t flags, int16_t tout_frames)
+{
+	struct coalesce *c;
+	enum lsd_status stat;
+	int16_t chunk;
+	int16_t sent = 0;
+
+	if (ch >= LSD_MAX_CH || len < 0) {
+		return -1;
+	}
+	c = &d.coal[ch];
+	if (!c->buf) {
+		// Without coalescing buffer data cannot be copied, so it is
+		// sent directly and must be waited for
+		if ((flags & MW_SOCK_NONBLOCK) ||
+				mw_send_sync(ch, data, len, tout_frames)) {
+			return -1;
+		}
+		return len;
+	}
+
+	while (TRUE) {
+		if (sent < len) {
+			chunk = MIN(len - sent, c->half);
+			stat = mw_send(ch, data + sent, chunk, NULL, NULL);
+			if (stat >= LSD_STAT_COMPLETE) {
+				sent += chunk;
+				continue;
+			}
+		} else {
+			// Do not leave the data waiting for more to coalesce
+			stat = mw_flush(ch);
+			if (stat >= LSD_STAT_COMPLETE) {
+				break;
+			}
+		}
+		if (stat != LSD_STAT_ERR_IN_PROGRESS) {
+			return -1;
+		}
+		// Buffer or send queue full, wait for data to be sent
+		if ((flags & MW_SOCK_NONBLOCK) || pend_frame(&tout_frames)) {
+			break;
+		}
+	}
+
+	return sent;
+}
+
+static void link_features_set(uint16_t features)
+{
+	lsd_crc_set((features & MW_LINK_CRC) ? TRUE : FALSE);
+	lsd_ext_set((features & MW_LINK_EXT_CH) ? TRUE : FALSE);
+	lsd_lz_set((features & MW_LINK_EXT_CH) && (features & MW_LINK_LZ4) ?
+			TRUE : FALSE);
+	d.max_sock = (features & MW_LINK_EXT_CH) ? MW_EXT_MAX_SOCK :
+		MW_MAX_SOCK;
+	d.cmd_tag = (features & MW_LINK_CMD_TAG) ? TRUE : FALSE;
+	cmd_reply_post();
+}
+
 enum mw_err mw_detect(uint8_t *major, uint8_t *minor, char **variant)
 {
 	int16_t retries = 5;
@@ -217,6 +1188,9 @@ enum mw_err mw_detect(uint8_t *major, uint8_t *minor, char **variant)
 	// Wait a bit and take module out of resest
 	tsk_super_pend(MS_TO_FRAMES(30));
 	mw_module_start();
+	// Module boots using the default baud rate and link features
+	uart_divisor_set(UART_DIV(UART_BR));
+	link_features_set(0);
 	tsk_super_pend(MS_TO_FRAMES(1000));
 
 	do {
@@ -264,6 +1238,191 @@ enum mw_err mw_version_get(uint8_t version[3], char **variant)
 	return MW_ERR_NONE;
 }
 
+enum mw_err mw_link_cfg_set(uint16_t features, uint16_t *accepted)
+{
+	enum mw_err err;
+
+	if (!d.mw_ready) {
+		return MW_ERR_NOT_READY;
+	}
+	// Retransmissions are timed by the VBLANK service
+	if ((features & MW_LINK_CRC) && !lsd_vint_running()) {
+		return MW_ERR_PARAM;
+	}
+
+	if (!d.reply) {
+		// Tagged replies need their own buffer
+		features &= ~MW_LINK_CMD_TAG;
+	}
+	d.cmd->cmd = MW_CMD_LINK_CFG;
+	d.cmd->data_len = sizeof(struct mw_msg_link_cfg);
+	d.cmd->link_cfg.features = features;
+	d.cmd->link_cfg.reserved = 0;
+	err = mw_command(MW_COMMAND_TOUT);
+	if (err) {
+		// Firmware without link negotiation, keep plain frames
+		return err;
+	}
+	features &= d.cmd->link_cfg.features;
+	// Reply has been received, so link is idle and mode can be switched
+	link_features_set(features);
+	if (accepted) {
+		*accepted = features;
+	}
+
+	return MW_ERR_NONE;
+}
+
+enum mw_err mw_ch_compress_set(uint8_t ch, uint8_t enable)
+{
+	enum mw_err err;
+
+	if (!d.mw_ready) {
+		return MW_ERR_NOT_READY;
+	}
+	if (ch >= LSD_MAX_CH) {
+		return MW_ERR_PARAM;
+	}
+	// Compressed frames must fit whole in the room posted
+	if (enable && (d.ch_strm & (1<<ch))) {
+		return MW_ERR_PARAM;
+	}
+
+	d.cmd->cmd = MW_CMD_CH_COMPRESS;
+	d.cmd->data_len = sizeof(struct mw_msg_ch_compress);
+	d.cmd->ch_compress.ch = ch;
+	d.cmd->ch_compress.enable = enable;
+	err = mw_command(MW_COMMAND_TOUT);
+	if (err) {
+		return MW_ERR;
+	}
+	if (enable) {
+		d.ch_lz |= 1<<ch;
+	} else {
+		d.ch_lz &= ~(1<<ch);
+	}
+
+	return MW_ERR_NONE;
+}
+
+// Sends an echo burst and checks the reply matches
+static enum mw_err uart_check(void)
+{
+	enum mw_err err;
+	uint16_t i;
+
+	d.cmd->cmd = MW_CMD_ECHO;
+	d.cmd->data_len = MW_UART_CHECK_LEN;
+	// Alternate bit patterns, changing on every byte
+	for (i = 0; i < MW_UART_CHECK_LEN; i++) {
+		d.cmd->data[i] = (i & 1) ? ~i : i ^ 0x55;
+	}
+	err = mw_command(MW_COMMAND_TOUT);
+	if (err) {
+		return err;
+	}
+	if (d.cmd->data_len != MW_UART_CHECK_LEN) {
+		return MW_ERR_RECV;
+	}
+	for (i = 0; i < MW_UART_CHECK_LEN; i++) {
+		if (d.cmd->data[i] != (uint8_t)((i & 1) ? ~i : i ^ 0x55)) {
+			return MW_ERR_RECV;
+		}
+	}
+
+	return MW_ERR_NONE;
+}
+
+// Sends a baud rate change request
+static enum mw_err uart_speed_cmd(uint16_t div, uint16_t flags)
+{
+	d.cmd->cmd = MW_CMD_UART_SPEED_SET;
+	d.cmd->data_len = sizeof(struct mw_msg_uart_speed);
+	d.cmd->uart_speed.baud = UART_DIV_TO_BR(div);
+	d.cmd->uart_speed.tout_ms = MW_UART_SPEED_TOUT_MS;
+	d.cmd->uart_speed.flags = flags;
+
+	return mw_command(MW_COMMAND_TOUT);
+}
+
+// Switches both ends to the specified divisor
+static enum mw_err uart_div_switch(uint16_t div)
+{
+	uint16_t prev = uart_divisor_get();
+	int16_t retries = MW_UART_COMMIT_RETRIES;
+	enum mw_err err;
+
+	err = uart_speed_cmd(div, 0);
+	if (err) {
+		return err;
+	}
+
+	// Module switches after sending the reply, so the line is idle
+	uart_divisor_set(div);
+	err = uart_check();
+	// Module keeps the new rate only when it gets the commit. A lost
+	// reply can be retried, the module acknowledges every commit.
+	if (!err) {
+		do {
+			err = uart_speed_cmd(div, MW_UART_SPEED_COMMIT);
+		} while (err && --retries);
+	}
+	if (!err) {
+		return MW_ERR_NONE;
+	}
+
+	// Go back and wait for the module to do the same
+	uart_divisor_set(prev);
+	tsk_super_pend(MW_UART_SPEED_TOUT);
+	uart_reset_fifos();
+	if (uart_check()) {
+		// Module did not revert, so a commit reached it
+		uart_divisor_set(div);
+		uart_reset_fifos();
+		if (!uart_check()) {
+			return MW_ERR_NONE;
+		}
+		uart_divisor_set(prev);
+	}
+
+	return err;
+}
+
+enum mw_err mw_uart_speed_set(uint32_t baud)
+{
+	uint16_t div;
+
+	if (!d.mw_ready) {
+		return MW_ERR_NOT_READY;
+	}
+	if (!baud || baud > UART_DIV_TO_BR(1)) {
+		return MW_ERR_PARAM;
+	}
+
+	div = UART_DIV(baud);
+
+	return uart_div_switch(div);
+}
+
+enum mw_err mw_uart_speed_probe(uint32_t *baud)
+{
+	enum mw_err err = MW_ERR;
+	uint16_t div;
+
+	if (!d.mw_ready) {
+		return MW_ERR_NOT_READY;
+	}
+
+	for (div = 1; err && div <= MW_UART_PROBE_DIV_MAX; div++) {
+		err = uart_div_switch(div);
+	}
+	if (!err && baud) {
+		*baud = UART_DIV_TO_BR(uart_divisor_get());
+	}
+
+	return err;
+}
+
 enum mw_err mw_default_cfg_set(void)
 {
 	enum mw_err err;
@@ -566,7 +1725,9 @@ static int16_t fill_addr(const char *dst_addr, const char *dst_port,
 	// Zero structure data
 	memset(in_addr, 0, sizeof(struct mw_msg_in_addr));
 	in_addr->dst_addr[0] = '\0';
-	strcpy(in_addr->dst_port, dst_port);
+	if (dst_port) {
+		strcpy(in_addr->dst_port, dst_port);
+	}
 	if (src_port) {
 		strcpy(in_addr->src_port, src_port);
 	}
@@ -587,7 +1748,7 @@ enum mw_err mw_tcp_connect(uint8_t ch, const char *dst_addr,
 	if (!d.mw_ready) {
 		return MW_ERR_NOT_READY;
 	}
-	if (ch > MW_MAX_SOCK) {
+	if (!ch || ch > d.max_sock) {
 		return MW_ERR_PARAM;
 	}
 
@@ -603,10 +1764,27 @@ enum mw_err mw_tcp_connect(uint8_t ch, const char *dst_addr,
 
 	// Enable channel
 	lsd_ch_enable(ch);
+	d.sock_used |= 1<<ch;
 
 	return MW_ERR_NONE;
 }
 
+/// Sends the data left in the coalescing buffer of a channel, and waits
+/// until the buffer is no longer in use. Returns FALSE on timeout.
+static int coal_drain(uint8_t ch, int16_t tout_frames)
+{
+	struct coalesce *c = &d.coal[ch];
+
+	while (c->len || c->busy) {
+		mw_flush(ch);
+		if (pend_frame(&tout_frames)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 enum mw_err mw_close(uint8_t ch)
 {
 	enum mw_err err;
@@ -614,6 +1792,9 @@ enum mw_err mw_close(uint8_t ch)
 	if (!d.mw_ready) {
 		return MW_ERR_NOT_READY;
 	}
+	if (ch < LSD_MAX_CH && !coal_drain(ch, MW_COMMAND_TOUT)) {
+		return MW_ERR_BUSY;
+	}
 
 	d.cmd->cmd = MW_CMD_CLOSE;
 	d.cmd->data_len = 1;
@@ -625,6 +1806,9 @@ enum mw_err mw_close(uint8_t ch)
 
 	// Disable channel
 	lsd_ch_disable(ch);
+	mw_sock_free(ch);
+	mw_coalesce_set(ch, NULL, 0, 0, 0);
+	mw_sock_stream_set(ch, NULL, 0);
 
 	return MW_ERR_NONE;
 }
@@ -636,6 +1820,9 @@ enum mw_err mw_tcp_bind(uint8_t ch, uint16_t port)
 	if (!d.mw_ready) {
 		return MW_ERR_NOT_READY;
 	}
+	if (!ch || ch > d.max_sock) {
+		return MW_ERR_PARAM;
+	}
 
 	d.cmd->cmd = MW_CMD_TCP_BIND;
 	d.cmd->data_len = 7;
@@ -648,10 +1835,36 @@ enum mw_err mw_tcp_bind(uint8_t ch, uint16_t port)
 	}
 
 	lsd_ch_enable(ch);
+	d.sock_used |= 1<<ch;
 
 	return MW_ERR_NONE;
 }
 
+int16_t mw_sock_alloc(void)
+{
+	for (uint8_t ch = 1; ch <= d.max_sock; ch++) {
+		// With the extended header there are channels enough to
+		// leave the HTTP one alone
+		if (MW_HTTP_CH == ch && d.max_sock > MW_HTTP_CH) {
+			continue;
+		}
+		if (!(d.sock_used & (1<<ch))) {
+			d.sock_used |= 1<<ch;
+			return ch;
+		}
+	}
+
+	return -1;
+}
+
+void mw_sock_free(uint8_t ch)
+{
+	if (!ch || ch > d.max_sock) {
+		return;
+	}
+	d.sock_used &= ~(1<<ch);
+}
+
 enum mw_err mw_udp_set(uint8_t ch, const char *dst_addr, const char *dst_port,
 		const char *src_port)
 {
@@ -660,7 +1873,7 @@ enum mw_err mw_udp_set(uint8_t ch, const char *dst_addr, const char *dst_port,
 	if (!d.mw_ready) {
 		return MW_ERR_NOT_READY;
 	}
-	if (ch > MW_MAX_SOCK) {
+	if (!ch || ch > d.max_sock) {
 		return MW_ERR_PARAM;
 	}
 
@@ -676,6 +1889,7 @@ enum mw_err mw_udp_set(uint8_t ch, const char *dst_addr, const char *dst_port,
 
 	// Enable channel
 	lsd_ch_enable(ch);
+	d.sock_used |= 1<<ch;
 
 	return MW_ERR_NONE;
 }
@@ -1231,7 +2445,7 @@ void mw_power_off(void)
 	d.cmd->cmd = MW_CMD_SLEEP;
 	d.cmd->data_len = 0;
 
-	mw_cmd_send(d.cmd, NULL, NULL);
+	cmd_send(d.cmd);
 }
 
 void mw_sleep(int16_t frames)
@@ -21,8 +21,7 @@
  *
  * \note This module uses a loop_timer from the loop module.
  *
- * \todo Missing a lot of integrity checks, also module should track used
- *       channels, and is not currently doing it
+ * \todo Missing a lot of integrity checks.
  ****************************************************************************/
 
 #ifndef _MEGAWIFI_H_
@@ -54,6 +53,14 @@
 #define MW_UPGRADE_TOUT_MS	180000
 /// Milliseconds between status polls while in wm_ap_assoc_wait()
 #define MW_STAT_POLL_MS		250
+/// Time the module waits for the commit at a new baud rate before reverting
+#define MW_UART_SPEED_TOUT_MS	500
+/// Times the commit of a new baud rate is sent before giving up
+#define MW_UART_COMMIT_RETRIES	3
+/// Length of the echo burst used to check the link at a new baud rate
+#define MW_UART_CHECK_LEN	128
+/// Slowest divisor tried by mw_uart_speed_probe() (115200 bps)
+#define MW_UART_PROBE_DIV_MAX	UART_DIV(115200)
 
 /// Error codes for MegaWiFi API functions
 enum mw_err {
@@ -63,7 +70,8 @@ enum mw_err {
 	MW_ERR_BUFFER_TOO_SHORT,	///< Command buffer is too small
 	MW_ERR_PARAM,			///< Input parameter out of range
 	MW_ERR_SEND,			///< Error sending data
-	MW_ERR_RECV			///< Error receiving data
+	MW_ERR_RECV,			///< Error receiving data
+	MW_ERR_BUSY			///< Another command is in progress
 };
 
 /// Supported HTTP methods
@@ -104,16 +112,23 @@ enum mw_http_method {
 #define MW_FSM_QUEUE_LEN	8
 /// Maximum number of simultaneous TCP connections
 #define MW_MAX_SOCK			3
+/// Maximum number of simultaneous sockets with the extended LSD header
+#define MW_EXT_MAX_SOCK			(LSD_MAX_CH - 1)
 /// Control channel used for LSD protocol
 #define MW_CTRL_CH			0
-/// Channel used for HTTP requests and cert sets
-#define MW_HTTP_CH			LSD_MAX_CH - 1
+/// Channel used for HTTP requests and cert sets. Shared with the last
+/// socket when not using the extended LSD header
+#define MW_HTTP_CH			(LSD_STD_MAX_CH - 1)
 
 /// Minimum command buffer length to be able to send all available commands
 /// with minimum data payload. This length might not guarantee that commands
 /// like mw_sntp_cfg_set() can be sent if payload length is big enough).
 #define MW_CMD_MIN_BUFLEN	168
 
+/// Maximum number of commands waiting for their reply, when MW_LINK_CMD_TAG
+/// is enabled. Without it, only one command can be in progress.
+#define MW_CMD_MAX_INFLIGHT	4
+
 /// Access Point data.
 struct mw_ap_data {
 	enum mw_security auth;	///< Security type
@@ -145,23 +160,120 @@ int16_t mw_init(char *cmd_buf, uint16_t buf_len);
  * \brief Processes sends/receives pending data.
  *
  * Call this function as much as possible to process incoming/outgoing data.
+ * It also delivers the frames held in the side buffer to the buffers
+ * posted for their channels (see mw_cmd_data_buf_set()).
  *
  * \warning No data will be sent/received if this function is not frequently
  * invoked.
  ****************************************************************************/
-static inline void mw_process(void)	{lsd_process();}
+void mw_process(void);
+
+/************************************************************************//**
+ * \brief Processes sends/receives pending data, stopping when the VDP
+ * reaches the specified scanline. See lsd_process_budget().
+ *
+ * Frames held in the side buffer are only delivered if the deadline is not
+ * reached.
+ *
+ * \param[in] end_line Scanline at which processing stops.
+ *
+ * \return TRUE if processing stopped because of the deadline, FALSE if
+ *         there was nothing more to do.
+ ****************************************************************************/
+int mw_process_budget(uint8_t end_line);
+
+/************************************************************************//**
+ * \brief Sets the side buffer, holding data frames received while commands
+ * are in progress.
+ *
+ * While a command is in progress, reception runs to get the reply, and a
+ * frame for a channel without a buffer posted with mw_recv() or
+ * mw_ch_recv() (nor lsd_recv() or an RX ring) would stop it, so the command
+ * times out. With a side buffer, these frames are kept there instead, and
+ * mw_process() delivers them to the buffers posted for their channels
+ * afterwards, as if they had just been received. Later frames for these
+ * channels are also kept there until the previous ones are delivered, so
+ * each channel gets its frames in order.
+ *
+ * \param[in] buf Side buffer, aligned to 2 bytes. NULL disables it.
+ * \param[in] len Length of the buffer. Frames only go to the side buffer if
+ *            they fit whole, with 6 extra bytes each.
+ *
+ * \note Call after mw_init(). To disable the side buffer, wait until the
+ * frames it holds are delivered.
+ * \warning When the side buffer is full, frames wait in the UART
+ * (including command replies) until the frames held are delivered.
+ ****************************************************************************/
+void mw_cmd_data_buf_set(char *buf, uint16_t len);
+
+/// Callback run when the reply to a command sent with mw_cmd_submit()
+/// arrives. err is MW_ERR_NONE if the module replied MW_CMD_OK, and reply
+/// points to the command buffer, holding the reply.
+typedef void (*mw_cmd_cb)(enum mw_err err, mw_cmd *reply, void *ctx);
+
+/************************************************************************//**
+ * \brief Sends a command to the WiFi module without waiting for the reply.
+ *
+ * The command is queued for sending and the function returns at once. The
+ * reply is received into the same buffer, and done_cb is run from
+ * mw_process() when it arrives, so the game can keep running while the
+ * module works (e.g. associating to an AP or connecting a socket). Build
+ * the command as described in mw-msg.h. Synchronous API functions use this
+ * same path, waiting for the reply in the supervisor task.
+ *
+ * When MW_LINK_CMD_TAG has been negotiated (see mw_link_cfg_set()), up to
+ * MW_CMD_MAX_INFLIGHT commands (each one with its own buffer) can be in
+ * progress, and replies are matched to commands by their tag, whatever the
+ * order they arrive in. Otherwise only one command can be in progress.
+ *
+ * \param[in] cmd     Command to send. Must stay valid until the reply
+ *                    arrives or the command is cancelled.
+ * \param[in] ctx     Context for the completion callback.
+ * \param[in] done_cb Callback to run when the reply arrives. Can be NULL,
+ *                    and poll mw_cmd_busy() instead.
+ *
+ * \return MW_ERR_NONE if the command was queued, MW_ERR_BUSY if no more
+ * commands can be in progress or the send queue is full, or other code on
+ * failure.
+ *
+ * \note There is no timeout: count frames and call mw_cmd_cancel() to give
+ * up waiting for the reply.
+ ****************************************************************************/
+enum mw_err mw_cmd_submit(mw_cmd *cmd, void *ctx, mw_cmd_cb done_cb);
 
 /************************************************************************//**
- * \brief Sets the callback function to be run when network data is received
- * while waiting for a command reply.
+ * \brief Stops waiting for the reply to a command. The completion callback
+ * is not run.
  *
- * \param[in] cmd_recv_cb Callback to be run when data is received while
- *                        waiting for a command reply.
+ * \param[in] cmd Command to cancel, as passed to mw_cmd_submit().
  *
- * \warning If this callback is not set, data received while waiting for a
- * command reply will be silently discarded.
+ * Without MW_LINK_CMD_TAG, replies cannot be told apart, so the next reply
+ * received is discarded as the late reply to the cancelled command. If the
+ * module never sends it, the reply to the next command is lost instead.
  ****************************************************************************/
-void mw_cmd_data_cb_set(lsd_recv_cb cmd_recv_cb);
+void mw_cmd_cancel(const mw_cmd *cmd);
+
+/************************************************************************//**
+ * \brief Checks if a command is waiting for its reply.
+ *
+ * \param[in] cmd Command to check, or NULL to check for any command.
+ *
+ * \return TRUE if the command is in progress, FALSE otherwise.
+ ****************************************************************************/
+int mw_cmd_busy(const mw_cmd *cmd);
+
+/************************************************************************//**
+ * \brief Sets the buffer receiving replies to tagged commands.
+ *
+ * Tagged replies can arrive in any order, so they are received here and
+ * then copied to the buffer of the matching command. Must be set before
+ * requesting MW_LINK_CMD_TAG with mw_link_cfg_set(), that otherwise does
+ * not request it.
+ *
+ * \param[in] reply_buf Buffer for the replies. Must stay valid while
+ *            MW_LINK_CMD_TAG is enabled.
+ ****************************************************************************/
+void mw_cmd_reply_buf_set(mw_cmd *reply_buf);
 
 /************************************************************************//**
  * \brief Performs the startup sequence for the WiFi module, and tries
@@ -185,6 +297,95 @@ enum mw_err mw_detect(uint8_t *major, uint8_t *minor, char **variant);
  ****************************************************************************/
 enum mw_err mw_version_get(uint8_t version[3], char **variant);
 
+/************************************************************************//**
+ * \brief Negotiates link layer features with the WiFi module.
+ *
+ * Requested features accepted by the module are enabled on both ends of the
+ * link when this function returns. Available features are:
+ * - MW_LINK_CRC: adds sequence numbers and CRC to the frames, and makes
+ *   lost or corrupted frames to be retransmitted. Retransmissions are timed
+ *   by lsd_vint_service(), that must run on every VBLANK (see
+ *   lsd_vint_enable()): requesting it before the service runs fails with
+ *   MW_ERR_PARAM.
+ * - MW_LINK_EXT_CH: uses the extended LSD header, allowing up to
+ *   MW_EXT_MAX_SOCK sockets.
+ * - MW_LINK_LZ4: allows the module to send LZ4 compressed frames on the
+ *   channels enabled with mw_ch_compress_set(). Requires MW_LINK_EXT_CH.
+ * - MW_LINK_CMD_TAG: the module echoes command tags in the replies, allowing
+ *   several commands in progress (see mw_cmd_submit()). Requires setting a
+ *   reply buffer with mw_cmd_reply_buf_set(). Firmware not echoing tags
+ *   does not accept it, and commands are then sent one at a time.
+ *
+ * \param[in]  features Requested features (see mw_link_feature).
+ * \param[out] accepted Features enabled. Can be NULL.
+ *
+ * \return MW_ERR_NONE on success, other code on failure. Firmware versions
+ *         not supporting this command return an error, and the link remains
+ *         with no features enabled.
+ *
+ * \warning Call only when there are no pending data transfers.
+ ****************************************************************************/
+enum mw_err mw_link_cfg_set(uint16_t features, uint16_t *accepted);
+
+/************************************************************************//**
+ * \brief Enables or disables compression of the data the module sends to
+ * a channel.
+ *
+ * Compressed frames are decompressed as they are received, so this is
+ * transparent to the application: receive buffers only need room for the
+ * decompressed data. The module only compresses frames when it saves link
+ * bandwidth. Requires the MW_LINK_LZ4 link feature (see mw_link_cfg_set()).
+ *
+ * \param[in] ch     Channel to configure.
+ * \param[in] enable TRUE to enable compression, FALSE to disable it.
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_PARAM if the channel has a stream
+ * buffer (see mw_stream_init()), other code on failure.
+ *
+ * \warning Compressed frames are not split: a frame whose decompressed data
+ * does not fit in the buffer posted for it is dropped with
+ * LSD_STAT_ERR_FRAME_TOO_LONG.
+ ****************************************************************************/
+enum mw_err mw_ch_compress_set(uint8_t ch, uint8_t enable);
+
+/************************************************************************//**
+ * \brief Changes the baud rate of the link with the WiFi module.
+ *
+ * The module acknowledges the request at the current baud rate, and then
+ * both ends switch to the new one. The link is checked with an echo burst
+ * at the new rate, and if it passes, the new rate is committed with a
+ * second request the module also acknowledges. The module goes back to the
+ * previous baud rate if the commit does not arrive in MW_UART_SPEED_TOUT_MS,
+ * so when the check fails, or the commit is not acknowledged after
+ * MW_UART_COMMIT_RETRIES tries, the previous rate is restored after that
+ * time. If the module does not answer at the previous rate, the commit
+ * reached it, and the new rate is kept.
+ *
+ * \param[in] baud Baud rate to set. It is rounded to the nearest rate
+ *            achievable with UART_CLK.
+ *
+ * \return MW_ERR_NONE on success, other code on failure. On failure the
+ *         previous baud rate is kept.
+ *
+ * \warning Call only when there are no pending data transfers.
+ ****************************************************************************/
+enum mw_err mw_uart_speed_set(uint32_t baud);
+
+/************************************************************************//**
+ * \brief Sets the fastest baud rate the link works reliably with.
+ *
+ * Tries the divisors achievable with UART_CLK, from the fastest one down to
+ * MW_UART_PROBE_DIV_MAX, and keeps the first one passing the echo check.
+ * Run it before enabling CRC mode with mw_link_cfg_set(), or the
+ * retransmissions will hide the errors.
+ *
+ * \param[out] baud Baud rate set. Can be NULL.
+ *
+ * \return MW_ERR_NONE on success, other code if no baud rate passed the
+ *         check. On failure the previous baud rate is kept.
+ ****************************************************************************/
+enum mw_err mw_uart_speed_probe(uint32_t *baud);
+
 /************************************************************************//**
  * \brief Gets the module BSSID (the MAC address) for the specified interface.
  *
@@ -400,11 +601,13 @@ enum mw_err mw_tcp_connect(uint8_t ch, const char *dst_addr,
  * \brief Closes and disconnects a socket from specified channel.
  *
  * This function can be used to free the channel associated to both TCP and
- * UDP sockets.
+ * UDP sockets. Data in the coalescing buffer of the channel (see
+ * mw_coalesce_set()) is sent before closing it.
  *
  * \param[in] ch Channel associated to the socket to disconnect.
  *
- * \return MW_ERR_NONE on success, other code on failure.
+ * \return MW_ERR_NONE on success, MW_ERR_BUSY if the coalesced data could not
+ * be sent, other code on failure.
  ****************************************************************************/
 enum mw_err mw_close(uint8_t ch);
 
@@ -441,6 +644,30 @@ enum mw_err mw_udp_set(uint8_t ch, const char *dst_addr, const char *dst_port,
  ****************************************************************************/
 enum mw_err mw_tcp_bind(uint8_t ch, uint16_t port);
 
+/************************************************************************//**
+ * \brief Allocates a free channel to use with a socket.
+ *
+ * Channels go from 1 to MW_MAX_SOCK, or to MW_EXT_MAX_SOCK when the
+ * extended LSD header has been negotiated with mw_link_cfg_set(). In the
+ * latter case, MW_HTTP_CH is not allocated. Channels are freed when the
+ * socket is closed, or by calling mw_sock_free().
+ *
+ * \return The allocated channel, or -1 if there are no free channels.
+ *
+ * \note Channels passed directly to mw_tcp_connect(), mw_udp_set() or
+ *       mw_tcp_bind() are also marked as used.
+ ****************************************************************************/
+int16_t mw_sock_alloc(void);
+
+/************************************************************************//**
+ * \brief Frees a channel allocated with mw_sock_alloc() that has not been
+ * used to open a socket (e.g. because the connection failed).
+ *
+ * \param[in] ch Channel to free. Channels out of the range mw_sock_alloc()
+ *            returns are ignored.
+ ****************************************************************************/
+void mw_sock_free(uint8_t ch);
+
 /************************************************************************//**
  * \brief Polls a socket until it is ready to transfer data. Typical use of
  * this function is after a successful mw_tcp_bind().
@@ -469,6 +696,26 @@ static inline enum lsd_status mw_recv(char *buf, int16_t len, void *ctx,
 	return lsd_recv(buf, len, ctx, recv_cb);
 }
 
+/************************************************************************//**
+ * \brief Receive data on the specified channel, asyncrhonous interface.
+ *
+ * Frames on the channel are received into this buffer even if a buffer has
+ * been set with mw_recv() or a command is in progress.
+ *
+ * \param[in] ch      Channel to receive data from.
+ * \param[in] buf     Reception buffer.
+ * \param[in] len     Length of the receive buffer.
+ * \param[in] ctx     Context pointer to pass to the reception callbak.
+ * \param[in] recv_cb Callback to run when reception is complete or errors.
+ *
+ * \return Status of the receive procedure.
+ ****************************************************************************/
+static inline enum lsd_status mw_ch_recv(uint8_t ch, char *buf, int16_t len,
+		void *ctx, lsd_recv_cb recv_cb)
+{
+	return lsd_ch_recv(ch, buf, len, ctx, recv_cb);
+}
+
 /************************************************************************//**
  * \brief Receive data using an UDP socket in reuse mode.
  *
@@ -505,6 +752,32 @@ static inline enum lsd_status mw_udp_reuse_send(uint8_t ch,
 	return lsd_send(ch, (const char*)data, len, ctx, send_cb);
 }
 
+/************************************************************************//**
+ * \brief Send data using a UDP socket in reuse mode, gathering the data from
+ * several segments.
+ *
+ * The payload starts with the remote address, so the first MW_REUSE_HEADLEN
+ * bytes of the segments must hold the remote_ip and remote_port fields of a
+ * mw_reuse_payload structure. Usually the first segment holds the address
+ * and the following ones the data.
+ *
+ * \param[in] ch      Channel to use for the send operation.
+ * \param[in] iov     Array with the segments to send.
+ * \param[in] iovcnt  Number of segments in iov.
+ * \param[in] ctx     Context pointer to pass to the send callbak.
+ * \param[in] send_cb Callback to run when sending completes or errors.
+ *
+ * \return Status of the send procedure.
+ * \warning Neither the iov array nor the segment data can be modified until
+ * the send callback runs.
+ ****************************************************************************/
+static inline enum lsd_status mw_udp_reuse_sendv(uint8_t ch,
+		const struct lsd_iov *iov, uint8_t iovcnt, void *ctx,
+		lsd_send_cb send_cb)
+{
+	return lsd_sendv(ch, iov, iovcnt, ctx, send_cb);
+}
+
 /************************************************************************//**
  * \brief Sends data through a socket, using a previously allocated channel.
  * Asynchronous interface.
@@ -517,16 +790,87 @@ static inline enum lsd_status mw_udp_reuse_send(uint8_t ch,
  *
  * \return Status of the send procedure. Usually LSD_STAT_BUSY is returned,
  * and the send procedure is then performed in background.
- * \note Calling this function while there is a send procedure in progress,
- * will cause the function call to fail with LSD_STAT_SEND_ERR_IN_PROGRESS.
+ * \note Up to LSD_TX_QUEUE_LEN frames can be queued. Calling this function
+ * while the send queue is full, will cause the function call to fail with
+ * LSD_STAT_ERR_IN_PROGRESS.
  * \warning For very short data frames, it is possible that the send callback
  * is run before this function returns. In this case, the function returns
  * LSD_STAT_COMPLETE.
+ * \note If coalescing is enabled on the channel (see mw_coalesce_set()),
+ * data is copied to the coalescing buffer, the send callback is run before
+ * this function returns, and LSD_STAT_COMPLETE is returned.
+ ****************************************************************************/
+enum lsd_status mw_send(uint8_t ch, const char *data, int16_t len,
+		void *ctx, lsd_send_cb send_cb);
+
+/************************************************************************//**
+ * \brief Enables or disables coalescing of the data sent on a channel.
+ *
+ * When enabled, data sent with mw_send() is accumulated and sent in a single
+ * frame, saving the frame overhead (both on the link and on the network) of
+ * many small sends. Data is sent when half the buffer is filled, when
+ * max_msgs sends have been accumulated, when it has waited for max_frames,
+ * or when mw_flush() is called. Half of the buffer accumulates data while
+ * the other half is being sent.
+ *
+ * \param[in] ch       Channel to configure. Use it only with TCP sockets,
+ *                     since datagram boundaries are not kept.
+ * \param[in] buf      Coalescing buffer. NULL disables coalescing.
+ * \param[in] len      Length of buf.
+ * \param[in] max_msgs Number of sends after which data is sent. Set to 0 to
+ *                     send only when half the buffer is filled.
+ * \param[in] max_frames Frames data can wait before it is sent by
+ *                     mw_process(). Set to 0 to disable. Frames are counted
+ *                     by lsd_vint_service(), that must run on every VBLANK.
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_PARAM if ch is not valid,
+ * MW_ERR_BUSY if data in the current buffer is still being sent.
+ *
+ * \warning Data not flushed is lost when disabling coalescing. The buffer
+ * must not be modified until all the data in it has been sent.
  ****************************************************************************/
-static inline enum lsd_status mw_send(uint8_t ch, const char *data, int16_t len,
-		void *ctx, lsd_send_cb send_cb)
+enum mw_err mw_coalesce_set(uint8_t ch, char *buf, uint16_t len,
+		uint8_t max_msgs, uint8_t max_frames);
+
+/************************************************************************//**
+ * \brief Sends the data accumulated in the coalescing buffer of a channel.
+ *
+ * \param[in] ch Channel to flush.
+ *
+ * \return LSD_STAT_BUSY if data is being sent, LSD_STAT_COMPLETE if there
+ * was nothing to send, or an error code (e.g. LSD_STAT_ERR_IN_PROGRESS if
+ * the send queue is full). On error, data is kept in the buffer.
+ ****************************************************************************/
+enum lsd_status mw_flush(uint8_t ch);
+
+/************************************************************************//**
+ * \brief Sends data through a socket, gathering it from several segments.
+ * Asynchronous interface.
+ *
+ * Segments are sent in order as a single frame, without copying them.
+ *
+ * \param[in] ch      Channel used to send the data.
+ * \param[in] iov     Array with the segments to send.
+ * \param[in] iovcnt  Number of segments in iov.
+ * \param[in] ctx     Context for the send callback function.
+ * \param[in] send_cb Callback to run when send completes or errors.
+ *
+ * \return Status of the send procedure. Usually LSD_STAT_BUSY is returned,
+ * and the send procedure is then performed in background.
+ * \warning Neither the iov array nor the segment data can be modified until
+ * the send callback runs.
+ ****************************************************************************/
+static inline enum lsd_status mw_sendv(uint8_t ch, const struct lsd_iov *iov,
+		uint8_t iovcnt, void *ctx, lsd_send_cb send_cb)
 {
-	return lsd_send(ch, data, len, ctx, send_cb);
+	// Keep ordering with data accumulated by mw_send()
+	enum lsd_status stat = mw_flush(ch);
+
+	if (stat < LSD_STAT_COMPLETE) {
+		return stat;
+	}
+
+	return lsd_sendv(ch, iov, iovcnt, ctx, send_cb);
 }
 
 /************************************************************************//**
@@ -550,20 +894,185 @@ enum mw_err mw_recv_sync(uint8_t *ch, char *buf, int16_t *buf_len,
  * \brief Sends data through a socket, using a previously allocated channel.
  * Synchronous interface.
  *
+ * Data is split in frames of up to LSD_MAX_LEN bytes. Next frames are queued
+ * while the previous ones are being sent, so the link is kept busy.
+ *
  * \param[in] ch          Channel used to send the data.
  * \param[in] data        Buffer to send.
  * \param[in] len         Length of the data to send.
- * \param[in] tout_frames Timeout for send operation in frames. Set to 0 for
+ * \param[in] tout_frames Timeout waiting for each frame to be sent, in
+ *                        frames. Set to 0 or TSK_PEND_FOREVER for
  *                        infinite wait (dangerous!).
  *
- * \return Status of the send procedure. Usually LSD_STAT_BUSY is returned,
- * and the send procedure is then performed in background.
+ * \return MW_ERR_NONE when all data has been sent, MW_ERR_SEND on error or
+ * timeout. Frames already queued when a call fails are still sent, but
+ * do not affect later calls.
  * \warning Do not use more than one syncrhonous call at once. You must wait
  * until a syncrhonous call ends to issue another one.
+ * \warning When the call fails, frames already queued still point to data.
+ * Do not modify or free it until mw_send_sync_wait() returns MW_ERR_NONE.
  ****************************************************************************/
 enum mw_err mw_send_sync(uint8_t ch, const char *data, uint16_t len,
 		int16_t tout_frames);
 
+/************************************************************************//**
+ * \brief Waits until the frames queued by failed mw_send_sync() calls have
+ * been sent.
+ *
+ * \param[in] tout_frames Timeout in frames. Set to 0 or TSK_PEND_FOREVER for
+ *                        infinite wait.
+ *
+ * \return MW_ERR_NONE when there are no frames left, MW_ERR_SEND on timeout.
+ ****************************************************************************/
+enum mw_err mw_send_sync_wait(int16_t tout_frames);
+
+/// Flags for mw_sock_read() and mw_sock_write()
+enum mw_sock_flags {
+	MW_SOCK_PEEK = 1,	///< Read data without removing it from the buffer
+	MW_SOCK_NONBLOCK = 2,	///< Return at once instead of waiting
+	MW_SOCK_WAITALL = 4	///< Wait until len bytes have been read
+};
+
+/// Buffer receiving the data of a channel as a byte stream, used by the
+/// socket stream buffers and the reader module (see reader.h). Received
+/// data is only added by the reception callback, and only consumed by the
+/// owner, so they do not need locking. Fields are private.
+struct mw_stream {
+	char *buf;		///< Reception buffer, NULL if not set
+	uint16_t len;		///< Length of the buffer
+	uint16_t in;		///< Bytes received (wrapping if ring)
+	uint16_t out;		///< Bytes consumed (wrapping if ring)
+	uint8_t ch;		///< Channel data is received from
+	uint8_t ring;		///< Buffer wraps, else data is received up to
+				///< the end and the owner moves it back
+	uint8_t posted;		///< Room in the buffer posted for reception
+	uint8_t waiting;	///< Supervisor task waiting for data
+	uint8_t eof;		///< Empty frame received, marking the end
+};
+
+/************************************************************************//**
+ * \brief Starts receiving the data of a channel into a stream buffer.
+ *
+ * The room after the data received is posted for reception on the channel
+ * (see mw_ch_recv()), so do not post other buffers to it. Frames filling
+ * the room continue on the next one, so the data is seen as a byte stream,
+ * regardless of how the module splits it in frames. The channel is held
+ * (see lsd_ch_hold()), so while there is no room, its frames wait in the
+ * UART until data is consumed: advance out and call mw_stream_post(). Set
+ * waiting before checking for data to be woken up with tsk_super_post()
+ * when more arrives.
+ *
+ * \param[out] s    Stream buffer to initialize.
+ * \param[in]  ch   Channel to receive data from.
+ * \param[in]  buf  Reception buffer.
+ * \param[in]  len  Length of the buffer. For rings, a power of 2 up to
+ *                  32 KiB.
+ * \param[in]  ring TRUE if positions wrap around the buffer. Otherwise
+ *                  data is received up to the end of the buffer, and the
+ *                  owner must move it back to its start (setting in and
+ *                  out accordingly) when posted is FALSE.
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_PARAM if a parameter is not valid
+ * or if compression is enabled on the channel (see mw_ch_compress_set()).
+ ****************************************************************************/
+enum mw_err mw_stream_init(struct mw_stream *s, uint8_t ch, char *buf,
+		uint16_t len, uint8_t ring);
+
+/************************************************************************//**
+ * \brief Posts the free room of a stream buffer for reception, if not
+ * already posted. Call it after consuming data.
+ *
+ * \param[in] s Stream buffer.
+ ****************************************************************************/
+void mw_stream_post(struct mw_stream *s);
+
+/************************************************************************//**
+ * \brief Stops receiving data into a stream buffer, releasing the channel.
+ *
+ * \param[in] s Stream buffer.
+ ****************************************************************************/
+void mw_stream_free(struct mw_stream *s);
+
+/************************************************************************//**
+ * \brief Sets the stream buffer of a socket, to use it as a byte stream
+ * with mw_sock_read(), mw_sock_write() and mw_sock_available().
+ *
+ * Data received on the channel is stored in the buffer as it arrives,
+ * regardless of how the module splits it in frames, and can then be read
+ * in chunks of any size. The buffer is posted for reception on the channel
+ * (see mw_stream_init()), so do not post other buffers to it. Set it before
+ * connecting the socket, so no data is received elsewhere. The buffer is
+ * freed when the socket is closed with mw_close().
+ *
+ * \param[in] ch  Channel of the socket.
+ * \param[in] buf Stream buffer. NULL disables it, discarding its data.
+ * \param[in] len Length of buf. Must be a power of 2, up to 32 KiB.
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_PARAM if ch or len are not valid,
+ * or if compression is enabled on the channel (see mw_ch_compress_set()).
+ *
+ * \warning When the buffer is full, the channel is held (see lsd_ch_hold()):
+ * its frames wait in the UART, and reception stops for all channels
+ * (including command replies) until data is read. Use TCP sockets, since
+ * datagram boundaries are not kept.
+ ****************************************************************************/
+enum mw_err mw_sock_stream_set(uint8_t ch, char *buf, uint16_t len);
+
+/************************************************************************//**
+ * \brief Gets the number of bytes that can be read from a socket without
+ * waiting.
+ *
+ * \param[in] ch Channel of the socket.
+ *
+ * \return Bytes in the stream buffer, or -1 if the socket has no stream
+ * buffer (see mw_sock_stream_set()).
+ ****************************************************************************/
+int16_t mw_sock_available(uint8_t ch);
+
+/************************************************************************//**
+ * \brief Reads data from the stream buffer of a socket.
+ *
+ * By default, waits until there is some data, and reads up to len bytes.
+ * With MW_SOCK_WAITALL, waits until len bytes have been read. With
+ * MW_SOCK_NONBLOCK, only reads the data already available. With
+ * MW_SOCK_PEEK, data is left in the buffer, so the next read gets it again.
+ *
+ * \param[in]  ch          Channel of the socket.
+ * \param[out] buf         Buffer receiving the data.
+ * \param[in]  len         Maximum number of bytes to read.
+ * \param[in]  flags       Combination of mw_sock_flags.
+ * \param[in]  tout_frames Timeout waiting for data to arrive, in frames. Set
+ *                         to 0 for infinite wait (dangerous!).
+ *
+ * \return Number of bytes read (0 on timeout or if there is no data in
+ * non-blocking mode), or -1 if the socket has no stream buffer.
+ ****************************************************************************/
+int16_t mw_sock_read(uint8_t ch, char *buf, int16_t len, uint8_t flags,
+		int16_t tout_frames);
+
+/************************************************************************//**
+ * \brief Writes data to a socket.
+ *
+ * If coalescing is enabled on the channel (see mw_coalesce_set()), data is
+ * copied to the coalescing buffer and queued for sending, waiting for room
+ * when the buffer is full. With MW_SOCK_NONBLOCK, only the data fitting
+ * without waiting is written, and the rest must be written again later.
+ * Without coalescing, data is sent with mw_send_sync(), and MW_SOCK_NONBLOCK
+ * is not supported. If the write fails, call mw_send_sync_wait() before
+ * reusing data.
+ *
+ * \param[in] ch          Channel of the socket.
+ * \param[in] data        Data to write.
+ * \param[in] len         Length of the data to write.
+ * \param[in] flags       MW_SOCK_NONBLOCK or 0.
+ * \param[in] tout_frames Timeout waiting for room, in frames. Set to 0 or
+ *                        TSK_PEND_FOREVER for infinite wait (dangerous!).
+ *
+ * \return Number of bytes written, or -1 on error.
+ ****************************************************************************/
+int16_t mw_sock_write(uint8_t ch, const char *data, int16_t len,
+		uint8_t flags, int16_t tout_frames);
+
 /************************************************************************//**
  * \brief Get system status.
  *
@@ -967,7 +1476,8 @@ static inline enum lsd_status mw_cmd_send(mw_cmd *cmd, void *ctx,
  ****************************************************************************/
 static inline enum lsd_status mw_cmd_recv(mw_cmd *rep, void *ctx,
 		lsd_recv_cb recv_cb) {
-	return lsd_recv(rep->packet, sizeof(mw_cmd), ctx, recv_cb);
+	return lsd_ch_recv(MW_CTRL_CH, rep->packet, sizeof(mw_cmd), ctx,
+			recv_cb);
 }
 
 #endif /*_MEGAWIFI_H_*/
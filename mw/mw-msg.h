@@ -108,6 +108,9 @@ enum PACKED mw_command {
 	MW_CMD_GAME_ENDPOINT_SET =  56,	///< Set game API endpoint
 	MW_CMD_GAME_KEYVAL_ADD	 =  57,	///< Add key/value appended to requests
 	MW_CMD_GAME_REQUEST	 =  58,	///< Perform a game API request
+	MW_CMD_LINK_CFG		 =  59,	///< Negotiate link layer features
+	MW_CMD_UART_SPEED_SET	 =  60,	///< Set UART baud rate
+	MW_CMD_CH_COMPRESS	 =  61,	///< Compress data received on channel
 	MW_CMD_ERROR		 = 255	///< Error command reply
 };
 
@@ -306,11 +309,51 @@ struct mw_ga_request {
 	char req[];		///< Request data
 };
 
+/// Link layer features, negotiated with MW_CMD_LINK_CFG
+enum mw_link_feature {
+	MW_LINK_CRC = 1,	///< Frames with CRC and acknowledge
+	MW_LINK_EXT_CH = 2,	///< Extended header, up to LSD_MAX_CH channels
+	MW_LINK_LZ4 = 4,	///< LZ4 compressed frames, needs MW_LINK_EXT_CH
+	MW_LINK_CMD_TAG = 8	///< Command tags echoed in the replies
+};
+
+/// Channel compression configuration
+struct mw_msg_ch_compress {
+	uint8_t ch;		///< Channel to configure
+	uint8_t enable;		///< Compress frames sent to the channel
+};
+
+/// Link layer configuration
+struct mw_msg_link_cfg {
+	uint16_t features;	///< Feature flags (see mw_link_feature)
+	uint16_t reserved;	///< Reserved, set to 0
+};
+
+/// UART baud rate change flags
+enum mw_uart_speed_flag {
+	/// Keep the baud rate previously switched to. Sent at the new rate.
+	MW_UART_SPEED_COMMIT = 1
+};
+
+/// UART baud rate change request
+struct mw_msg_uart_speed {
+	uint32_t baud;		///< Baud rate to switch to after the reply
+	uint16_t tout_ms;	///< Revert if not committed before timeout
+	uint16_t flags;		///< Request flags (see mw_uart_speed_flag)
+};
+
+/// Command code of the cmd field of a command or reply
+#define MW_CMD_CODE(cmd)	((cmd) & 0xFF)
+/// Tag of the cmd field of a command or reply, 0 if untagged
+#define MW_CMD_TAG(cmd)		((cmd)>>8)
+
 /// Command sent to system FSM
 typedef union mw_cmd {
 	char packet[MW_CMD_MAX_BUFLEN + 2 * sizeof(uint16_t)];	///< Packet raw data
 	struct {
-		uint16_t cmd;			///< Command code
+		/// Command code in the low byte. With MW_LINK_CMD_TAG, the
+		/// high byte is a tag the module copies to the reply.
+		uint16_t cmd;
 		uint16_t data_len;		///< Data length
 		// If datalen is nonzero, additional command data goes here until
 		// filling datalen bytes.
@@ -336,6 +379,9 @@ typedef union mw_cmd {
 			struct mw_wifi_adv_cfg wifi_adv_cfg;	///< Advanced WiFi configuration
 			struct mw_flash_id flash_id;		///< Flash chip identifiers
 			struct mw_ga_request ga_request;	///< Game API request
+			struct mw_msg_link_cfg link_cfg;	///< Link configuration
+			struct mw_msg_uart_speed uart_speed;	///< UART baud rate
+			struct mw_msg_ch_compress ch_compress;	///< Channel compression
 			uint16_t fl_sect;	///< Flash sector
 			uint32_t fl_id;		///< Flash IDs
 			uint16_t rnd_len;	///< Length of the random buffer to fill
@@ -356,6 +402,9 @@ struct mw_reuse_payload {
 	char payload[MW_CMD_MAX_BUFLEN - 4 - 2];
 };
 
+/// Length of the remote address preceding mw_reuse_payload data
+#define MW_REUSE_HEADLEN	(sizeof(uint32_t) + sizeof(uint16_t))
+
 #endif //_MW_MSG_H_
 
 /** \} */
@@ -0,0 +1,295 @@
+/************************************************************************//**
+ * \brief Buffered reader for text protocols.
+ *
+ * Data is received at the end of a linear stream buffer (see
+ * mw_stream_init()), and consumed from its start. Data is compacted when
+ * there is no room left at the end, since only then there is no reception
+ * posted to the buffer.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date 2020
+ ****************************************************************************/
+#include <string.h>
+#include "reader.h"
+#include "util.h"
+#include "tsk.h"
+
+/// Moves the data not consumed to the start of the buffer, when the end
+/// has been reached
+static void rd_compact(struct mw_reader *r)
+{
+	struct mw_stream *s = &r->s;
+
+	if (s->posted || !s->out) {
+		return;
+	}
+	memmove(s->buf, s->buf + s->out, s->in - s->out);
+	r->scan -= s->out;
+	s->in -= s->out;
+	s->out = 0;
+	mw_stream_post(s);
+}
+
+/// Waits for more data to arrive. Returns TRUE on timeout. Set r->s.waiting
+/// before checking for the data, or the wake up could be missed.
+static int rd_wait(struct mw_reader *r, int16_t tout_frames)
+{
+	if (tsk_super_pend(tout_frames)) {
+		r->s.waiting = FALSE;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+enum mw_err mw_reader_init(struct mw_reader *r, uint8_t ch, char *buf,
+		uint16_t len)
+{
+	r->scan = 0;
+
+	return mw_stream_init(&r->s, ch, buf, len, FALSE);
+}
+
+void mw_reader_free(struct mw_reader *r)
+{
+	mw_stream_free(&r->s);
+}
+
+enum mw_err mw_read_until(struct mw_reader *r, char delim, char **data,
+		uint16_t *len, int16_t tout_frames)
+{
+	char *found = NULL;
+
+	while (TRUE) {
+		rd_compact(r);
+		r->s.waiting = TRUE;
+		found = memchr(r->s.buf + r->scan, delim, r->s.in - r->scan);
+		if (found) {
+			break;
+		}
+		r->scan = r->s.in;
+		if (!r->s.out && r->s.in == r->s.len) {
+			r->s.waiting = FALSE;
+			return MW_ERR_BUFFER_TOO_SHORT;
+		}
+		if (r->s.eof) {
+			r->s.waiting = FALSE;
+			return MW_ERR_RECV;
+		}
+		if (rd_wait(r, tout_frames)) {
+			return MW_ERR_RECV;
+		}
+	}
+	r->s.waiting = FALSE;
+
+	*found = '\0';
+	*data = r->s.buf + r->s.out;
+	*len = found - *data;
+	r->s.out += *len + 1;
+	r->scan = r->s.out;
+
+	return MW_ERR_NONE;
+}
+
+enum mw_err mw_read_line(struct mw_reader *r, char **line, uint16_t *len,
+		int16_t tout_frames)
+{
+	enum mw_err err;
+
+	err = mw_read_until(r, '\n', line, len, tout_frames);
+	if (!err && *len && '\r' == (*line)[*len - 1]) {
+		(*len)--;
+		(*line)[*len] = '\0';
+	}
+
+	return err;
+}
+
+enum mw_err mw_read_exact(struct mw_reader *r, uint16_t len, char **data,
+		int16_t tout_frames)
+{
+	if (len > r->s.len) {
+		return MW_ERR_BUFFER_TOO_SHORT;
+	}
+
+	while (TRUE) {
+		rd_compact(r);
+		r->s.waiting = TRUE;
+		if (r->s.in - r->s.out >= len) {
+			break;
+		}
+		if (r->s.eof) {
+			r->s.waiting = FALSE;
+			return MW_ERR_RECV;
+		}
+		if (rd_wait(r, tout_frames)) {
+			return MW_ERR_RECV;
+		}
+	}
+	r->s.waiting = FALSE;
+
+	*data = r->s.buf + r->s.out;
+	r->s.out += len;
+	r->scan = MAX(r->scan, r->s.out);
+
+	return MW_ERR_NONE;
+}
+
+enum mw_err mw_read_some(struct mw_reader *r, uint16_t max, char **data,
+		uint16_t *len, int16_t tout_frames)
+{
+	while (TRUE) {
+		rd_compact(r);
+		r->s.waiting = TRUE;
+		if (r->s.in != r->s.out || r->s.eof) {
+			break;
+		}
+		if (rd_wait(r, tout_frames)) {
+			return MW_ERR_RECV;
+		}
+	}
+	r->s.waiting = FALSE;
+
+	*data = r->s.buf + r->s.out;
+	*len = MIN((uint16_t)(r->s.in - r->s.out), max);
+	r->s.out += *len;
+	r->scan = MAX(r->scan, r->s.out);
+
+	return MW_ERR_NONE;
+}
+
+enum mw_err mw_read_to_end(struct mw_reader *r, char **data, uint16_t *len,
+		int16_t tout_frames)
+{
+	while (TRUE) {
+		rd_compact(r);
+		r->s.waiting = TRUE;
+		if (r->s.eof) {
+			break;
+		}
+		if (!r->s.out && r->s.in == r->s.len) {
+			r->s.waiting = FALSE;
+			return MW_ERR_BUFFER_TOO_SHORT;
+		}
+		if (rd_wait(r, tout_frames)) {
+			return MW_ERR_RECV;
+		}
+	}
+	r->s.waiting = FALSE;
+
+	*data = r->s.buf + r->s.out;
+	*len = r->s.in - r->s.out;
+	r->s.out = r->s.in;
+	r->scan = r->s.in;
+
+	return MW_ERR_NONE;
+}
+
+/// Passes len bytes of body (or up to the end if to_end) to the callback
+static enum mw_err body_feed(struct mw_reader *r, uint32_t len, int to_end,
+		mw_http_body_cb body_cb, void *ctx, int16_t tout_frames)
+{
+	enum mw_err err;
+	uint16_t got;
+	char *data;
+
+	while (to_end || len) {
+		err = mw_read_some(r, to_end ? r->s.len : MIN(len, r->s.len),
+				&data, &got, tout_frames);
+		if (err) {
+			return err;
+		}
+		if (!got) {
+			// End of data, body is only complete if expected
+			return to_end ? MW_ERR_NONE : MW_ERR_RECV;
+		}
+		if (body_cb && body_cb(data, got, ctx)) {
+			return MW_ERR;
+		}
+		len -= got;
+	}
+
+	return MW_ERR_NONE;
+}
+
+/// Parses the length of a chunk, ignoring chunk extensions. Returns FALSE
+/// if the line is not valid.
+static int chunk_len_get(const char *line, uint32_t *len)
+{
+	uint8_t digits = 0;
+	char c;
+
+	*len = 0;
+	while (TRUE) {
+		c = *line++;
+		if (c >= '0' && c <= '9') {
+			*len = (*len<<4) | (c - '0');
+		} else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+			*len = (*len<<4) | ((c | 0x20) - 'a' + 10);
+		} else {
+			break;
+		}
+		if (++digits > 8) {
+			return FALSE;
+		}
+	}
+
+	return digits && ('\0' == c || ';' == c || ' ' == c || '\t' == c);
+}
+
+static enum mw_err body_chunked(struct mw_reader *r, mw_http_body_cb body_cb,
+		void *ctx, int16_t tout_frames)
+{
+	enum mw_err err;
+	uint32_t chunk;
+	uint16_t len;
+	char *line;
+
+	while (TRUE) {
+		err = mw_read_line(r, &line, &len, tout_frames);
+		if (err) {
+			return err;
+		}
+		if (!chunk_len_get(line, &chunk)) {
+			return MW_ERR_RECV;
+		}
+		if (!chunk) {
+			break;
+		}
+		err = body_feed(r, chunk, FALSE, body_cb, ctx, tout_frames);
+		if (err) {
+			return err;
+		}
+		// Chunk data is followed by an empty line
+		err = mw_read_line(r, &line, &len, tout_frames);
+		if (err || len) {
+			return MW_ERR_RECV;
+		}
+	}
+
+	// Skip the trailer, ending with an empty line
+	do {
+		err = mw_read_line(r, &line, &len, tout_frames);
+	} while (!err && len);
+
+	return err;
+}
+
+enum mw_err mw_http_body_read(struct mw_reader *r, enum mw_http_body type,
+		uint32_t len, mw_http_body_cb body_cb, void *ctx,
+		int16_t tout_frames)
+{
+	switch (type) {
+	case MW_HTTP_BODY_LENGTH:
+		return body_feed(r, len, FALSE, body_cb, ctx, tout_frames);
+
+	case MW_HTTP_BODY_CHUNKED:
+		return body_chunked(r, body_cb, ctx, tout_frames);
+
+	case MW_HTTP_BODY_CLOSE:
+		return body_feed(r, 0, TRUE, body_cb, ctx, tout_frames);
+
+	default:
+		return MW_ERR_PARAM;
+	}
+}
@@ -0,0 +1,192 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Buffered reader for text protocols.
+ *
+ * \defgroup reader reader
+ * \{
+ *
+ * \brief Buffered reader for text protocols.
+ *
+ * Receives the data of a channel directly into a buffer, and returns views
+ * of lines, delimited fields or fixed length blocks as soon as they arrive,
+ * so protocols can be parsed while data streams in. Views point into the
+ * buffer (no data is copied), and are valid until the next call on the
+ * reader. When the end of the buffer is reached, data not yet consumed is
+ * moved to its start, so the buffer must be as long as the longest line or
+ * block to read. An empty frame marks the end of the data (the WiFi module
+ * sends one at the end of HTTP bodies of unknown length), and reads not
+ * completed by then fail.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date 2020
+ ****************************************************************************/
+
+#ifndef _READER_H_
+#define _READER_H_
+
+#include "megawifi.h"
+
+/// Reader state. Fields are private, use the functions below.
+struct mw_reader {
+	/// Data received, from the start of the data not consumed (out) to
+	/// its end (in)
+	struct mw_stream s;
+	uint16_t scan;		///< End of the data searched for a delimiter
+};
+
+/// HTTP body framing, for mw_http_body_read()
+enum mw_http_body {
+	MW_HTTP_BODY_LENGTH = 0,	///< Body length is known in advance
+	MW_HTTP_BODY_CHUNKED,		///< Chunked transfer encoding
+	MW_HTTP_BODY_CLOSE		///< Body ends with the data
+};
+
+/// Callback receiving HTTP body data, from mw_http_body_read(). Return
+/// nonzero to stop reading.
+typedef int (*mw_http_body_cb)(const char *data, uint16_t len, void *ctx);
+
+/************************************************************************//**
+ * \brief Starts reading data from a channel.
+ *
+ * The buffer is a stream buffer (see mw_stream_init()), posted for
+ * reception on the channel, so do not post other buffers to it, nor use
+ * mw_sock_stream_set() on it. While the buffer is full, data for the
+ * channel waits in the UART (stopping reception for all channels) until
+ * the reader consumes some.
+ *
+ * \param[out] r   Reader to initialize.
+ * \param[in]  ch  Channel to read data from.
+ * \param[in]  buf Reception buffer.
+ * \param[in]  len Length of the reception buffer, up to LSD_MAX_LEN bytes
+ *                 are posted at once.
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_PARAM if a parameter is not valid
+ * or if compression is enabled on the channel.
+ ****************************************************************************/
+enum mw_err mw_reader_init(struct mw_reader *r, uint8_t ch, char *buf,
+		uint16_t len);
+
+/************************************************************************//**
+ * \brief Stops reading data, releasing the buffer. Data not consumed is
+ * discarded.
+ *
+ * \param[in] r Reader to stop.
+ ****************************************************************************/
+void mw_reader_free(struct mw_reader *r);
+
+/************************************************************************//**
+ * \brief Reads data up to a delimiter.
+ *
+ * Only data arrived since the previous call is searched for the delimiter.
+ * The delimiter is consumed, and replaced with a null termination, so the
+ * view can be used as a string.
+ *
+ * \param[in]  r           Reader.
+ * \param[in]  delim       Delimiter to look for.
+ * \param[out] data        View of the data, without the delimiter.
+ * \param[out] len         Length of the data, without the delimiter.
+ * \param[in]  tout_frames Timeout waiting for data to arrive, in frames. Set
+ *                         to 0 for infinite wait (dangerous!).
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_RECV on timeout, or
+ * MW_ERR_BUFFER_TOO_SHORT if the data does not fit in the buffer.
+ ****************************************************************************/
+enum mw_err mw_read_until(struct mw_reader *r, char delim, char **data,
+		uint16_t *len, int16_t tout_frames);
+
+/************************************************************************//**
+ * \brief Reads a line, terminated by "\n" or "\r\n".
+ *
+ * Same as mw_read_until() with '\n' as delimiter, but also removing the
+ * '\r' preceding it, if any.
+ *
+ * \param[in]  r           Reader.
+ * \param[out] line        View of the line, null terminated.
+ * \param[out] len         Length of the line, without the terminators.
+ * \param[in]  tout_frames Timeout waiting for data to arrive, in frames. Set
+ *                         to 0 for infinite wait (dangerous!).
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_RECV on timeout, or
+ * MW_ERR_BUFFER_TOO_SHORT if the line does not fit in the buffer.
+ ****************************************************************************/
+enum mw_err mw_read_line(struct mw_reader *r, char **line, uint16_t *len,
+		int16_t tout_frames);
+
+/************************************************************************//**
+ * \brief Reads a block of data of the specified length.
+ *
+ * \param[in]  r           Reader.
+ * \param[in]  len         Length of the data to read.
+ * \param[out] data        View of the data.
+ * \param[in]  tout_frames Timeout waiting for data to arrive, in frames. Set
+ *                         to 0 for infinite wait (dangerous!).
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_RECV on timeout, or
+ * MW_ERR_BUFFER_TOO_SHORT if len is longer than the buffer.
+ ****************************************************************************/
+enum mw_err mw_read_exact(struct mw_reader *r, uint16_t len, char **data,
+		int16_t tout_frames);
+
+/************************************************************************//**
+ * \brief Reads the data available, waiting for it if there is none.
+ *
+ * \param[in]  r           Reader.
+ * \param[in]  max         Maximum length of the data to read.
+ * \param[out] data        View of the data.
+ * \param[out] len         Length of the data, 0 at the end of the data.
+ * \param[in]  tout_frames Timeout waiting for data to arrive, in frames. Set
+ *                         to 0 for infinite wait (dangerous!).
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_RECV on timeout.
+ ****************************************************************************/
+enum mw_err mw_read_some(struct mw_reader *r, uint16_t max, char **data,
+		uint16_t *len, int16_t tout_frames);
+
+/************************************************************************//**
+ * \brief Reads all the data up to the end marked by an empty frame.
+ *
+ * The empty frame is only received while there is room left in the buffer,
+ * so the data must be shorter than the buffer.
+ *
+ * \param[in]  r           Reader.
+ * \param[out] data        View of the data.
+ * \param[out] len         Length of the data.
+ * \param[in]  tout_frames Timeout waiting for data to arrive, in frames. Set
+ *                         to 0 for infinite wait (dangerous!).
+ *
+ * \return MW_ERR_NONE on success, MW_ERR_RECV on timeout, or
+ * MW_ERR_BUFFER_TOO_SHORT if the data does not fit in the buffer.
+ ****************************************************************************/
+enum mw_err mw_read_to_end(struct mw_reader *r, char **data, uint16_t *len,
+		int16_t tout_frames);
+
+/************************************************************************//**
+ * \brief Reads an HTTP body, passing it to a callback as it arrives.
+ *
+ * Bodies of any length go through the reader buffer, that just needs to
+ * hold the chunk length lines of chunked bodies. Use MW_HTTP_BODY_CLOSE
+ * with bodies received on MW_HTTP_CH when mw_http_finish() or
+ * mw_ga_request() report INT32_MAX as length: the module decodes chunked
+ * replies, and marks the end of the body with an empty frame.
+ * MW_HTTP_BODY_CHUNKED is for HTTP bodies received through sockets.
+ *
+ * \param[in] r           Reader.
+ * \param[in] type        Body framing.
+ * \param[in] len         Length of the body, for MW_HTTP_BODY_LENGTH.
+ * \param[in] body_cb     Callback receiving the body data. NULL discards it.
+ * \param[in] ctx         Context for the callback.
+ * \param[in] tout_frames Timeout waiting for data to arrive, in frames. Set
+ *                        to 0 for infinite wait (dangerous!).
+ *
+ * \return MW_ERR_NONE when the whole body has been read, MW_ERR_RECV on
+ * timeout or malformed body, MW_ERR if the callback stopped the reading, or
+ * MW_ERR_PARAM if type is not valid.
+ ****************************************************************************/
+enum mw_err mw_http_body_read(struct mw_reader *r, enum mw_http_body type,
+		uint32_t len, mw_http_body_cb body_cb, void *ctx,
+		int16_t tout_frames);
+
+#endif /*_READER_H_*/
+
+/** \} */
@@ -56,6 +56,14 @@
 /// Put next symbol in named section .text.ro_data.symbol
 #define ROM_DATA(name)	SECTION(.text.ro_data.name)
 
+/// Storage of the module state. On host builds each thread gets its own
+/// state, so several consoles can run in the same process, one per thread.
+#ifdef MW_HOST
+#define MW_STATE	__thread
+#else
+#define MW_STATE
+#endif
+
 /// Get number of rows of a 2D array
 #define ARRAY_ROWS(array_2d)		(sizeof(array_2d) / sizeof(array_2d[0]) / sizeof(array_2d[0][0]))
 /// Get number of columns of a 2D array
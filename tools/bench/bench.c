@@ -0,0 +1,704 @@
+/************************************************************************//**
+ * \brief Host benchmark harness for the MegaWiFi stack.
+ *
+ * Runs the benchmark ROM on the Musashi 68000 core, with just enough of the
+ * console emulated for the stack to work: ROM, RAM, the VDP counters and
+ * VBLANK interrupt, and the UART. The UART is connected to a scripted peer
+ * standing for the WiFi module. The peer is infinitely fast (transmitter is
+ * always ready and received data is available at once, with no overruns),
+ * so the cycles measured are the ones spent by the CPU, not waiting for the
+ * line.
+ *
+ * The peer also negotiates the extended header and LZ4 compression, and
+ * compresses the frames sent to channels with compression enabled, using a
+ * simple greedy LZ4 block compressor.
+ *
+ * Results are written to the standard output in JSON format.
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "m68k.h"
+#include "../../mw/megawifi.h"
+#include "bench.h"
+
+/// 68000 clock frequency (NTSC)
+#define CPU_HZ			7670453
+/// Video frames per second
+#define FRAME_RATE		60
+/// CPU cycles per video frame
+#define FRAME_CYCLES		(CPU_HZ / FRAME_RATE)
+/// CPU cycles per scanline
+#define LINE_CYCLES		488
+/// Scanlines per frame
+#define FRAME_LINES		262
+/// First scanline of the vertical blanking
+#define VBLANK_LINE		224
+/// Frames after which the run is aborted
+#define MAX_FRAMES		(60 * FRAME_RATE)
+
+/// VBLANK interrupt level
+#define VINT_LEVEL		6
+/// Address of the VBLANK interrupt autovector
+#define VINT_VECTOR		(0x60 + 4 * VINT_LEVEL)
+
+#define ROM_LEN			0x400000
+#define RAM_BASE		0xE00000
+#define RAM_MASK		0xFFFF
+#define VDP_BASE		0xC00000
+#define VDP_MASK		0x1F
+
+/// Length of the queue of data sent by the peer (must be a power of 2)
+#define PEER_QUEUE_LEN		(1<<20)
+/// LSD frame delimiter
+#define PEER_STX_ETX		0x7E
+/// LENH flag of compressed frames (extended header)
+#define PEER_LENH_LZ		0x80
+
+/// LZ4 minimum match length
+#define LZ_MIN_MATCH		4
+/// LZ4 literals at the end of a block
+#define LZ_LAST_LITERALS	5
+/// LZ4 distance from the end of a block to the start of the last match
+#define LZ_MF_LIMIT		12
+/// Bits of the LZ4 compressor hash table index
+#define LZ_HASH_BITS		12
+
+/// Peer frame reception states
+enum peer_stat {
+	PEER_STX = 0,
+	PEER_CH,
+	PEER_CH_LENH,
+	PEER_LEN,
+	PEER_DATA,
+	PEER_ETX
+};
+
+/// Result of a test
+struct result {
+	uint64_t start;		///< Cycle count when the test started
+	uint64_t cycles;	///< Cycles elapsed
+	uint32_t units;		///< Units processed
+	int done;		///< Test completed
+};
+
+#define X_AS_BENCH_NAME(id, name, unit)	name,
+#define X_AS_BENCH_UNIT(id, name, unit)	unit,
+
+static const char * const test_name[] = {
+	BENCH_TEST_TABLE(X_AS_BENCH_NAME)
+};
+
+static const char * const test_unit[] = {
+	BENCH_TEST_TABLE(X_AS_BENCH_UNIT)
+};
+
+static struct {
+	uint8_t rom[ROM_LEN];
+	uint8_t ram[RAM_MASK + 1];
+	uint64_t clk;
+	uint32_t units;
+	int exit_code;
+	int done;
+	struct result result[BENCH_TEST_MAX];
+	// UART registers
+	uint8_t ier;
+	uint8_t lcr;
+	uint8_t mcr;
+	uint8_t spr;
+	uint16_t dl;
+	// Peer
+	uint8_t queue[PEER_QUEUE_LEN];
+	uint32_t head;
+	uint32_t tail;
+	enum peer_stat stat;
+	uint8_t ch;
+	uint16_t len;
+	uint16_t pos;
+	uint8_t frame[LSD_MAX_LEN];
+	uint8_t ext;
+	uint8_t lz;
+	uint16_t compress;	// Channels with compression enabled
+	uint32_t lz_in;		// Bytes sent to compressed channels
+	uint32_t lz_out;	// The same bytes, as sent on the line
+} b;
+
+static uint64_t now(void)
+{
+	return b.clk + m68k_cycles_run();
+}
+
+static void peer_putc(uint8_t data)
+{
+	b.queue[b.head++ & (PEER_QUEUE_LEN - 1)] = data;
+}
+
+static uint8_t *lz_len_ext(uint8_t *op, uint16_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+/// Writes an LZ4 sequence. The last one has no match (off is 0).
+static uint8_t *lz_sequence(uint8_t *op, const uint8_t *lit, uint16_t lit_len,
+		uint16_t off, uint16_t match)
+{
+	uint16_t match_len = off ? match - LZ_MIN_MATCH : 0;
+
+	*op++ = (MIN(lit_len, 15)<<4) | MIN(match_len, 15);
+	if (lit_len >= 15) {
+		op = lz_len_ext(op, lit_len - 15);
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (off) {
+		*op++ = off & 0xFF;
+		*op++ = off>>8;
+		if (match_len >= 15) {
+			op = lz_len_ext(op, match_len - 15);
+		}
+	}
+
+	return op;
+}
+
+/// Compresses data as an LZ4 block, with greedy 4 byte matches. Output needs
+/// room for len + len / 255 + 16 bytes.
+static uint16_t lz_compress(const uint8_t *in, uint16_t len, uint8_t *out)
+{
+	int32_t last[1<<LZ_HASH_BITS];
+	uint8_t *op = out;
+	int32_t anchor = 0;
+	int32_t pos = 0;
+	int32_t cand;
+	uint32_t hash;
+	uint16_t match;
+
+	memset(last, 0xFF, sizeof(last));
+	while (pos + LZ_MF_LIMIT < len) {
+		memcpy(&hash, in + pos, sizeof(hash));
+		hash = (hash * 2654435761u)>>(32 - LZ_HASH_BITS);
+		cand = last[hash];
+		last[hash] = pos;
+		// Frames are shorter than the 64 KiB offset limit
+		if (cand < 0 || memcmp(in + cand, in + pos, LZ_MIN_MATCH)) {
+			pos++;
+			continue;
+		}
+		match = LZ_MIN_MATCH;
+		while (pos + match < len - LZ_LAST_LITERALS &&
+				in[cand + match] == in[pos + match]) {
+			match++;
+		}
+		op = lz_sequence(op, in + anchor, pos - anchor, pos - cand,
+				match);
+		pos += match;
+		anchor = pos;
+	}
+	op = lz_sequence(op, in + anchor, len - anchor, 0, 0);
+
+	return op - out;
+}
+
+static void peer_send(uint8_t ch, const uint8_t *data, uint16_t len)
+{
+	static uint8_t comp[LSD_MAX_LEN + LSD_MAX_LEN / 255 + 16 + 2];
+	uint8_t flags = 0;
+	uint16_t comp_len;
+
+	if (b.lz && (b.compress & (1<<ch)) && len) {
+		// Decompressed length goes before the block
+		comp_len = 2 + lz_compress(data, len, comp + 2);
+		b.lz_in += len;
+		if (comp_len < len) {
+			comp[0] = len>>8;
+			comp[1] = len & 0xFF;
+			data = comp;
+			len = comp_len;
+			flags = PEER_LENH_LZ;
+		}
+		b.lz_out += len;
+	}
+
+	peer_putc(PEER_STX_ETX);
+	if (b.ext) {
+		peer_putc(ch);
+		peer_putc(flags | (len>>8));
+	} else {
+		peer_putc((ch<<4) | (len>>8));
+	}
+	peer_putc(len & 0xFF);
+	while (len--) {
+		peer_putc(*data++);
+	}
+	peer_putc(PEER_STX_ETX);
+}
+
+static void peer_reply(const uint8_t *data, uint16_t len)
+{
+	uint8_t reply[MW_CMD_HEADLEN + 16] = {};
+
+	reply[2] = len>>8;
+	reply[3] = len & 0xFF;
+	if (len) {
+		memcpy(reply + MW_CMD_HEADLEN, data, len);
+	}
+	peer_send(MW_CTRL_CH, reply, MW_CMD_HEADLEN + len);
+}
+
+static uint16_t gj_body(char *body, uint16_t max)
+{
+	int len = snprintf(body, max, "success:\"true\"\r\n");
+
+	for (int i = 0; i < BENCH_GJ_RECORDS; i++) {
+		len += snprintf(body + len, max - len,
+				"id:\"%d\"\r\n"
+				"title:\"Trophy %d\"\r\n"
+				"difficulty:\"Gold\"\r\n"
+				"description:\"Benchmark trophy number %d\"\r\n"
+				"image_url:\"https://m.gjcdn.net/assets/%d.png\"\r\n"
+				"achieved:\"false\"\r\n", 1000 + i, i, i, i);
+	}
+
+	return len;
+}
+
+static void peer_game_request(void)
+{
+	static char body[8192];
+	uint16_t len = gj_body(body, sizeof(body));
+	// Content length (big endian) and HTTP status
+	const uint8_t reply[6] = {0, 0, len>>8, len & 0xFF, 200>>8, 200 & 0xFF};
+
+	peer_reply(reply, sizeof(reply));
+	for (uint16_t pos = 0; pos < len; pos += LSD_MAX_LEN) {
+		peer_send(MW_HTTP_CH, (uint8_t*)body + pos,
+				MIN(len - pos, LSD_MAX_LEN));
+	}
+}
+
+static void peer_cmd(const uint8_t *data, uint16_t len)
+{
+	static const uint8_t version[] = {1, 5, 0, 's', 't', 'd', '\0'};
+	uint8_t reply[4] = {};
+	uint16_t features;
+	uint16_t cmd;
+
+	if (len < MW_CMD_HEADLEN) {
+		return;
+	}
+	cmd = (data[0]<<8) | data[1];
+
+	switch (cmd) {
+	case MW_CMD_VERSION:
+		peer_reply(version, sizeof(version));
+		break;
+
+	case MW_CMD_GAME_REQUEST:
+		peer_game_request();
+		break;
+
+	case MW_CMD_LINK_CFG:
+		// Just the extended header and compression. Accepted features
+		// go first in the reply, and apply once it is sent.
+		features = ((data[4]<<8) | data[5]) &
+			(MW_LINK_EXT_CH | MW_LINK_LZ4);
+		if (!(features & MW_LINK_EXT_CH)) {
+			features = 0;
+		}
+		reply[0] = features>>8;
+		reply[1] = features & 0xFF;
+		peer_reply(reply, sizeof(struct mw_msg_link_cfg));
+		b.ext = (features & MW_LINK_EXT_CH) ? 1 : 0;
+		b.lz = (features & MW_LINK_LZ4) ? 1 : 0;
+		b.compress = 0;
+		break;
+
+	case MW_CMD_CH_COMPRESS:
+		if (data[4] < LSD_MAX_CH && data[5]) {
+			b.compress |= 1<<data[4];
+		} else if (data[4] < LSD_MAX_CH) {
+			b.compress &= ~(1<<data[4]);
+		}
+		peer_reply(NULL, 0);
+		break;
+
+	default:
+		peer_reply(NULL, 0);
+		break;
+	}
+}
+
+static void peer_source(const uint8_t *data, uint16_t len)
+{
+	static uint8_t payload[LSD_MAX_LEN];
+	uint16_t frame_len;
+	uint16_t frames;
+
+	if (len < 4) {
+		return;
+	}
+	frame_len = MIN((data[0]<<8) | data[1], LSD_MAX_LEN);
+	frames = (data[2]<<8) | data[3];
+	memset(payload, 0xAA, frame_len);
+	while (frames--) {
+		peer_send(BENCH_SOURCE_CH, payload, frame_len);
+	}
+}
+
+static void peer_frame(uint8_t ch, const uint8_t *data, uint16_t len)
+{
+	switch (ch) {
+	case MW_CTRL_CH:
+		peer_cmd(data, len);
+		break;
+
+	case BENCH_SOURCE_CH:
+		peer_source(data, len);
+		break;
+
+	default:
+		// Data sent to the sink (and anything else) is discarded
+		break;
+	}
+}
+
+/// Receives a byte sent by the console
+static void peer_recv(uint8_t data)
+{
+	switch (b.stat) {
+	case PEER_STX:
+		if (PEER_STX_ETX == data) {
+			b.stat = b.ext ? PEER_CH : PEER_CH_LENH;
+		}
+		break;
+
+	case PEER_CH:
+		// An ETX followed by STX is also valid
+		if (PEER_STX_ETX != data) {
+			b.ch = data;
+			b.stat = PEER_CH_LENH;
+		}
+		break;
+
+	case PEER_CH_LENH:
+		if (b.ext) {
+			b.len = (data & 0x0F)<<8;
+			b.stat = PEER_LEN;
+		} else if (PEER_STX_ETX != data) {
+			b.ch = data>>4;
+			b.len = (data & 0x0F)<<8;
+			b.stat = PEER_LEN;
+		}
+		break;
+
+	case PEER_LEN:
+		b.len |= data;
+		b.pos = 0;
+		b.stat = b.len ? PEER_DATA : PEER_ETX;
+		break;
+
+	case PEER_DATA:
+		b.frame[b.pos++] = data;
+		if (b.pos >= b.len) {
+			b.stat = PEER_ETX;
+		}
+		break;
+
+	case PEER_ETX:
+		if (PEER_STX_ETX == data) {
+			peer_frame(b.ch, b.frame, b.len);
+		}
+		b.stat = PEER_STX;
+		break;
+	}
+}
+
+static unsigned int uart_read(unsigned int reg)
+{
+	switch (reg) {
+	case 0:
+		if (b.lcr & 0x80) {
+			return b.dl & 0xFF;
+		}
+		if (b.tail == b.head) {
+			return 0;
+		}
+		return b.queue[b.tail++ & (PEER_QUEUE_LEN - 1)];
+
+	case 1:
+		return b.lcr & 0x80 ? b.dl>>8 : b.ier;
+
+	case 2:
+		// FIFOs enabled, no interrupt pending
+		return 0xC1;
+
+	case 3:
+		return b.lcr;
+
+	case 4:
+		return b.mcr;
+
+	case 5:
+		// Transmitter always empty, data ready if the peer sent any
+		return 0x60 | (b.tail != b.head ? UART_LSR__DR : 0);
+
+	case 7:
+		return b.spr;
+
+	default:
+		return 0;
+	}
+}
+
+static void uart_write(unsigned int reg, unsigned int value)
+{
+	switch (reg) {
+	case 0:
+		if (b.lcr & 0x80) {
+			b.dl = (b.dl & 0xFF00) | value;
+		} else {
+			peer_recv(value);
+		}
+		break;
+
+	case 1:
+		if (b.lcr & 0x80) {
+			b.dl = (b.dl & 0x00FF) | (value<<8);
+		} else {
+			b.ier = value;
+		}
+		break;
+
+	case 2:
+		// Receive FIFO reset drops anything the peer sent
+		if (value & 0x02) {
+			b.tail = b.head;
+		}
+		break;
+
+	case 3:
+		b.lcr = value;
+		break;
+
+	case 4:
+		b.mcr = value;
+		break;
+
+	case 7:
+		b.spr = value;
+		break;
+	}
+}
+
+static unsigned int vdp_read(unsigned int addr)
+{
+	uint32_t line = ((now() % FRAME_CYCLES) / LINE_CYCLES + VBLANK_LINE) %
+		FRAME_LINES;
+
+	switch (addr & VDP_MASK) {
+	case 0x05:
+	case 0x07:
+		// Status, with the VBLANK flag
+		return line >= VBLANK_LINE ? 0x08 : 0x00;
+
+	case 0x08:
+		return line;
+
+	case 0x09:
+		return ((now() % LINE_CYCLES) * 171 / LINE_CYCLES) & 0xFF;
+
+	default:
+		return 0;
+	}
+}
+
+static void bench_write(unsigned int reg, unsigned int value)
+{
+	switch (reg) {
+	case BENCH_REG_START:
+		if (value < BENCH_TEST_MAX) {
+			b.result[value].start = now();
+		}
+		break;
+
+	case BENCH_REG_STOP:
+		if (value < BENCH_TEST_MAX) {
+			b.result[value].cycles = now() - b.result[value].start;
+			b.result[value].units = b.units;
+			b.result[value].done = 1;
+		}
+		break;
+
+	case BENCH_REG_UNITS:
+		b.units = value;
+		break;
+
+	case BENCH_REG_EXIT:
+		b.exit_code = value;
+		b.done = 1;
+		m68k_end_timeslice();
+		break;
+	}
+}
+
+unsigned int m68k_read_memory_8(unsigned int addr)
+{
+	if (addr < ROM_LEN) {
+		return b.rom[addr];
+	}
+	if (addr >= RAM_BASE) {
+		return b.ram[addr & RAM_MASK];
+	}
+	if (addr - UART_BASE < 16) {
+		return (addr - UART_BASE) & 1 ? 0 : uart_read((addr - UART_BASE)>>1);
+	}
+	if ((addr & ~VDP_MASK) == VDP_BASE) {
+		return vdp_read(addr);
+	}
+
+	return 0;
+}
+
+unsigned int m68k_read_memory_16(unsigned int addr)
+{
+	return (m68k_read_memory_8(addr)<<8) | m68k_read_memory_8(addr + 1);
+}
+
+unsigned int m68k_read_memory_32(unsigned int addr)
+{
+	// Fetching the vector acknowledges the interrupt
+	if (VINT_VECTOR == addr) {
+		m68k_set_irq(0);
+	}
+
+	return (m68k_read_memory_16(addr)<<16) | m68k_read_memory_16(addr + 2);
+}
+
+void m68k_write_memory_8(unsigned int addr, unsigned int value)
+{
+	if (addr >= RAM_BASE) {
+		b.ram[addr & RAM_MASK] = value;
+	} else if (addr - UART_BASE < 16 && !((addr - UART_BASE) & 1)) {
+		uart_write((addr - UART_BASE)>>1, value);
+	}
+}
+
+void m68k_write_memory_16(unsigned int addr, unsigned int value)
+{
+	if (addr - BENCH_PORT_ADDR < 16) {
+		bench_write(addr - BENCH_PORT_ADDR, value);
+		return;
+	}
+	m68k_write_memory_8(addr, value>>8);
+	m68k_write_memory_8(addr + 1, value & 0xFF);
+}
+
+void m68k_write_memory_32(unsigned int addr, unsigned int value)
+{
+	if (addr - BENCH_PORT_ADDR < 16) {
+		bench_write(addr - BENCH_PORT_ADDR, value);
+		return;
+	}
+	m68k_write_memory_16(addr, value>>16);
+	m68k_write_memory_16(addr + 2, value & 0xFFFF);
+}
+
+static int rom_load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	memset(b.rom, 0xFF, ROM_LEN);
+	if (!fread(b.rom, 1, ROM_LEN, f)) {
+		fprintf(stderr, "%s: empty ROM\n", path);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+
+	return 0;
+}
+
+static int run(void)
+{
+	uint64_t next_vint = FRAME_CYCLES;
+	int frames = 0;
+
+	m68k_init();
+	m68k_set_cpu_type(M68K_CPU_TYPE_68000);
+	m68k_pulse_reset();
+
+	while (!b.done) {
+		if (b.clk >= next_vint) {
+			if (++frames > MAX_FRAMES) {
+				fprintf(stderr, "timeout after %d frames\n",
+						MAX_FRAMES);
+				return 1;
+			}
+			m68k_set_irq(VINT_LEVEL);
+			next_vint += FRAME_CYCLES;
+		}
+		b.clk += m68k_execute(next_vint - b.clk);
+	}
+	if (b.exit_code) {
+		fprintf(stderr, "benchmark ROM failed at frame %d\n", frames);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int results_print(void)
+{
+	const char *sep = "";
+	int err = 0;
+
+	printf("{\n\t\"cpu_hz\": %d,\n\t\"results\": [", CPU_HZ);
+	for (int i = 0; i < BENCH_TEST_MAX; i++) {
+		const struct result *r = &b.result[i];
+
+		if (!r->done || !r->units) {
+			fprintf(stderr, "%s: no result\n", test_name[i]);
+			err = 1;
+			continue;
+		}
+		printf("%s\n\t\t{\"name\": \"%s\", \"unit\": \"%s\", "
+				"\"units\": %u, \"cycles\": %llu, "
+				"\"cycles_per_unit\": %.2f}", sep,
+				test_name[i], test_unit[i], r->units,
+				(unsigned long long)r->cycles,
+				(double)r->cycles / r->units);
+		// Skipped tests must not leave a separator behind
+		sep = ",";
+	}
+	// Compression of the data sent to channels with it enabled
+	printf("\n\t],\n\t\"lz\": {\"bytes\": %u, \"sent\": %u}\n}\n",
+			b.lz_in, b.lz_out);
+
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s bench.bin\n", argv[0]);
+		return 1;
+	}
+
+	if (rom_load(argv[1]) || run()) {
+		return 1;
+	}
+
+	return results_print();
+}
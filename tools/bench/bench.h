@@ -0,0 +1,62 @@
+/************************************************************************//**
+ * \file
+ *
+ * \brief Definitions shared by the benchmark ROM and the host harness.
+ *
+ * \defgroup bench bench
+ * \{
+ *
+ * \brief Definitions shared by the benchmark ROM and the host harness.
+ *
+ * The benchmark ROM reports to the harness by writing to a small register
+ * block in the unused expansion area. Writing a test number to the start
+ * register takes a cycle count stamp, and writing it to the stop register
+ * records the cycles elapsed, along with the number of units processed,
+ * that must be written to the units register before stopping.
+ ****************************************************************************/
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/// Base address of the benchmark register block
+#define BENCH_PORT_ADDR		0x700000
+
+/** \addtogroup BenchRegs BenchRegs
+ *  \brief Offsets of the benchmark registers.
+ *  \{ */
+#define BENCH_REG_START		0	///< Start test (word)
+#define BENCH_REG_STOP		2	///< Stop test (word)
+#define BENCH_REG_UNITS		4	///< Units processed by test (long)
+#define BENCH_REG_EXIT		8	///< Exit, with error code (word)
+/** \} */
+
+/// Channel used by the peer to discard received data
+#define BENCH_SINK_CH		1
+/// Channel used by the peer to send the requested data
+#define BENCH_SOURCE_CH		2
+
+/// Number of trophies sent by the peer in GameJolt requests
+#define BENCH_GJ_RECORDS	32
+
+/// Test table: identifier, name and unit
+#define BENCH_TEST_TABLE(X_MACRO) \
+	X_MACRO(TX_4K,    "tx_4k",    "byte") \
+	X_MACRO(TX_64,    "tx_64",    "byte") \
+	X_MACRO(RX_4K,    "rx_4k",    "byte") \
+	X_MACRO(RX_64,    "rx_64",    "byte") \
+	X_MACRO(CMD_RTT,  "cmd_rtt",  "command") \
+	X_MACRO(GJ_FETCH, "gj_fetch", "record") \
+	X_MACRO(GJ_PARSE, "gj_parse", "record") \
+	X_MACRO(GJ_LZ_FETCH, "gj_lz_fetch", "record")
+
+#define X_AS_BENCH_ENUM(id, name, unit)	BENCH_ ## id,
+
+/// Benchmark tests
+enum bench_test {
+	BENCH_TEST_TABLE(X_AS_BENCH_ENUM)
+	BENCH_TEST_MAX
+};
+
+#endif /*_BENCH_H_*/
+
+/** \} */
@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+"""Compares benchmark results against a baseline.
+
+Both files are the JSON output of the bench harness (`make bench`):
+
+    bench_cmp.py baseline.json bench.json
+
+Exits with error if any test needs more cycles per unit than the baseline
+plus the tolerance, or if a test in the baseline is missing.
+"""
+
+import argparse
+import json
+import sys
+
+
+def results_load(path):
+    with open(path) as f:
+        return {r['name']: r for r in json.load(f)['results']}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('baseline', help='baseline results')
+    parser.add_argument('current', help='results to check')
+    parser.add_argument('--tolerance', type=float, default=2,
+                        help='allowed slowdown, in percent (default: 2)')
+    args = parser.parse_args()
+
+    base = results_load(args.baseline)
+    cur = results_load(args.current)
+
+    failed = False
+    for name, b in base.items():
+        c = cur.get(name)
+        if c is None:
+            print(f'{name:10} missing')
+            failed = True
+            continue
+        delta = (c['cycles_per_unit'] / b['cycles_per_unit'] - 1) * 100
+        regressed = delta > args.tolerance
+        failed |= regressed
+        print(f"{name:10} {b['cycles_per_unit']:10.2f} "
+              f"{c['cycles_per_unit']:10.2f} cycles/{c['unit']:8} "
+              f"{delta:+7.2f}%{'  REGRESSION' if regressed else ''}")
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,203 @@
+/************************************************************************//**
+ * \brief Benchmark ROM, run on the host by the bench harness.
+ *
+ * Exercises the MegaWiFi stack against the scripted peer implemented in
+ * bench.c, reporting the cycles spent by each test through the benchmark
+ * registers (see bench.h). Build and run it with `make bench`.
+ ****************************************************************************/
+
+#include <string.h>
+#include "../../mw/util.h"
+#include "../../mw/megawifi.h"
+#include "../../mw/gamejolt.h"
+#include "../../mw/tsk.h"
+#include "bench.h"
+
+/// Length of the command buffer
+#define MW_BUFLEN	1460
+
+/// Length of the data buffer, used for all tests
+#define BENCH_BUF_LEN	8192
+
+/// Timeout for the send and receive operations
+#define BENCH_TOUT	MS_TO_FRAMES(1000)
+
+/// Access to a benchmark word register
+#define BENCH_REG_W(reg)	\
+	(*((volatile uint16_t*)(BENCH_PORT_ADDR + BENCH_REG_ ## reg)))
+/// Access to a benchmark long register
+#define BENCH_REG_DW(reg)	\
+	(*((volatile uint32_t*)(BENCH_PORT_ADDR + BENCH_REG_ ## reg)))
+
+/// Command buffer
+static char cmd_buf[MW_BUFLEN];
+
+/// Data buffer
+static char buf[BENCH_BUF_LEN];
+
+static void bench_start(enum bench_test test)
+{
+	BENCH_REG_W(START) = test;
+}
+
+static void bench_stop(enum bench_test test, uint32_t units)
+{
+	BENCH_REG_DW(UNITS) = units;
+	BENCH_REG_W(STOP) = test;
+}
+
+/// Sends frames to the sink channel. Returns TRUE on error.
+static int tx_test(enum bench_test test, uint16_t len, uint16_t times)
+{
+	uint16_t i;
+
+	bench_start(test);
+	for (i = 0; i < times; i++) {
+		if (mw_send_sync(BENCH_SINK_CH, buf, len, BENCH_TOUT)) {
+			return TRUE;
+		}
+	}
+	bench_stop(test, (uint32_t)len * times);
+
+	return FALSE;
+}
+
+/// Requests frames to the source channel and receives them. Returns TRUE
+/// on error.
+static int rx_test(enum bench_test test, uint16_t len, uint16_t frames)
+{
+	uint32_t total = (uint32_t)len * frames;
+	uint32_t received = 0;
+	char req[4];
+	int16_t buf_len;
+	uint8_t ch;
+
+	// Request is the frame length and the number of frames
+	req[0] = len>>8;
+	req[1] = len;
+	req[2] = frames>>8;
+	req[3] = frames;
+
+	bench_start(test);
+	if (mw_send_sync(BENCH_SOURCE_CH, req, sizeof(req), BENCH_TOUT)) {
+		return TRUE;
+	}
+	while (received < total) {
+		buf_len = BENCH_BUF_LEN;
+		if (mw_recv_sync(&ch, buf, &buf_len, BENCH_TOUT) ||
+				ch != BENCH_SOURCE_CH) {
+			return TRUE;
+		}
+		received += buf_len;
+	}
+	bench_stop(test, total);
+
+	return FALSE;
+}
+
+static int cmd_test(uint16_t times)
+{
+	uint8_t version[3];
+	uint16_t i;
+
+	bench_start(BENCH_CMD_RTT);
+	for (i = 0; i < times; i++) {
+		if (mw_version_get(version, NULL)) {
+			return TRUE;
+		}
+	}
+	bench_stop(BENCH_CMD_RTT, times);
+
+	return FALSE;
+}
+
+static int gj_test(void)
+{
+	struct gj_trophy trophy;
+	uint16_t records = 0;
+	char *pos;
+
+	if (gj_init("https://api.gamejolt.com/api/game/v1_2/", "123456",
+				"0123456789abcdef0123456789abcdef", "bench",
+				"token", buf, BENCH_BUF_LEN, BENCH_TOUT)) {
+		return TRUE;
+	}
+
+	bench_start(BENCH_GJ_FETCH);
+	pos = gj_trophies_fetch(false, NULL);
+	if (!pos) {
+		return TRUE;
+	}
+	bench_stop(BENCH_GJ_FETCH, BENCH_GJ_RECORDS);
+
+	bench_start(BENCH_GJ_PARSE);
+	while ((pos = gj_trophy_get_next(pos, &trophy))) {
+		records++;
+	}
+	bench_stop(BENCH_GJ_PARSE, records);
+
+	return records != BENCH_GJ_RECORDS;
+}
+
+/// Fetches the trophies again, with the HTTP channel LZ4 compressed
+static int gj_lz_test(void)
+{
+	uint16_t features;
+
+	if (mw_link_cfg_set(MW_LINK_EXT_CH | MW_LINK_LZ4, &features) ||
+			!(features & MW_LINK_LZ4) ||
+			mw_ch_compress_set(MW_HTTP_CH, TRUE)) {
+		return TRUE;
+	}
+
+	bench_start(BENCH_GJ_LZ_FETCH);
+	if (!gj_trophies_fetch(false, NULL)) {
+		return TRUE;
+	}
+	bench_stop(BENCH_GJ_LZ_FETCH, BENCH_GJ_RECORDS);
+
+	return FALSE;
+}
+
+/// Polls the WiFi module
+static void idle_tsk(void)
+{
+	while (1) {
+		mw_process();
+	}
+}
+
+static int run(void)
+{
+	uint8_t major, minor;
+	char *variant;
+
+	tsk_user_set(idle_tsk);
+	if (mw_init(cmd_buf, MW_BUFLEN) || mw_detect(&major, &minor, &variant)) {
+		return TRUE;
+	}
+	lsd_ch_enable(BENCH_SINK_CH);
+	lsd_ch_enable(BENCH_SOURCE_CH);
+
+	memset(buf, 0x55, BENCH_BUF_LEN);
+
+	return tx_test(BENCH_TX_4K, 2 * LSD_MAX_LEN, 4) ||
+		tx_test(BENCH_TX_64, 64, 256) ||
+		rx_test(BENCH_RX_4K, LSD_MAX_LEN, 8) ||
+		rx_test(BENCH_RX_64, 64, 256) ||
+		cmd_test(64) ||
+		gj_test() ||
+		gj_lz_test();
+}
+
+/// Entry point
+int main(void)
+{
+	BENCH_REG_W(EXIT) = run();
+
+	while (1) {
+		tsk_user_yield();
+	}
+
+	return 0;
+}
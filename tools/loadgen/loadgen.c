@@ -0,0 +1,470 @@
+/************************************************************************//**
+ * \brief Load generator, running many consoles against the game backend.
+ *
+ * Each console is a thread running the host build of the API (make host)
+ * with its own module state, tasks and UART, connected to its own virtual
+ * module through the UNIX socket served by mw_virt.py --listen. Consoles
+ * use the same request paths carts do (gj_* calls, mw_ga_request() and
+ * mw_udp_reuse_send()), so the servers get the traffic real carts produce.
+ *
+ * A summary of the requests and their latencies is written to the standard
+ * output when the run ends. UDP requests complete when the relay echoes the
+ * datagram back, so their latency is the round trip time through it.
+ ****************************************************************************/
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../mw/megawifi.h"
+#include "../../mw/gamejolt.h"
+#include "../../mw/tsk.h"
+#include "../../mw/host/host.h"
+
+/// Latency histogram buckets, one per millisecond. Last one holds the rest
+#define LAT_BUCKETS		10000
+/// Frame period, in nanoseconds
+#define FRAME_NS		(1000000000LL / FPS)
+/// Timeout for the requests, in frames
+#define REQ_TOUT		MS_TO_FRAMES(10000)
+/// Channel used by the UDP socket
+#define UDP_CH			1
+/// Stack length of the console threads
+#define CONSOLE_STACK_LEN	(256 * 1024)
+/// Length of the buffer for gj_* replies
+#define GJ_BUF_LEN		4096
+/// Maximum payload length of the UDP datagrams
+#define UDP_PAYLOAD_MAX		sizeof(((struct mw_reuse_payload*)0)->payload)
+
+/// Traffic generated by the consoles
+enum scenario {
+	SCN_GJ = 0,	///< Session pings, trophies and scores, in turns
+	SCN_GA,		///< Game API requests to a single path
+	SCN_UDP,	///< UDP datagrams sent to a relay, in reuse mode
+	SCN_MAX
+};
+
+static const char * const scenario_str[SCN_MAX] = {
+	"gj", "ga", "udp"
+};
+
+/// Run configuration, shared by all consoles
+static struct {
+	const char *module;	///< Path to the mw_virt.py socket
+	enum scenario scn;	///< Scenario to run
+	int consoles;		///< Number of consoles
+	int seconds;		///< Run length
+	int ramp;		///< Time to start all consoles, in seconds
+	int interval;		///< Frames between requests of a console
+	const char *endpoint;	///< Game API endpoint
+	const char *game_id;	///< Game API game identifier
+	const char *key;	///< Game API private key
+	const char *user;	///< Game API user name
+	const char *token;	///< Game API user token
+	const char *path;	///< Path for SCN_GA requests
+	uint32_t relay_ip;	///< Relay address for SCN_UDP, network order
+	uint16_t relay_port;	///< Relay port for SCN_UDP
+	int payload_len;	///< Datagram payload length for SCN_UDP
+	volatile int stop;	///< Set when the run ends
+} cfg = {
+	.scn = SCN_GJ,
+	.consoles = 100,
+	.seconds = 60,
+	.interval = FPS,
+	.user = "loadgen",
+	.token = "loadgen",
+	.path = "time",
+	.payload_len = 32,
+};
+
+/// Console state and results
+struct console {
+	pthread_t thread;		///< Thread running the console
+	int id;				///< Console number
+	int fd;				///< Connection to the virtual module
+	uint8_t ready;			///< Module detected and configured
+	uint8_t echoed;			///< Datagram echoed, for SCN_UDP
+	uint32_t seq;			///< Datagram in flight, for SCN_UDP
+	uint32_t requests;		///< Requests completed
+	uint32_t errors;		///< Requests failed
+	uint32_t received;		///< Datagrams received, for SCN_UDP
+	uint32_t lat[LAT_BUCKETS];	///< Latency histogram
+	char cmd_buf[MW_CMD_MAX_BUFLEN];	///< Command buffer
+	char gj_buf[GJ_BUF_LEN];	///< Buffer for gj_* replies
+	struct mw_reuse_payload rx;	///< UDP reception buffer
+	struct mw_reuse_payload tx;	///< UDP transmission buffer
+};
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void user_tsk(void)
+{
+	while (TRUE) {
+		mw_process();
+		host_idle();
+	}
+}
+
+/// Pends the supervisor task until the specified time, or the run ends
+static void wait_until(int64_t when)
+{
+	int64_t left;
+
+	while (!cfg.stop && (left = when - now_ns()) > 0) {
+		// At most a second, so the end of the run is noticed. Longer
+		// waits could also overflow the (int16_t) timeout, and negative
+		// timeouts pend forever.
+		tsk_super_pend(MIN(MAX(1, left / FRAME_NS), FPS));
+	}
+}
+
+static int module_connect(struct console *c)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+	strncpy(addr.sun_path, cfg.module, sizeof(addr.sun_path) - 1);
+	c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (c->fd < 0 || connect(c->fd, (struct sockaddr*)&addr,
+				sizeof(addr))) {
+		return -1;
+	}
+	uart_host_fd_set(c->fd);
+
+	return 0;
+}
+
+static void udp_recv_cb(enum lsd_status stat, uint8_t ch, char *data,
+		uint16_t len, void *ctx)
+{
+	struct console *c = ctx;
+	UNUSED_PARAM(ch);
+	UNUSED_PARAM(data);
+
+	if (LSD_STAT_COMPLETE == stat) {
+		c->received++;
+		// Late echoes of timed out datagrams do not match
+		if (len >= MW_REUSE_HEADLEN + sizeof(c->id) + sizeof(c->seq) &&
+				!memcmp(c->rx.payload, &c->id, sizeof(c->id)) &&
+				!memcmp(c->rx.payload + sizeof(c->id), &c->seq,
+					sizeof(c->seq))) {
+			c->echoed = TRUE;
+			tsk_super_post(TRUE);
+		}
+	}
+	mw_udp_reuse_recv(&c->rx, sizeof(c->rx), c, udp_recv_cb);
+}
+
+static int scenario_setup(struct console *c)
+{
+	switch (cfg.scn) {
+	case SCN_GJ:
+		return gj_init(cfg.endpoint, cfg.game_id, cfg.key, cfg.user,
+				cfg.token, c->gj_buf, sizeof(c->gj_buf),
+				REQ_TOUT) || gj_sessions_open();
+
+	case SCN_GA:
+		return gj_init(cfg.endpoint, cfg.game_id, cfg.key, cfg.user,
+				cfg.token, c->gj_buf, sizeof(c->gj_buf),
+				REQ_TOUT);
+
+	case SCN_UDP:
+		if (mw_udp_set(UDP_CH, NULL, NULL, NULL)) {
+			return -1;
+		}
+		// Sent as is, so in the (big endian) byte order of the console
+		c->tx.remote_ip = cfg.relay_ip;
+		c->tx.remote_port = htons(cfg.relay_port);
+		mw_udp_reuse_recv(&c->rx, sizeof(c->rx), c, udp_recv_cb);
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+/// Runs a request of the scenario. Returns 0 on success.
+static int scenario_step(struct console *c, uint32_t seq)
+{
+	uint32_t len;
+
+	switch (cfg.scn) {
+	case SCN_GJ:
+		switch (seq % 3) {
+		case 0:
+			return gj_sessions_ping(TRUE);
+		case 1:
+			return !gj_trophies_fetch(FALSE, NULL);
+		default:
+			return !gj_scores_fetch("10", NULL, NULL, NULL, NULL,
+					FALSE);
+		}
+
+	case SCN_GA:
+		return !gj_request(&cfg.path, 1, NULL, NULL, 0, &len);
+
+	case SCN_UDP:
+		// Payload starts with the console and sequence numbers, that
+		// the relay echoes back
+		c->seq = seq;
+		c->echoed = FALSE;
+		memcpy(c->tx.payload, &c->id, sizeof(c->id));
+		memcpy(c->tx.payload + sizeof(c->id), &seq, sizeof(seq));
+		if (mw_udp_reuse_send(UDP_CH, &c->tx,
+					MW_REUSE_HEADLEN + cfg.payload_len,
+					NULL, NULL) != LSD_STAT_BUSY) {
+			return -1;
+		}
+		while (!c->echoed) {
+			if (tsk_super_pend(REQ_TOUT)) {
+				return -1;
+			}
+		}
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+static void *console_run(void *arg)
+{
+	struct console *c = arg;
+	int64_t start;
+	int64_t next;
+	int64_t ms;
+	uint32_t seq = 0;
+
+	if (module_connect(c)) {
+		perror(cfg.module);
+		return NULL;
+	}
+	tsk_user_set(user_tsk);
+	if (mw_init(c->cmd_buf, sizeof(c->cmd_buf))) {
+		goto out;
+	}
+	// Spread console starts along the ramp time
+	next = now_ns() + (int64_t)cfg.ramp * 1000000000LL * c->id /
+		cfg.consoles;
+	wait_until(next);
+	if (cfg.stop || mw_detect(NULL, NULL, NULL) || scenario_setup(c)) {
+		goto out;
+	}
+	c->ready = TRUE;
+
+	while (!cfg.stop) {
+		start = now_ns();
+		if (scenario_step(c, seq++)) {
+			c->errors++;
+		} else {
+			c->requests++;
+			ms = (now_ns() - start) / 1000000;
+			c->lat[MIN(ms, LAT_BUCKETS - 1)]++;
+		}
+		next += cfg.interval * FRAME_NS;
+		wait_until(MAX(next, now_ns()));
+	}
+
+out:
+	close(c->fd);
+	uart_host_fd_set(-1);
+	return NULL;
+}
+
+/// Returns the latency in ms under which the specified permille of the
+/// requests completed
+static int lat_get(const uint32_t *lat, uint32_t total, int permille)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < LAT_BUCKETS - 1; i++) {
+		count += lat[i];
+		if (count * 1000 >= (uint64_t)total * permille) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static void results_print(struct console *con, double secs)
+{
+	static uint32_t lat[LAT_BUCKETS];
+	uint32_t requests = 0, errors = 0, received = 0;
+	int ready = 0;
+	int max = 0;
+	int i, j;
+
+	for (i = 0; i < cfg.consoles; i++) {
+		ready += con[i].ready;
+		requests += con[i].requests;
+		errors += con[i].errors;
+		received += con[i].received;
+		for (j = 0; j < LAT_BUCKETS; j++) {
+			lat[j] += con[i].lat[j];
+			if (con[i].lat[j] && j > max) {
+				max = j;
+			}
+		}
+	}
+
+	printf("scenario   %s\n", scenario_str[cfg.scn]);
+	printf("consoles   %d (%d ready)\n", cfg.consoles, ready);
+	printf("duration   %.1f s\n", secs);
+	printf("requests   %u (%.1f/s)\n", requests, requests / secs);
+	printf("errors     %u\n", errors);
+	if (SCN_UDP == cfg.scn) {
+		printf("received   %u (%.1f/s)\n", received, received / secs);
+	}
+	if (requests) {
+		printf("latency    p50 %d ms, p90 %d ms, p99 %d ms, max %d%s ms\n",
+				lat_get(lat, requests, 500),
+				lat_get(lat, requests, 900),
+				lat_get(lat, requests, 990), max,
+				max == LAT_BUCKETS - 1 ? "+" : "");
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options] module_socket\n"
+			"  -n consoles   number of consoles (default 100)\n"
+			"  -t seconds    run length (default 60)\n"
+			"  -R seconds    time to start all consoles (default 0)\n"
+			"  -i frames     frames between requests (default %d)\n"
+			"  -s scenario   gj, ga or udp (default gj)\n"
+			"  -e endpoint   Game API endpoint (gj, ga)\n"
+			"  -g game_id    Game API game ID (gj, ga)\n"
+			"  -k key        Game API private key (gj, ga)\n"
+			"  -u user       Game API user name (gj, ga)\n"
+			"  -T token      Game API user token (gj, ga)\n"
+			"  -p path       Game API path to request (ga)\n"
+			"  -r ip:port    echoing relay address (udp)\n"
+			"  -l length     datagram payload length (udp)\n",
+			name, FPS);
+}
+
+static int scenario_parse(const char *str)
+{
+	int i;
+
+	for (i = 0; i < SCN_MAX; i++) {
+		if (!strcmp(str, scenario_str[i])) {
+			cfg.scn = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int relay_parse(char *str)
+{
+	char *port = strrchr(str, ':');
+
+	if (!port) {
+		return -1;
+	}
+	*port++ = '\0';
+	cfg.relay_ip = inet_addr(str);
+	cfg.relay_port = atoi(port);
+
+	return INADDR_NONE == cfg.relay_ip || !cfg.relay_port;
+}
+
+static int args_parse(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:t:R:i:s:e:g:k:u:T:p:r:l:")) != -1) {
+		switch (opt) {
+		case 'n': cfg.consoles = atoi(optarg); break;
+		case 't': cfg.seconds = atoi(optarg); break;
+		case 'R': cfg.ramp = atoi(optarg); break;
+		case 'i': cfg.interval = atoi(optarg); break;
+		case 'e': cfg.endpoint = optarg; break;
+		case 'g': cfg.game_id = optarg; break;
+		case 'k': cfg.key = optarg; break;
+		case 'u': cfg.user = optarg; break;
+		case 'T': cfg.token = optarg; break;
+		case 'p': cfg.path = optarg; break;
+		case 'l': cfg.payload_len = atoi(optarg); break;
+		case 's':
+			if (scenario_parse(optarg)) {
+				return -1;
+			}
+			break;
+		case 'r':
+			if (relay_parse(optarg)) {
+				return -1;
+			}
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (optind != argc - 1 || cfg.consoles <= 0 || cfg.interval <= 0 ||
+			cfg.payload_len < 8 ||
+			cfg.payload_len > (int)UDP_PAYLOAD_MAX) {
+		return -1;
+	}
+	cfg.module = argv[optind];
+
+	if (SCN_UDP == cfg.scn) {
+		return !cfg.relay_ip;
+	}
+	return !cfg.endpoint || !cfg.game_id || !cfg.key;
+}
+
+int main(int argc, char **argv)
+{
+	struct console *con;
+	pthread_attr_t attr;
+	int64_t start;
+	int i;
+
+	if (args_parse(argc, argv)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	con = calloc(cfg.consoles, sizeof(struct console));
+	if (!con) {
+		perror("calloc");
+		return 1;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, CONSOLE_STACK_LEN);
+
+	start = now_ns();
+	for (i = 0; i < cfg.consoles; i++) {
+		con[i].id = i;
+		con[i].fd = -1;
+		if (pthread_create(&con[i].thread, &attr, console_run, &con[i])) {
+			perror("pthread_create");
+			cfg.consoles = i;
+			break;
+		}
+	}
+	sleep(cfg.ramp + cfg.seconds);
+	cfg.stop = TRUE;
+	for (i = 0; i < cfg.consoles; i++) {
+		pthread_join(con[i].thread, NULL);
+	}
+
+	results_print(con, (now_ns() - start) / 1e9);
+	free(con);
+
+	return 0;
+}
@@ -0,0 +1,60 @@
+-- Wireshark dissector for LSD frames captured with LSD_CAPTURE and
+-- converted with lsd_pcap.py.
+--
+-- Usage: wireshark -X lua_script:tools/lsd.lua capture.pcap
+
+local lsd = Proto("lsd", "MegaWiFi Local Symmetric Data-link")
+
+local directions = { [0] = "RX", [1] = "TX" }
+local link_msgs = { [0x06] = "ACK", [0x15] = "NAK" }
+
+local f_dir = ProtoField.uint8("lsd.dir", "Direction", base.DEC, directions,
+	0x01)
+local f_err = ProtoField.bool("lsd.err", "Error", 8, nil, 0x02)
+local f_crc = ProtoField.bool("lsd.crc", "CRC mode", 8, nil, 0x04)
+local f_ch = ProtoField.uint8("lsd.ch", "Channel", base.DEC)
+local f_seq = ProtoField.uint8("lsd.seq", "Sequence", base.DEC)
+local f_len = ProtoField.uint16("lsd.len", "Length", base.DEC)
+local f_cap = ProtoField.uint16("lsd.cap_len", "Captured", base.DEC)
+local f_link = ProtoField.uint8("lsd.link", "Link message", base.HEX,
+	link_msgs)
+local f_data = ProtoField.bytes("lsd.data", "Payload prefix")
+
+lsd.fields = { f_dir, f_err, f_crc, f_ch, f_seq, f_len, f_cap, f_link, f_data }
+
+function lsd.dissector(buf, pinfo, tree)
+	local flags = buf(0, 1):uint()
+	local ch = buf(1, 1):uint()
+	local crc = bit.band(flags, 0x04) ~= 0
+	local cap_len = buf(6, 2):uint()
+
+	pinfo.cols.protocol = "LSD"
+	local t = tree:add(lsd, buf(), "LSD")
+	t:add(f_dir, buf(0, 1))
+	t:add(f_err, buf(0, 1))
+	t:add(f_crc, buf(0, 1))
+	t:add(f_ch, buf(1, 1))
+	if crc then
+		t:add(f_seq, buf(2, 1))
+	end
+	t:add(f_len, buf(4, 2))
+	t:add(f_cap, buf(6, 2))
+
+	local info = string.format("%s ch %d len %d",
+		directions[bit.band(flags, 0x01)], ch, buf(4, 2):uint())
+	if crc then
+		info = info .. string.format(" seq %d", buf(2, 1):uint())
+	end
+	if crc and (ch == 0x0F or ch == 0xFF) and cap_len > 0 then
+		t:add(f_link, buf(8, 1))
+		info = info .. " " .. (link_msgs[buf(8, 1):uint()] or "?")
+	elseif cap_len > 0 then
+		t:add(f_data, buf(8, cap_len))
+	end
+	if bit.band(flags, 0x02) ~= 0 then
+		info = info .. " [ERROR]"
+	end
+	pinfo.cols.info = info
+end
+
+DissectorTable.get("wtap_encap"):add(wtap.USER0, lsd)
@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""Converts an LSD capture ring dump into a pcap file.
+
+Build the ROM with `make LSD_CAPTURE=1`, dump the RAM (or just the
+`lsd_cap` symbol) from the debugger or emulator, and run:
+
+    lsd_pcap.py ram.bin capture.pcap
+
+The ring is located using its magic number, so a full RAM dump works. Open
+the result in Wireshark with the lsd.lua dissector loaded:
+
+    wireshark -X lua_script:tools/lsd.lua capture.pcap
+
+Each packet carries an 8 byte pseudo-header (flags, channel, sequence number,
+reserved, frame length and captured length, big endian) followed by the
+captured payload prefix. Timestamps are built from the video frame counter
+and the VDP V counter, so they are accurate to the scanline.
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = b'LSDC'
+HEAD_FMT = '>4sHHIHH'
+REC_FMT = '>HHHBBBB'
+LINKTYPE_USER0 = 147
+
+
+def ring_parse(dump):
+    """Returns the records in the ring, oldest first."""
+    off = dump.find(MAGIC)
+    if off < 0:
+        raise ValueError('capture ring magic not found')
+    _, rec_len, rec_num, count, _, _ = struct.unpack_from(HEAD_FMT, dump, off)
+    off += struct.calcsize(HEAD_FMT)
+
+    recs = []
+    first = max(0, count - rec_num)
+    for i in range(first, count):
+        pos = off + (i % rec_num) * rec_len
+        frame, hv, length, ch, flags, seq, cap_len = struct.unpack_from(
+            REC_FMT, dump, pos)
+        data_pos = pos + struct.calcsize(REC_FMT)
+        data = dump[data_pos:data_pos + cap_len]
+        recs.append((frame, hv, length, ch, flags, seq, data))
+
+    return recs, count - first
+
+
+def timestamps(recs, fps, lines):
+    """Builds monotonic timestamps, unwrapping the 16-bit frame counter."""
+    base = 0
+    prev = None
+    for frame, hv, *_ in recs:
+        if prev is not None and frame < prev:
+            base += 0x10000
+        prev = frame
+        yield (base + frame + (hv >> 8) / lines) / fps
+
+
+def pcap_write(out, recs, fps, lines):
+    out.write(struct.pack('<IHHiIII', 0xA1B2C3D4, 2, 4, 0, 0, 65535,
+                          LINKTYPE_USER0))
+    for ts, rec in zip(timestamps(recs, fps, lines), recs):
+        _, _, length, ch, flags, seq, data = rec
+        pkt = struct.pack('>BBBBHH', flags, ch, seq, 0, length,
+                          len(data)) + data
+        sec = int(ts)
+        usec = int((ts - sec) * 1000000)
+        out.write(struct.pack('<IIII', sec, usec, len(pkt), len(pkt)))
+        out.write(pkt)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('dump', help='RAM dump containing the capture ring')
+    parser.add_argument('pcap', help='output pcap file')
+    parser.add_argument('--fps', type=float, default=60,
+                        help='video frames per second (default: 60)')
+    parser.add_argument('--lines', type=int, default=262,
+                        help='scanlines per frame (default: 262)')
+    args = parser.parse_args()
+
+    with open(args.dump, 'rb') as f:
+        dump = f.read()
+    try:
+        recs, num = ring_parse(dump)
+    except (ValueError, struct.error) as e:
+        sys.exit(f'{args.dump}: {e}')
+    with open(args.pcap, 'wb') as out:
+        pcap_write(out, recs, args.fps, args.lines)
+    print(f'{num} frames written to {args.pcap}')
+
+
+if __name__ == '__main__':
+    main()
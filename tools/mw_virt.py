@@ -0,0 +1,958 @@
+#!/usr/bin/env python3
+"""Virtual MegaWiFi module, standing for the WiFi module firmware.
+
+Speaks LSD through a pseudo terminal and implements the commands defined in
+mw/mw-msg.h, backed by real host sockets, HTTP requests and a file-backed
+flash image, so the API can be exercised end to end without hardware:
+
+    mw_virt.py --link /tmp/megawifi --flash flash.bin
+
+Then point the emulator UART (or anything speaking LSD) to /tmp/megawifi.
+
+With --listen, a UNIX socket is served instead, and each connection gets its
+own module in a child process, so many consoles (e.g. the host load
+generator in tools/loadgen) can be served at once. The flash image is shared
+by all of them.
+
+Link configuration requests are accepted with CRC mode, the extended header,
+LZ4 compression and command tags as features, and baud rate changes are
+acknowledged and ignored. Channels enabled with the compression command get
+their frames LZ4 compressed when it saves bytes, with the reference
+compressor if the lz4 package is installed (pip install lz4), or else a
+simple built-in one. Multi-byte fields are big endian, as sent by the
+console (host builds of the library convert them).
+
+In CRC mode, link faults can be injected into the frames sent to the
+console, to exercise the retransmissions: --corrupt, --drop and --dup set
+the probability of each frame being corrupted, lost or sent twice. To
+exercise the matching of command replies, --reorder sets the probability
+of a tagged reply being sent after the next one, and --no-tags refuses
+command tags, so the console falls back to one command at a time.
+"""
+
+import argparse
+import binascii
+import hashlib
+import http.client
+import os
+import random
+import selectors
+import signal
+import socket
+import ssl
+import struct
+import sys
+import time
+import tty
+import urllib.parse
+
+try:
+    import lz4.block
+except ImportError:
+    lz4 = None
+
+STX_ETX = 0x7E
+MAX_LEN = 4095
+MAX_CH = 4
+CTRL_CH = 0
+HTTP_CH = MAX_CH - 1
+# Content length reported for bodies of unknown length (chunked)
+HTTP_LEN_UNKNOWN = 0x7FFFFFFF
+CMD_MAX_BUFLEN = 508
+
+CMD_OK = 0
+CMD_VERSION = 1
+CMD_ECHO = 2
+CMD_AP_CFG_GET = 5
+CMD_IP_CURRENT = 6
+CMD_IP_CFG_GET = 9
+CMD_DEF_AP_CFG_GET = 11
+CMD_TCP_CON = 14
+CMD_TCP_BIND = 15
+CMD_CLOSE = 17
+CMD_UDP_SET = 18
+CMD_SOCK_STAT = 20
+CMD_DATETIME = 24
+CMD_FLASH_WRITE = 26
+CMD_FLASH_READ = 27
+CMD_FLASH_ERASE = 28
+CMD_FLASH_ID = 29
+CMD_SYS_STAT = 30
+CMD_HRNG_GET = 32
+CMD_BSSID_GET = 33
+CMD_HTTP_URL_SET = 39
+CMD_HTTP_METHOD_SET = 40
+CMD_HTTP_CERT_QUERY = 41
+CMD_HTTP_CERT_SET = 42
+CMD_HTTP_HDR_ADD = 43
+CMD_HTTP_HDR_DEL = 44
+CMD_HTTP_OPEN = 45
+CMD_HTTP_FINISH = 46
+CMD_HTTP_CLEANUP = 47
+CMD_GAME_ENDPOINT_SET = 56
+CMD_GAME_KEYVAL_ADD = 57
+CMD_GAME_REQUEST = 58
+CMD_LINK_CFG = 59
+CMD_CH_COMPRESS = 61
+CMD_ERROR = 255
+
+LINK_CRC = 1
+LINK_EXT_CH = 2
+LINK_LZ4 = 4
+LINK_CMD_TAG = 8
+
+# Link control frames (CRC mode), standard and extended header
+LINK_CH = 0x0F
+LINK_CH_EXT = 0xFF
+LINK_ACK = 0x06
+LINK_NAK = 0x15
+# Frames sent and not acknowledged, and time to wait before resending them
+TX_WINDOW = 8
+RETX_TIMEOUT = 0.5
+# Seconds a reordered reply waits for the next one before being sent anyway
+REORDER_HOLD = 0.05
+
+# LENH flag of compressed frames (extended header)
+LENH_LZ = 0x80
+# LZ4 block format limits: minimum match, literals at the end of the block,
+# and distance from the end of the block to the start of the last match
+LZ4_MIN_MATCH = 4
+LZ4_LAST_LITERALS = 5
+LZ4_MF_LIMIT = 12
+
+SOCK_NONE = 0
+SOCK_TCP_LISTEN = 1
+SOCK_TCP_EST = 2
+SOCK_UDP_READY = 3
+
+ST_READY = 4
+SECTOR_LEN = 4096
+FLASH_ID = (0x4016, 0xEF)
+
+HTTP_METHODS = ('GET', 'POST', 'PUT', 'PATCH', 'DELETE', 'HEAD', 'NOTIFY',
+                'SUBSCRIBE', 'UNSUBSCRIBE', 'OPTIONS')
+
+
+class CmdError(Exception):
+    """Command failed, reply with CMD_ERROR."""
+
+
+def strings(data, num=None):
+    """Splits a buffer of NULL terminated strings."""
+    items = [s.decode('latin-1') for s in bytes(data).split(b'\0')]
+    return items[:num] if num is not None else items[:-1]
+
+
+def cstr(data):
+    return strings(data, 1)[0]
+
+
+class Flash:
+    """File-backed flash image, with NOR semantics."""
+
+    def __init__(self, path, size):
+        self.path = path
+        self.size = size
+        if not os.path.exists(path):
+            with open(path, 'wb') as f:
+                f.write(b'\xff' * size)
+
+    def _check(self, addr, length):
+        if addr + length > self.size:
+            raise CmdError(f'flash access out of range: {addr:#x}')
+
+    def read(self, addr, length):
+        self._check(addr, length)
+        with open(self.path, 'rb') as f:
+            f.seek(addr)
+            return f.read(length).ljust(length, b'\xff')
+
+    def write(self, addr, data):
+        # Writing can only clear bits
+        old = self.read(addr, len(data))
+        with open(self.path, 'r+b') as f:
+            f.seek(addr)
+            f.write(bytes(a & b for a, b in zip(old, data)))
+
+    def erase(self, sect):
+        addr = sect * SECTOR_LEN
+        self._check(addr, SECTOR_LEN)
+        with open(self.path, 'r+b') as f:
+            f.seek(addr)
+            f.write(b'\xff' * SECTOR_LEN)
+
+
+class Socket:
+    """Host socket bound to an LSD channel."""
+
+    def __init__(self, sock, stat, dst=None, reuse=False):
+        self.sock = sock
+        self.stat = stat
+        self.dst = dst
+        self.reuse = reuse
+        self.listen = None
+
+
+class Faults:
+    """Link faults injected into the frames sent in CRC mode, and tagged
+    command replies sent out of order."""
+
+    def __init__(self, corrupt=0, drop=0, dup=0, seed=None, reorder=0):
+        self.corrupt = corrupt
+        self.drop = drop
+        self.dup = dup
+        self.reorder = reorder
+        self.rand = random.Random(seed)
+        self.count = {'corrupt': 0, 'drop': 0, 'dup': 0, 'reorder': 0}
+
+    def hold(self):
+        """Returns if a reply is sent after the next one."""
+        if self.rand.random() < self.reorder:
+            self.count['reorder'] += 1
+            return True
+        return False
+
+    def apply(self, frame):
+        """Returns the byte strings to write for a frame."""
+        if self.rand.random() < self.drop:
+            self.count['drop'] += 1
+            return []
+        if self.rand.random() < self.corrupt:
+            self.count['corrupt'] += 1
+            # Any byte but STX and ETX, so framing is kept
+            pos = self.rand.randrange(1, len(frame) - 1)
+            frame = bytearray(frame)
+            frame[pos] ^= 1 << self.rand.randrange(8)
+            frame = bytes(frame)
+        if self.rand.random() < self.dup:
+            self.count['dup'] += 1
+            return [frame, frame]
+        return [frame]
+
+
+def crc16(data):
+    """CRC-16/CCITT with 0xFFFF initial value, as used in LSD frames."""
+    return binascii.crc_hqx(data, 0xFFFF)
+
+
+def int8(value):
+    return ((value + 0x80) & 0xFF) - 0x80
+
+
+def lz4_len(out, length):
+    """Appends the extension bytes of a sequence length."""
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def lz4_sequence(out, literals, offset=0, match=0):
+    """Appends an LZ4 sequence. The last one has no match (no offset)."""
+    mlen = match - LZ4_MIN_MATCH if offset else 0
+    out.append(min(len(literals), 15) << 4 | min(mlen, 15))
+    if len(literals) >= 15:
+        lz4_len(out, len(literals) - 15)
+    out += literals
+    if offset:
+        out += offset.to_bytes(2, 'little')
+        if mlen >= 15:
+            lz4_len(out, mlen - 15)
+
+
+def lz4_compress(data):
+    """Compresses data as an LZ4 block, with greedy 4 byte matches."""
+    out = bytearray()
+    last = {}
+    anchor = pos = 0
+    while pos < len(data) - LZ4_MF_LIMIT:
+        key = data[pos:pos + LZ4_MIN_MATCH]
+        cand = last.get(key)
+        last[key] = pos
+        if cand is None or pos - cand > 0xFFFF:
+            pos += 1
+            continue
+        match = LZ4_MIN_MATCH
+        match_max = len(data) - LZ4_LAST_LITERALS - pos
+        while match < match_max and data[cand + match] == data[pos + match]:
+            match += 1
+        lz4_sequence(out, data[anchor:pos], pos - cand, match)
+        pos += match
+        anchor = pos
+    lz4_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def lz4_block(data):
+    """Compresses data as an LZ4 block, with the reference compressor if
+    the lz4 package is installed."""
+    if lz4:
+        return lz4.block.compress(data, store_size=False)
+    return lz4_compress(data)
+
+
+class Link:
+    """LSD framing over the pseudo terminal."""
+
+    def __init__(self, fd, on_frame, faults=None, log=None):
+        self.fd = fd
+        self.on_frame = on_frame
+        self.faults = faults
+        self.log = log or (lambda msg: None)
+        self.stat = 'stx'
+        self.ch = 0
+        self.len = 0
+        self.data = bytearray()
+        self.ext_set(False)
+        self.crc_set(False)
+
+    def crc_set(self, enable):
+        """Enables or disables CRC mode, with a fresh sequence."""
+        self.crc = enable
+        self.tx_seq = 0
+        self.rx_seq = 0
+        self.unacked = []
+        self.queue = []
+        self.tx_time = None
+
+    def ext_set(self, enable, lz=False):
+        """Selects the header format, and if compression is allowed."""
+        self.ext = enable
+        self.lz = enable and lz
+        self.link_ch = LINK_CH_EXT if enable else LINK_CH
+        self.compress = set()
+
+    def header(self, ch, length, lz=False):
+        if self.ext:
+            return bytes((ch, (LENH_LZ if lz else 0) | length >> 8,
+                          length & 0xFF))
+        return bytes(((ch << 4) | (length >> 8), length & 0xFF))
+
+    def payload(self, ch, chunk):
+        """Returns the payload to send, compressed if enabled and smaller,
+        and if it is compressed."""
+        if not self.lz or ch not in self.compress or not chunk:
+            return chunk, False
+        comp = len(chunk).to_bytes(2, 'big') + lz4_block(chunk)
+        if len(comp) >= len(chunk):
+            return chunk, False
+        self.log(f'channel {ch}: {len(chunk)} bytes compressed to '
+                 f'{len(comp)}')
+        return comp, True
+
+    def write(self, frame):
+        while frame:
+            frame = frame[os.write(self.fd, frame):]
+
+    def emit(self, ch, data, seq=None, lz=False):
+        hdr = self.header(ch, len(data), lz)
+        if seq is None:
+            self.write(bytes((STX_ETX,)) + hdr + data + bytes((STX_ETX,)))
+            return
+        body = hdr + bytes((seq,)) + data
+        frame = bytes((STX_ETX,)) + body + \
+            crc16(body).to_bytes(2, 'big') + bytes((STX_ETX,))
+        for part in self.faults.apply(frame) if self.faults else [frame]:
+            self.write(part)
+
+    def send(self, ch, data=b''):
+        for pos in range(0, max(len(data), 1), MAX_LEN):
+            chunk, lz = self.payload(ch, data[pos:pos + MAX_LEN])
+            if self.crc:
+                self.queue.append((ch, chunk, lz))
+            else:
+                self.emit(ch, chunk, lz=lz)
+        self.flush()
+
+    def flush(self):
+        """Sends queued frames while the window has room."""
+        while self.queue and len(self.unacked) < TX_WINDOW:
+            ch, chunk, lz = self.queue.pop(0)
+            self.emit(ch, chunk, (self.tx_seq + len(self.unacked)) & 0xFF,
+                      lz)
+            self.unacked.append((ch, chunk, lz))
+            self.tx_time = time.monotonic()
+
+    def resend(self):
+        """Sends again all frames not acknowledged (go-back-N)."""
+        for i, (ch, chunk, lz) in enumerate(self.unacked):
+            self.emit(ch, chunk, (self.tx_seq + i) & 0xFF, lz)
+        self.tx_time = time.monotonic()
+
+    def ack(self, seq):
+        while self.unacked and int8(seq - self.tx_seq) >= 0:
+            self.unacked.pop(0)
+            self.tx_seq = (self.tx_seq + 1) & 0xFF
+        self.tx_time = time.monotonic()
+        self.flush()
+
+    def timeout(self):
+        """Seconds until frames not acknowledged are resent, or None."""
+        if not self.unacked:
+            return None
+        return max(0, self.tx_time + RETX_TIMEOUT - time.monotonic())
+
+    def poll(self):
+        if self.unacked and self.timeout() == 0:
+            self.log(f'resending {len(self.unacked)} frames on timeout')
+            self.resend()
+
+    def link_msg(self, msg, seq):
+        self.emit(self.link_ch, bytes((msg,)), seq & 0xFF)
+
+    def check(self, seq, crc):
+        """Checks a frame received in CRC mode, answering it."""
+        ahead = int8(seq - self.rx_seq)
+        if crc != crc16(self.hdr + bytes((seq,)) + self.data):
+            self.log('CRC error')
+            self.link_msg(LINK_NAK, self.rx_seq)
+        elif self.ch == self.link_ch:
+            if self.data == bytes((LINK_ACK,)):
+                self.ack(seq)
+            elif self.data == bytes((LINK_NAK,)):
+                self.log(f'resending from frame {seq} on NAK')
+                self.ack(seq - 1)
+                self.resend()
+        elif ahead > 0:
+            self.link_msg(LINK_NAK, self.rx_seq)
+        elif ahead < 0:
+            self.link_msg(LINK_ACK, self.rx_seq - 1)
+        else:
+            self.link_msg(LINK_ACK, self.rx_seq)
+            self.rx_seq = (self.rx_seq + 1) & 0xFF
+            self.on_frame(self.ch, bytes(self.data))
+
+    def recv(self):
+        data = os.read(self.fd, 4096)
+        if not data:
+            raise EOFError
+        for byte in data:
+            if self.stat == 'stx':
+                if byte == STX_ETX:
+                    self.stat = 'ch' if self.ext else 'ch_lenh'
+            elif self.stat == 'ch':
+                # ETX from previous frame followed by STX
+                if byte != STX_ETX:
+                    self.ch = byte
+                    self.hdr = bytes((byte,))
+                    self.stat = 'lenh'
+            elif self.stat == 'lenh':
+                # The console does not compress, so LENH is just length
+                self.len = (byte & 0x0F) << 8
+                self.hdr += bytes((byte,))
+                self.stat = 'len'
+            elif self.stat == 'ch_lenh':
+                # ETX from previous frame followed by STX
+                if byte != STX_ETX:
+                    self.ch = byte >> 4
+                    self.len = (byte & 0x0F) << 8
+                    self.hdr = bytes((byte,))
+                    self.stat = 'len'
+            elif self.stat == 'len':
+                self.len |= byte
+                self.hdr += bytes((byte,))
+                self.data = bytearray()
+                if self.crc:
+                    self.stat = 'seq'
+                else:
+                    self.stat = 'data' if self.len else 'etx'
+            elif self.stat == 'seq':
+                self.seq = byte
+                self.stat = 'data' if self.len else 'crch'
+            elif self.stat == 'data':
+                self.data.append(byte)
+                if len(self.data) == self.len:
+                    self.stat = 'crch' if self.crc else 'etx'
+            elif self.stat == 'crch':
+                self.crc_rx = byte << 8
+                self.stat = 'crcl'
+            elif self.stat == 'crcl':
+                self.crc_rx |= byte
+                self.stat = 'etx'
+            else:
+                if byte != STX_ETX:
+                    # Framing error, ask for the frame again
+                    if self.crc:
+                        self.link_msg(LINK_NAK, self.rx_seq)
+                elif self.crc:
+                    self.check(self.seq, self.crc_rx)
+                else:
+                    self.on_frame(self.ch, bytes(self.data))
+                self.stat = 'stx'
+
+
+class Module:
+    """WiFi module command and data processing."""
+
+    def __init__(self, fd, flash, verbose, faults=None, tags=True):
+        self.flash = flash
+        self.verbose = verbose
+        self.faults = faults
+        self.link = Link(fd, self.frame, faults, self.log)
+        self.features = None
+        self.tags = tags
+        # Reply held to be sent after the next one, and when it was held
+        self.held = None
+        self.held_time = None
+        self.sel = selectors.DefaultSelector()
+        self.sel.register(fd, selectors.EVENT_READ, self.link.recv)
+        self.socks = {}
+        self.http_reset()
+        self.cert = None
+        self.cert_hash = 0xFFFFFFFF
+        self.cert_pend = 0
+        self.ga_endpoint = None
+        self.ga_key = None
+        self.ga_kv = []
+        self.handlers = {
+            CMD_VERSION: lambda _: bytes((1, 5, 0)) + b'virtual\0',
+            CMD_ECHO: lambda data: data,
+            CMD_AP_CFG_GET: self.ap_cfg_get,
+            CMD_IP_CURRENT: self.ip_cfg_get,
+            CMD_IP_CFG_GET: self.ip_cfg_get,
+            CMD_DEF_AP_CFG_GET: lambda _: b'\0',
+            CMD_TCP_CON: self.tcp_con,
+            CMD_TCP_BIND: self.tcp_bind,
+            CMD_CLOSE: lambda data: self.close(data[0]),
+            CMD_UDP_SET: self.udp_set,
+            CMD_SOCK_STAT: self.sock_stat,
+            CMD_DATETIME: self.datetime,
+            CMD_FLASH_WRITE: self.flash_write,
+            CMD_FLASH_READ: self.flash_read,
+            CMD_FLASH_ERASE: self.flash_erase,
+            CMD_FLASH_ID: lambda _: struct.pack('>HB', *FLASH_ID),
+            CMD_SYS_STAT: self.sys_stat,
+            CMD_HRNG_GET: self.hrng_get,
+            CMD_BSSID_GET: lambda _: b'\x02\x00\x00\x4d\x57\x00',
+            CMD_HTTP_URL_SET: self.http_url_set,
+            CMD_HTTP_METHOD_SET: self.http_method_set,
+            CMD_HTTP_CERT_QUERY: lambda _: struct.pack('>I', self.cert_hash),
+            CMD_HTTP_CERT_SET: self.http_cert_set,
+            CMD_HTTP_HDR_ADD: self.http_hdr_add,
+            CMD_HTTP_HDR_DEL: self.http_hdr_del,
+            CMD_HTTP_OPEN: self.http_open,
+            CMD_HTTP_FINISH: self.http_finish,
+            CMD_HTTP_CLEANUP: lambda _: self.http_reset(),
+            CMD_GAME_ENDPOINT_SET: self.ga_endpoint_set,
+            CMD_GAME_KEYVAL_ADD: self.ga_keyval_add,
+            CMD_GAME_REQUEST: self.ga_request,
+            CMD_LINK_CFG: self.link_cfg,
+            CMD_CH_COMPRESS: self.ch_compress,
+        }
+
+    def log(self, msg):
+        if self.verbose:
+            print(msg, file=sys.stderr)
+
+    def run(self):
+        while True:
+            for key, _ in self.sel.select(self.timeout()):
+                key.data()
+            self.link.poll()
+            if self.held and self.timeout() == 0:
+                self.log('sending held reply on timeout')
+                self.release()
+
+    def timeout(self):
+        """Seconds until something has to be sent, or None."""
+        timeouts = [self.link.timeout()]
+        if self.held:
+            timeouts.append(max(0, self.held_time + REORDER_HOLD -
+                                time.monotonic()))
+        return min((t for t in timeouts if t is not None), default=None)
+
+    def release(self):
+        """Sends the held reply, if any."""
+        if self.held:
+            self.link.send(CTRL_CH, self.held)
+            self.held = None
+
+    def frame(self, ch, data):
+        if ch == CTRL_CH:
+            self.command(data)
+        elif ch == HTTP_CH and (self.cert_pend or self.http['open']):
+            self.http_data(data)
+        elif ch in self.socks:
+            self.sock_send(self.socks[ch], data)
+        else:
+            self.log(f'dropped {len(data)} bytes on channel {ch}')
+
+    def command(self, data):
+        if len(data) < 4:
+            return
+        cmd, length = struct.unpack_from('>HH', data)
+        # Tag (if any) is echoed in the reply
+        tag, cmd = cmd >> 8, cmd & 0xFF
+        handler = self.handlers.get(cmd)
+        self.log(f'command {cmd}, {length} bytes')
+        try:
+            # Commands not modelled just succeed
+            reply = handler(data[4:4 + length]) if handler else None
+            reply = reply or b''
+            code = CMD_OK
+        except (CmdError, OSError, ValueError, IndexError,
+                struct.error) as e:
+            self.log(f'command {cmd} failed: {e}')
+            reply = b''
+            code = CMD_ERROR
+        if isinstance(reply, tuple):
+            # Reply followed by data on another channel
+            reply, ch, *payloads = reply
+        else:
+            ch = None
+        reply = struct.pack('>HH', code | tag << 8, len(reply)) + \
+            reply[:CMD_MAX_BUFLEN]
+        if tag and ch is None and not self.held and self.faults and \
+                self.faults.hold():
+            # Tags let the console match replies sent out of order
+            self.log(f'holding reply to command {cmd}, tag {tag}')
+            self.held = reply
+            self.held_time = time.monotonic()
+        else:
+            self.link.send(CTRL_CH, reply)
+            self.release()
+        if ch is not None:
+            for payload in payloads:
+                self.link.send(ch, payload)
+        if self.features is not None:
+            # Link changes apply after the reply, as done by the console
+            self.link.ext_set(bool(self.features & LINK_EXT_CH),
+                              bool(self.features & LINK_LZ4))
+            self.link.crc_set(bool(self.features & LINK_CRC))
+            self.features = None
+
+    # Configuration
+
+    def link_cfg(self, data):
+        features, = struct.unpack_from('>H', data)
+        if not features & LINK_EXT_CH:
+            # Compression flag only fits in the extended header
+            features &= ~LINK_LZ4
+        self.features = features & (LINK_CRC | LINK_EXT_CH | LINK_LZ4 |
+                                    (LINK_CMD_TAG if self.tags else 0))
+        return struct.pack('>HH', self.features, 0)
+
+    def ch_compress(self, data):
+        ch, enable = data[0], data[1]
+        if not self.link.lz:
+            raise CmdError('LZ4 not enabled on the link')
+        if enable:
+            self.link.compress.add(ch)
+        else:
+            self.link.compress.discard(ch)
+
+    def ap_cfg_get(self, data):
+        return struct.pack('>BB32s64s', data[0], 7, b'virtual', b'')
+
+    def ip_cfg_get(self, data):
+        ip = [socket.inet_aton(a) for a in
+              ('127.0.0.1', '255.0.0.0', '127.0.0.1', '127.0.0.1',
+               '0.0.0.0')]
+        return bytes(4) + b''.join(ip)
+
+    def sys_stat(self, _):
+        # Status, online, cfg_ok and dt_ok flags, and channel events
+        return struct.pack('>I', ST_READY << 24 | 0xE0 << 16)
+
+    def datetime(self, _):
+        now = int(time.time())
+        return struct.pack('>Q', now) + time.ctime(now).encode()
+
+    def hrng_get(self, data):
+        length, = struct.unpack('>H', data[:2])
+        return os.urandom(min(length, CMD_MAX_BUFLEN))
+
+    # Flash
+
+    def flash_write(self, data):
+        addr, = struct.unpack_from('>I', data)
+        self.flash.write(addr, data[4:])
+
+    def flash_read(self, data):
+        addr, length = struct.unpack_from('>IH', data)
+        return self.flash.read(addr, min(length, CMD_MAX_BUFLEN))
+
+    def flash_erase(self, data):
+        sect, = struct.unpack_from('>H', data)
+        self.flash.erase(sect)
+
+    # Sockets
+
+    def sock_add(self, ch, sock):
+        if ch in self.socks:
+            self.close(ch)
+        self.socks[ch] = sock
+        sock.sock.setblocking(False)
+        self.sel.register(sock.sock, selectors.EVENT_READ,
+                          lambda: self.sock_recv(ch))
+
+    def tcp_con(self, data):
+        dst_port, src_port = strings(data[:6], 1)[0], strings(data[6:12], 1)[0]
+        ch = data[12]
+        addr = cstr(data[13:])
+        sock = socket.create_connection(
+            (addr, int(dst_port)), timeout=5,
+            source_address=('', int(src_port)) if src_port else None)
+        self.sock_add(ch, Socket(sock, SOCK_TCP_EST))
+
+    def tcp_bind(self, data):
+        _, port, ch = struct.unpack_from('>IHB', data)
+        srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        srv.bind(('', port))
+        srv.listen(1)
+        if ch in self.socks:
+            self.close(ch)
+        sock = Socket(None, SOCK_TCP_LISTEN)
+        sock.listen = srv
+        self.socks[ch] = sock
+        self.sel.register(srv, selectors.EVENT_READ,
+                          lambda: self.tcp_accept(ch))
+
+    def tcp_accept(self, ch):
+        sock = self.socks[ch]
+        conn, addr = sock.listen.accept()
+        self.log(f'channel {ch}: connection from {addr}')
+        self.sel.unregister(sock.listen)
+        sock.listen.close()
+        del self.socks[ch]
+        self.sock_add(ch, Socket(conn, SOCK_TCP_EST))
+
+    def udp_set(self, data):
+        dst_port, src_port = strings(data[:6], 1)[0], strings(data[6:12], 1)[0]
+        ch = data[12]
+        addr = cstr(data[13:])
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        if src_port:
+            sock.bind(('', int(src_port)))
+        # With no destination, the peer address goes with the data
+        reuse = not addr
+        dst = None if reuse else (addr, int(dst_port))
+        self.sock_add(ch, Socket(sock, SOCK_UDP_READY, dst, reuse))
+
+    def close(self, ch):
+        sock = self.socks.pop(ch, None)
+        if not sock:
+            return
+        for s in (sock.sock, sock.listen):
+            if s:
+                self.sel.unregister(s)
+                s.close()
+
+    def sock_stat(self, data):
+        sock = self.socks.get(data[0])
+        return bytes((sock.stat if sock else SOCK_NONE,))
+
+    def sock_send(self, sock, data):
+        if sock.stat == SOCK_TCP_EST:
+            sock.sock.sendall(data)
+        elif sock.reuse:
+            ip, port = struct.unpack_from('>4sH', data)
+            sock.sock.sendto(data[6:], (socket.inet_ntoa(ip), port))
+        elif sock.stat == SOCK_UDP_READY:
+            sock.sock.sendto(data, sock.dst)
+
+    def sock_recv(self, ch):
+        sock = self.socks[ch]
+        if sock.stat == SOCK_TCP_EST:
+            data = sock.sock.recv(MAX_LEN)
+            if not data:
+                # Remote end closed, signalled with an empty frame
+                self.close(ch)
+            self.link.send(ch, data)
+            return
+        data, (ip, port) = sock.sock.recvfrom(MAX_LEN)
+        if sock.reuse:
+            data = struct.pack('>4sH', socket.inet_aton(ip), port) + \
+                data[:MAX_LEN - 6]
+        self.link.send(ch, data)
+
+    # HTTP
+
+    def http_reset(self):
+        self.http = {'url': None, 'method': 'GET', 'headers': {},
+                     'open': False, 'body': bytearray(), 'len': 0}
+
+    def http_url_set(self, data):
+        self.http['url'] = cstr(data)
+
+    def http_method_set(self, data):
+        self.http['method'] = HTTP_METHODS[data[0]]
+
+    def http_hdr_add(self, data):
+        key, value = strings(data, 2)
+        self.http['headers'][key] = value
+
+    def http_hdr_del(self, data):
+        self.http['headers'].pop(cstr(data), None)
+
+    def http_cert_set(self, data):
+        self.cert_hash, self.cert_pend = struct.unpack_from('>IH', data)
+        self.cert = bytearray()
+
+    def http_open(self, data):
+        self.http['len'], = struct.unpack_from('>I', data)
+        self.http['open'] = True
+        self.http['body'] = bytearray()
+
+    def http_data(self, data):
+        if self.cert_pend:
+            self.cert += data
+            self.cert_pend = max(0, self.cert_pend - len(data))
+        else:
+            self.http['body'] += data
+
+    def ssl_context(self):
+        if self.cert:
+            return ssl.create_default_context(
+                cadata=bytes(self.cert).decode('latin-1'))
+        return ssl.create_default_context()
+
+    def http_request(self, method, url, headers=None, body=None):
+        """Performs the request, returning the reply and the body."""
+        parts = urllib.parse.urlsplit(url)
+        if parts.scheme == 'https':
+            conn = http.client.HTTPSConnection(parts.netloc, timeout=30,
+                                               context=self.ssl_context())
+        else:
+            conn = http.client.HTTPConnection(parts.netloc, timeout=30)
+        path = parts.path or '/'
+        if parts.query:
+            path += '?' + parts.query
+        try:
+            conn.request(method, path, body=bytes(body or b''),
+                         headers=headers or {})
+            resp = conn.getresponse()
+            payload = resp.read()
+        except (OSError, http.client.HTTPException) as e:
+            raise CmdError(f'{method} {url}: {e}') from e
+        finally:
+            conn.close()
+        self.log(f'{method} {url}: {resp.status}, {len(payload)} bytes')
+        # Content length and status code, then the body on the HTTP channel
+        if not resp.chunked:
+            return (struct.pack('>IH', len(payload), resp.status),
+                    HTTP_CH, payload)
+        # Chunked body length is unknown, an empty frame marks its end
+        payloads = (payload, b'') if payload else (b'',)
+        return (struct.pack('>IH', HTTP_LEN_UNKNOWN, resp.status),
+                HTTP_CH, *payloads)
+
+    def http_finish(self, _):
+        if not self.http['url']:
+            raise CmdError('no URL set')
+        self.http['open'] = False
+        return self.http_request(self.http['method'], self.http['url'],
+                                 self.http['headers'], self.http['body'])
+
+    # Game API
+
+    def ga_endpoint_set(self, data):
+        self.ga_endpoint, self.ga_key = strings(data, 2)
+
+    def ga_keyval_add(self, data):
+        items = strings(data)
+        self.ga_kv = list(zip(items[0::2], items[1::2]))
+
+    def ga_request(self, data):
+        if not self.ga_endpoint:
+            raise CmdError('no endpoint set')
+        method, num_paths, num_kv = data[0], data[1], data[2]
+        items = strings(data[3:], num_paths + 2 * num_kv)
+        paths = items[:num_paths]
+        kv = list(zip(items[num_paths::2], items[num_paths + 1::2]))
+        url = (self.ga_endpoint + '/'.join(paths) + '/?' +
+               urllib.parse.urlencode(self.ga_kv + kv))
+        # Requests are signed hashing the URL and the private key
+        sig = hashlib.md5((url + self.ga_key).encode()).hexdigest()
+        return self.http_request(HTTP_METHODS[method],
+                                 url + '&signature=' + sig)
+
+
+def pty_open(link):
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    path = os.ttyname(slave)
+    if link:
+        if os.path.islink(link):
+            os.unlink(link)
+        os.symlink(path, link)
+        path = link
+    # Slave is kept open, so the module survives clients reconnecting
+    return master, slave, path
+
+
+def serve(path, flash, verbose, faults, tags):
+    """Runs a module for each connection to a UNIX socket."""
+    if os.path.exists(path):
+        os.unlink(path)
+    srv = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    srv.bind(path)
+    srv.listen(socket.SOMAXCONN)
+    signal.signal(signal.SIGCHLD, signal.SIG_IGN)
+    print(f'MegaWiFi virtual modules on {path}', flush=True)
+    while True:
+        conn, _ = srv.accept()
+        if os.fork():
+            conn.close()
+            continue
+        srv.close()
+        try:
+            Module(conn.fileno(), flash, verbose, faults, tags).run()
+        except (EOFError, OSError):
+            pass
+        os._exit(0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--link', help='symlink to the pseudo terminal')
+    parser.add_argument('--listen', metavar='PATH',
+                        help='serve a module per connection to a UNIX socket')
+    parser.add_argument('--flash', default='mw_flash.bin',
+                        help='flash image file (default: mw_flash.bin)')
+    parser.add_argument('--flash-size', type=int, default=0x100000,
+                        help='flash image length (default: 1 MiB)')
+    parser.add_argument('--corrupt', type=float, default=0, metavar='P',
+                        help='probability of corrupting a frame (CRC mode)')
+    parser.add_argument('--drop', type=float, default=0, metavar='P',
+                        help='probability of losing a frame (CRC mode)')
+    parser.add_argument('--dup', type=float, default=0, metavar='P',
+                        help='probability of sending a frame twice '
+                        '(CRC mode)')
+    parser.add_argument('--reorder', type=float, default=0, metavar='P',
+                        help='probability of sending a tagged command reply '
+                        'after the next one')
+    parser.add_argument('--no-tags', action='store_true',
+                        help='refuse command tags, so replies are matched '
+                        'in order')
+    parser.add_argument('--seed', type=int,
+                        help='random seed for the injected faults')
+    parser.add_argument('-v', '--verbose', action='store_true',
+                        help='log commands and data to stderr')
+    args = parser.parse_args()
+
+    flash = Flash(args.flash, args.flash_size)
+    faults = Faults(args.corrupt, args.drop, args.dup, args.seed,
+                    args.reorder)
+    if args.listen:
+        try:
+            serve(args.listen, flash, args.verbose, faults, not args.no_tags)
+        except KeyboardInterrupt:
+            pass
+        return
+
+    master, _, path = pty_open(args.link)
+    print(f'MegaWiFi virtual module on {path}', flush=True)
+    module = Module(master, flash, args.verbose, faults, not args.no_tags)
+    try:
+        module.run()
+    except KeyboardInterrupt:
+        pass
+    if any(faults.count.values()):
+        print('injected faults: ' + ', '.join(
+            f'{n} {k}' for k, n in faults.count.items()), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
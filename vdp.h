@@ -51,6 +51,8 @@
 #define VDP_CTRL_PORT_DW (*((volatile uint32_t*)VDP_CTRL_PORT_ADDR))
 /// VDP scanline counter port, WORD access
 #define VDP_HV_COUNT_W   (*((volatile uint16_t*)VDP_HV_COUNT_ADDR))
+/// VDP vertical counter (current scanline), BYTE access
+#define VDP_V_COUNT_B    (*((volatile uint8_t*)VDP_HV_COUNT_ADDR))
 /** \} */
 
 /// Build color in CRAM format, with 3-bit g, b and b components